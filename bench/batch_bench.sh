@@ -0,0 +1,34 @@
+#!/bin/sh
+# Runs a generated batch script through each given ash binary and reports commands/sec.
+# Usage: bench/batch_bench.sh [-n lines] ash [ash...]
+set -e
+
+lines=10000
+if [ "$1" = "-n" ]; then
+	lines=$2
+	shift 2
+fi
+if [ $# -eq 0 ]; then
+	echo "Usage: $0 [-n lines] ash [ash...]" >&2
+	exit 1
+fi
+
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+i=0
+while [ $i -lt "$lines" ]; do
+	case $((i % 4)) in
+		0) echo "true" ;;
+		1) echo "echo line $i > /dev/null" ;;
+		2) echo "echo line $i | cat > /dev/null" ;;
+		3) echo "ls / > /dev/null" ;;
+	esac
+	i=$((i + 1))
+done > "$script"
+
+for ash in "$@"; do
+	start=$(date +%s.%N)
+	"$ash" "$script" > /dev/null
+	end=$(date +%s.%N)
+	echo "$ash" "$lines" "$start" "$end" | awk '{ printf "%s: %d lines in %.2fs, %.0f commands/sec\n", $1, $2, $4 - $3, $2 / ($4 - $3) }'
+done
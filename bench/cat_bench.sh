@@ -0,0 +1,43 @@
+#!/bin/sh
+# Pipes a generated log file through grep and wc via ash, once with the builtin cat and once
+# with /bin/cat, and reports MB/sec for each pipeline.
+# Usage: bench/cat_bench.sh [-s MiB] ash
+set -e
+
+size=2048
+if [ "$1" = "-s" ]; then
+	size=$2
+	shift 2
+fi
+if [ $# -ne 1 ]; then
+	echo "Usage: $0 [-s MiB] ash" >&2
+	exit 1
+fi
+ash=$1
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+log="$dir/log"
+i=0
+while [ $i -lt 1000 ]; do
+	echo "2024-01-01T00:00:$((i % 60)) INFO request $i served in $((i % 97))ms"
+	[ $((i % 10)) -eq 0 ] && echo "2024-01-01T00:00:$((i % 60)) ERROR request $i failed"
+	i=$((i + 1))
+done > "$log"
+while [ "$(stat -c %s "$log")" -lt $((size * 1024 * 1024)) ]; do
+	cat "$log" "$log" > "$dir/double"
+	mv "$dir/double" "$log"
+done
+bytes=$(stat -c %s "$log")
+
+for pipeline in \
+	"cat $log | wc -l" "/bin/cat $log | wc -l" \
+	"cat $log | grep -c ERROR" "/bin/cat $log | grep -c ERROR" \
+	"cat $log > $dir/copy" "/bin/cat $log > $dir/copy"; do
+	echo "$pipeline" > "$dir/script"
+	start=$(date +%s.%N)
+	"$ash" "$dir/script" > /dev/null
+	end=$(date +%s.%N)
+	echo "$pipeline" | sed "s|$dir/||g" | tr '\n' ' '
+	echo "$bytes $start $end" | awk '{ printf "%.2fs, %.0f MB/sec\n", $3 - $2, $1 / 1048576 / ($3 - $2) }'
+done
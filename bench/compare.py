@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+"""Compares Google Benchmark JSON results against the recorded baseline.
+
+Usage:
+  bench/compare.py [--threshold PCT] baseline.json result.json...
+      Prints each benchmark's real time against the baseline and exits 1 if any
+      got slower by more than PCT percent (default 15).
+  bench/compare.py --merge baseline.json result.json...
+      Writes the results as the new baseline: per benchmark, only the real time that is
+      compared, the median where there were repetitions.
+"""
+import argparse
+import json
+import sys
+
+UNITS = {"ns": 1, "us": 1e3, "ms": 1e6, "s": 1e9}
+
+
+def load(paths):
+    """Real time in ns for every benchmark in the given result files, keyed by name.
+    With repetitions the median is used, as single runs of the spawn benchmarks are noisy."""
+    times = {}
+    medians = {}
+    for path in paths:
+        with open(path) as f:
+            for bench in json.load(f)["benchmarks"]:
+                if "error_occurred" in bench:
+                    continue
+                ns = bench["real_time"] * UNITS[bench.get("time_unit", "ns")]
+                if bench.get("run_type", "iteration") == "iteration":
+                    times[bench.get("run_name", bench["name"])] = ns
+                elif bench.get("aggregate_name") == "median":
+                    medians[bench["run_name"]] = ns
+    times.update(medians)
+    return times
+
+
+def merge(baseline, results):
+    benchmarks = [{"name": name, "real_time": round(ns, 1), "time_unit": "ns"}
+                  for name, ns in sorted(load(results).items())]
+    with open(baseline, "w") as f:
+        json.dump({"benchmarks": benchmarks}, f, indent=1)
+        f.write("\n")
+    print(f"wrote {len(benchmarks)} benchmarks to {baseline}")
+    return 0
+
+
+def compare(baseline, results, threshold):
+    before = load([baseline])
+    after = load(results)
+    regressions = 0
+    width = max((len(name) for name in after), default=10)
+    print(f"{'benchmark':<{width}} {'baseline':>12} {'current':>12} {'change':>8}")
+    for name, current in after.items():
+        if name not in before:
+            print(f"{name:<{width}} {'-':>12} {current:>10.0f}ns {'new':>8}")
+            continue
+        change = (current - before[name]) / before[name] * 100
+        flag = ""
+        if change > threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        print(f"{name:<{width}} {before[name]:>10.0f}ns {current:>10.0f}ns {change:>+7.1f}%{flag}")
+    for name in before.keys() - after.keys():
+        print(f"{name:<{width}} missing from the current results")
+    if regressions:
+        print(f"{regressions} benchmark(s) more than {threshold:g}% slower than the baseline")
+    return 1 if regressions else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--threshold", type=float, default=15, help="allowed slowdown in percent")
+    parser.add_argument("--merge", action="store_true", help="write the results as the new baseline")
+    parser.add_argument("baseline")
+    parser.add_argument("results", nargs="+")
+    args = parser.parse_args()
+    if args.merge:
+        return merge(args.baseline, args.results)
+    return compare(args.baseline, args.results, args.threshold)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
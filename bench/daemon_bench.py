@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+"""Runs the same one-line command many times, once by starting ash on a one-line script for
+every call and once through ash-client and a warm `ash --daemon`, and reports calls/sec and
+per-call latency for each.
+
+Usage: bench/daemon_bench.py [--calls N] [--line LINE] build/ash build/ash-client
+"""
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+
+# posix_spawn rather than fork, so the cost of copying this interpreter is not measured
+def measure(argv, calls):
+    devnull = os.open(os.devnull, os.O_WRONLY)
+    latencies = []
+    for _ in range(calls):
+        start = time.monotonic()
+        pid = os.posix_spawn(argv[0], argv, os.environ, file_actions=[(os.POSIX_SPAWN_DUP2, devnull, 1)])
+        _, status = os.waitpid(pid, 0)
+        latencies.append(time.monotonic() - start)
+        if os.waitstatus_to_exitcode(status) != 0:
+            raise SystemExit(f"{' '.join(argv)} exited with {os.waitstatus_to_exitcode(status)}")
+    os.close(devnull)
+    latencies.sort()
+    return calls / sum(latencies), latencies[len(latencies) // 2], latencies[len(latencies) * 99 // 100]
+
+
+def report(name, result):
+    rate, p50, p99 = result
+    print(f"{name:<8} {rate:8.0f} calls/sec   p50 {p50 * 1e6:8.0f}us   p99 {p99 * 1e6:8.0f}us")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--calls", type=int, default=1000)
+    parser.add_argument("--line", default="echo hello | tr a-z A-Z")
+    parser.add_argument("ash")
+    parser.add_argument("client")
+    args = parser.parse_args()
+    ash = os.path.abspath(args.ash)
+    client = os.path.abspath(args.client)
+    with tempfile.TemporaryDirectory() as tmp:
+        script = os.path.join(tmp, "line.ash")
+        with open(script, "w") as f:
+            f.write(args.line + "\n")
+        report("process", measure([ash, script], args.calls))
+
+        sock = os.path.join(tmp, "ash.sock")
+        daemon = subprocess.Popen([ash, "--daemon", sock])
+        try:
+            while not os.path.exists(sock):
+                time.sleep(0.01)
+            report("daemon", measure([client, sock, args.line], args.calls))
+        finally:
+            daemon.terminate()
+            daemon.wait()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,45 @@
+#include <benchmark/benchmark.h>
+#include <string>
+#include "lexer.h"
+#include "parser.h"
+#include "executor.h"
+
+// Latency of running one parsed line: process creation, pipe setup and waiting, with /bin/true
+// doing no work of its own
+static void executeLine(benchmark::State& state, const std::string& line) {
+	Lexer lexer(line);
+	Parser parser(lexer);
+	auto sequence = parser.parse();
+	Executor executor;
+	for (auto _ : state) {
+		executor.execute(sequence);
+	}
+	state.counters["spawns"] = benchmark::Counter(executor.getSpawnCount(), benchmark::Counter::kAvgIterations);
+}
+
+static void BM_SpawnTrue(benchmark::State& state) {
+	executeLine(state, "/bin/true");
+}
+BENCHMARK(BM_SpawnTrue)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+static void BM_SpawnPipeline(benchmark::State& state) {
+	std::string line = "/bin/true";
+	for (int i = 1; i < state.range(0); i++) {
+		line += " | /bin/true";
+	}
+	executeLine(state, line);
+}
+BENCHMARK(BM_SpawnPipeline)->Arg(2)->Arg(8)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+static void BM_SpawnRedirect(benchmark::State& state) {
+	executeLine(state, "/bin/true < /dev/null > /dev/null 2>&1");
+}
+BENCHMARK(BM_SpawnRedirect)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+// The in-process builtin, for contrast
+static void BM_BuiltinTrue(benchmark::State& state) {
+	executeLine(state, "true");
+}
+BENCHMARK(BM_BuiltinTrue)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+BENCHMARK_MAIN();
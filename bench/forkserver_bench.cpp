@@ -0,0 +1,89 @@
+#include <benchmark/benchmark.h>
+#include <cstring>
+#include <memory>
+#include <sys/mman.h>
+#include "forkserver.h"
+
+// Cost of creating a child as the shell grows: the argument is how many MB of touched heap the
+// shell holds. fork() copies the page tables of all of it; the fork server was started before
+// the heap grew, so its children cost the same at any size.
+static ForkServer server;
+
+static void grow(size_t megabytes) {
+	static void* heap = nullptr;
+	static size_t size = 0;
+	if (heap != nullptr) {
+		munmap(heap, size);
+	}
+	size = megabytes << 20;
+	heap = size == 0 ? nullptr : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (heap != nullptr) {
+		memset(heap, 1, size);
+	}
+}
+
+static Command trueCommand() {
+	Command cmd;
+	cmd.args.emplace_back("true");
+	return cmd;
+}
+
+// What the shell does for builtin stages in a pipeline without a fork server
+static void BM_Fork(benchmark::State& state) {
+	grow(state.range(0));
+	for (auto _ : state) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			_exit(0);
+		}
+		waitpid(pid, nullptr, 0);
+	}
+	grow(0);
+}
+BENCHMARK(BM_Fork)->Arg(0)->Arg(256)->Arg(1024)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+static void BM_ForkServerRun(benchmark::State& state) {
+	grow(state.range(0));
+	Command cmd = trueCommand();
+	SpawnPlan plan;
+	int error;
+	for (auto _ : state) {
+		waitpid(server.run(plan, &cmd, 1, error), nullptr, 0);
+	}
+	grow(0);
+}
+BENCHMARK(BM_ForkServerRun)->Arg(0)->Arg(256)->Arg(1024)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+// External programs: posix_spawn already avoids copying the shell's memory
+static void BM_PosixSpawn(benchmark::State& state) {
+	grow(state.range(0));
+	SpawnPlan plan;
+	Argv argv(std::vector<std::string> {"/bin/true"});
+	int error;
+	for (auto _ : state) {
+		waitpid(plan.spawn("/bin/true", argv, error), nullptr, 0);
+	}
+	grow(0);
+}
+BENCHMARK(BM_PosixSpawn)->Arg(0)->Arg(1024)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+static void BM_ForkServerSpawn(benchmark::State& state) {
+	grow(state.range(0));
+	SpawnPlan plan;
+	Argv argv(std::vector<std::string> {"/bin/true"});
+	int error;
+	for (auto _ : state) {
+		waitpid(server.spawn(plan, "/bin/true", argv, error), nullptr, 0);
+	}
+	grow(0);
+}
+BENCHMARK(BM_ForkServerSpawn)->Arg(0)->Arg(1024)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+int main(int argc, char** argv) {
+	// Started first, as the shell does, while this process is small
+	server.start([](const Command*, size_t) { return 0; });
+	benchmark::Initialize(&argc, argv);
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return 0;
+}
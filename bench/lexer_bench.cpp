@@ -0,0 +1,82 @@
+#include <benchmark/benchmark.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <variant>
+#include "lexer.h"
+#include "token.h"
+
+// Synthetic batch script of roughly the given size, mixing plain words, quotes, pipes and redirects
+static std::vector<std::string> makeScript(size_t bytes) {
+	const std::vector<std::string> templates = {
+		"ls -la /usr/lib/x86_64-linux-gnu > listing.txt",
+		"grep -v \"^#\" config/settings.ini | sort | uniq -c 2>> errors.log",
+		"echo provisioning host-42 step 17 of 120 &>> run.log",
+		"cp build/output/artifact.tar.gz /srv/releases/ 2>&1",
+		"cat < input.txt | tr a-z A-Z | wc -l; sleep 1 &",
+	};
+	std::vector<std::string> lines;
+	size_t total = 0;
+	for (size_t i = 0; total < bytes; i++) {
+		lines.push_back(templates[i % templates.size()]);
+		total += lines.back().size() + 1;
+	}
+	return lines;
+}
+
+static void BM_LexScript(benchmark::State& state) {
+	auto lines = makeScript(state.range(0) << 20);
+	size_t tokens = 0;
+	size_t bytes = 0;
+	for (auto _ : state) {
+		for (const auto& line : lines) {
+			Lexer lexer(line);
+			while (true) {
+				auto tok = lexer.getToken();
+				tokens++;
+				if (auto ptr = std::get_if<Token>(&tok); ptr == nullptr || ptr->type == Type::END) {
+					break;
+				}
+			}
+			bytes += line.size() + 1;
+		}
+	}
+	state.SetItemsProcessed(tokens);
+	state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_LexScript)->Arg(4)->Arg(16)->Unit(benchmark::kMillisecond);
+
+// Real scripts: the repo's own shell scripts, lexed line by line (run from the repo root, as make bench does)
+static void BM_LexRealScripts(benchmark::State& state) {
+	std::vector<std::string> lines;
+	for (const char* path : {"bench/batch_bench.sh", "bench/cat_bench.sh"}) {
+		std::ifstream script(path);
+		for (std::string line; std::getline(script, line);) {
+			lines.push_back(line);
+		}
+	}
+	if (lines.empty()) {
+		state.SkipWithError("bench/*.sh not found; run from the repo root");
+		return;
+	}
+	size_t tokens = 0;
+	size_t bytes = 0;
+	for (auto _ : state) {
+		for (const auto& line : lines) {
+			Lexer lexer(line);
+			while (true) {
+				auto tok = lexer.getToken();
+				tokens++;
+				if (auto ptr = std::get_if<Token>(&tok); ptr == nullptr || ptr->type == Type::END) {
+					break;
+				}
+			}
+			bytes += line.size() + 1;
+		}
+	}
+	state.SetItemsProcessed(tokens);
+	state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_LexRealScripts);
+
+BENCHMARK_MAIN();
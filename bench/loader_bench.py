@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+"""Loads and parses a large generated batch script with `ash -n` (parse only, no execution)
+and reports wall time and peak resident memory for each ash binary given.
+
+The script repeats a small set of command templates, as generated scripts do; --distinct
+makes every line unique instead, defeating the parse cache.
+
+Usage: bench/loader_bench.py [--size MiB] [--distinct] ash [ash...]
+"""
+import argparse
+import os
+import sys
+import tempfile
+import time
+
+TEMPLATES = [
+    "ls -la /usr/lib/x86_64-linux-gnu > listing.txt",
+    "grep -v \"^#\" config/settings.ini | sort | uniq -c 2>> errors.log",
+    "echo provisioning host-42 step 17 of 120 &>> run.log",
+    "cp build/output/artifact.tar.gz /srv/releases/ 2>&1",
+    "cat < input.txt | tr a-z A-Z | wc -l; sleep 1 &",
+]
+
+
+def generate(path, size, distinct):
+    written = 0
+    n = 0
+    with open(path, "wb") as f:
+        while written < size:
+            lines = []
+            for _ in range(10000):
+                line = TEMPLATES[n % len(TEMPLATES)]
+                lines.append(f"{line} # {n}" if distinct else line)
+                n += 1
+            block = ("\n".join(lines) + "\n").encode()
+            f.write(block)
+            written += len(block)
+    return written
+
+
+def run(ash, script):
+    start = time.monotonic()
+    pid = os.fork()
+    if pid == 0:
+        devnull = os.open(os.devnull, os.O_WRONLY)
+        os.dup2(devnull, 1)
+        os.execv(ash, [ash, "-n", script])
+    _, status, usage = os.wait4(pid, 0)
+    elapsed = time.monotonic() - start
+    return elapsed, usage.ru_maxrss, os.waitstatus_to_exitcode(status)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--size", type=int, default=1024, help="script size in MiB")
+    parser.add_argument("--distinct", action="store_true", help="make every line unique")
+    parser.add_argument("ash", nargs="+")
+    args = parser.parse_args()
+    with tempfile.TemporaryDirectory() as tmp:
+        script = os.path.join(tmp, "script.ash")
+        size = generate(script, args.size << 20, args.distinct)
+        for ash in args.ash:
+            elapsed, maxrss, code = run(os.path.abspath(ash), script)
+            print(f"{ash}: {size / 1048576:.0f} MiB in {elapsed:.2f}s, {size / 1048576 / elapsed:.0f} MiB/sec, "
+                  f"max RSS {maxrss / 1024:.1f} MiB, exit {code}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
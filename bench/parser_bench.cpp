@@ -0,0 +1,47 @@
+#include <benchmark/benchmark.h>
+#include <string>
+#include "arena.h"
+#include "lexer.h"
+#include "parser.h"
+
+// One line holding a pipeline of the given number of stages
+static std::string makePipeline(int stages) {
+	std::string line = "cat input.txt";
+	for (int i = 1; i < stages; i++) {
+		line += " | grep -v pattern" + std::to_string(i);
+	}
+	return line;
+}
+
+// One command carrying every kind of redirection, repeated across a ;-separated line
+static std::string makeRedirects(int commands) {
+	std::string line;
+	for (int i = 0; i < commands; i++) {
+		line += "make -j8 target" + std::to_string(i) + " < in.txt > out.txt 2>> err.log 2>&1 &>> all.log 1>&2; ";
+	}
+	return line;
+}
+
+static void parseLines(benchmark::State& state, const std::string& line) {
+	LineArena arena;
+	for (auto _ : state) {
+		arena.reset();
+		Lexer lexer(line, arena.resource());
+		Parser parser(lexer, arena.resource());
+		auto sequence = parser.parse();
+		benchmark::DoNotOptimize(sequence);
+	}
+	state.SetBytesProcessed(state.iterations() * line.size());
+}
+
+static void BM_ParseDeepPipeline(benchmark::State& state) {
+	parseLines(state, makePipeline(state.range(0)));
+}
+BENCHMARK(BM_ParseDeepPipeline)->Arg(8)->Arg(64)->Arg(512);
+
+static void BM_ParseRedirects(benchmark::State& state) {
+	parseLines(state, makeRedirects(state.range(0)));
+}
+BENCHMARK(BM_ParseRedirects)->Arg(1)->Arg(32);
+
+BENCHMARK_MAIN();
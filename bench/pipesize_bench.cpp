@@ -0,0 +1,25 @@
+#include <benchmark/benchmark.h>
+#include <string>
+#include "lexer.h"
+#include "parser.h"
+#include "executor.h"
+
+// Throughput of a producer/consumer pair, `yes | head -c`, by the size of the pipe between them.
+// Small pipes mean a context switch every few writes; past a point a bigger one stops helping and
+// only costs cache.
+static void BM_PipeThroughput(benchmark::State& state) {
+	const size_t bytes = 256 << 20;
+	std::string line = "pipesize=" + std::to_string(state.range(0)) + " /usr/bin/yes | /usr/bin/head -c " +
+		std::to_string(bytes) + " > /dev/null";
+	Lexer lexer(line);
+	Parser parser(lexer);
+	auto sequence = parser.parse();
+	Executor executor;
+	for (auto _ : state) {
+		executor.execute(sequence);
+	}
+	state.SetBytesProcessed(state.iterations() * bytes);
+}
+BENCHMARK(BM_PipeThroughput)->RangeMultiplier(4)->Range(4 << 10, 1 << 20)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+"""Startup latency of ash: the median wall time of `ash -c true` (start, run a builtin, exit),
+and the median time from exec to the first child spawn. The latter is measured with a FIFO:
+ash runs `/bin/true > fifo`, and the spawned child opens the FIFO for writing before it
+execs, which is when the open for reading here returns.
+
+With --json the medians are written in Google Benchmark's format, so bench/compare.py tracks
+them with the other benchmarks.
+
+Usage: bench/startup_bench.py [--runs N] [--json out.json] ash [ash...]
+"""
+import argparse
+import json
+import os
+import statistics
+import sys
+import tempfile
+import time
+
+
+def spawn(argv):
+    devnull = os.open(os.devnull, os.O_WRONLY)
+    pid = os.posix_spawn(argv[0], argv, os.environ, file_actions=[(os.POSIX_SPAWN_DUP2, devnull, 1)])
+    os.close(devnull)
+    return pid
+
+
+def run_true(ash, runs):
+    times = []
+    for _ in range(runs):
+        start = time.perf_counter_ns()
+        _, status = os.waitpid(spawn([ash, "-c", "true"]), 0)
+        times.append(time.perf_counter_ns() - start)
+        if os.waitstatus_to_exitcode(status) != 0:
+            raise SystemExit(f"{ash} -c true exited with {os.waitstatus_to_exitcode(status)}")
+    return statistics.median(times)
+
+
+def first_spawn(ash, runs, fifo):
+    times = []
+    for _ in range(runs):
+        start = time.perf_counter_ns()
+        pid = spawn([ash, "-c", f"/bin/true > {fifo}"])
+        fd = os.open(fifo, os.O_RDONLY)
+        times.append(time.perf_counter_ns() - start)
+        os.close(fd)
+        os.waitpid(pid, 0)
+    return statistics.median(times)
+
+
+def entry(name, ns, runs):
+    return {"name": name, "run_name": name, "run_type": "aggregate", "aggregate_name": "median",
+            "repetitions": runs, "iterations": runs, "real_time": ns / 1e3, "cpu_time": 0, "time_unit": "us"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--runs", type=int, default=10000)
+    parser.add_argument("--json", help="write the medians as Google Benchmark JSON")
+    parser.add_argument("ash", nargs="+")
+    args = parser.parse_args()
+    benchmarks = []
+    with tempfile.TemporaryDirectory() as tmp:
+        fifo = os.path.join(tmp, "fifo")
+        os.mkfifo(fifo)
+        for ash in args.ash:
+            ash = os.path.abspath(ash)
+            total = run_true(ash, args.runs)
+            spawned = first_spawn(ash, max(args.runs // 10, 1), fifo)
+            print(f"{ash}: ash -c true {total / 1e3:.0f}us, exec to first spawn {spawned / 1e3:.0f}us (medians)")
+            benchmarks += [entry("BM_StartupTrue", total, args.runs), entry("BM_StartupToSpawn", spawned, args.runs)]
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"benchmarks": benchmarks}, f, indent=1)
+            f.write("\n")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,203 @@
+#!/usr/bin/env python3
+"""End-to-end load and leak harness for ash.
+
+Feeds ash tens of thousands of mixed lines through batch mode and through interactive
+stdin. The lines mix pipelines, redirections, background jobs and errors. While ash
+runs, its open fds (/proc/PID/fd) and zombie children are sampled.
+
+The harness reports commands/sec and p50/p99 per-line latency. In batch mode the
+latency comes from ASH_TRACE; interactively it is the round trip of each line. It
+exits 1 if fds grow past their steady state after warm-up or zombies accumulate.
+
+Usage: bench/stress.py [-n lines] [--mode batch|interactive|both] [ash]
+"""
+import argparse
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+# FdCache::DEFAULT_CAPACITY in src/fdcache.h: batch mode may keep this many append targets open
+FDCACHE_CAPACITY = 16
+
+
+def make_lines(count, tmp, seed=1):
+    rng = random.Random(seed)
+    templates = [
+        "echo line {i}",
+        "echo line {i} | tr a-z A-Z | wc -c",
+        "ls / > {tmp}/out{m}.txt",
+        "cat < {tmp}/out{m}.txt | wc -l",
+        "echo appended {i} >> {tmp}/log.txt",
+        "/bin/sleep 0.01 &",
+        "echo background {i} > /dev/null &",
+        "missing_command_{i}",
+        "echo x > /nonexistent/dir/file",
+        "cat < /nonexistent/file",
+        "echo bad >",
+        "true; false; printf \"%s\\n\" {i} > /dev/null",
+        "jobs > /dev/null",
+    ]
+    lines = []
+    for i in range(count):
+        if i % 1000 == 999:
+            lines.append("wait")
+        else:
+            lines.append(rng.choice(templates).format(i=i, m=i % 50, tmp=tmp))
+    return lines
+
+
+class Sampler(threading.Thread):
+    """Samples the fd count and zombie children of a process every interval seconds."""
+
+    def __init__(self, pid, interval=0.01):
+        super().__init__(daemon=True)
+        self.pid = pid
+        self.interval = interval
+        self.samples = []
+        self.stopped = threading.Event()
+
+    def run(self):
+        while not self.stopped.is_set():
+            sample = self.sample()
+            if sample is None:
+                break
+            self.samples.append(sample)
+            self.stopped.wait(self.interval)
+
+    def sample(self):
+        try:
+            fds = len(os.listdir(f"/proc/{self.pid}/fd"))
+        except OSError:
+            return None
+        zombies = 0
+        for entry in os.listdir("/proc"):
+            if not entry.isdigit():
+                continue
+            try:
+                with open(f"/proc/{entry}/stat") as f:
+                    stat = f.read()
+            except OSError:
+                continue
+            # The command name may contain spaces, so split after its closing parenthesis
+            fields = stat[stat.rfind(")") + 2:].split()
+            if fields[0] == "Z" and int(fields[1]) == self.pid:
+                zombies += 1
+        return fds, zombies
+
+    def stop(self):
+        self.stopped.set()
+        self.join()
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p / 100 * len(values)))] if values else 0
+
+
+def check_leaks(name, samples, allowance=0):
+    """Fails if zombies pile up, or if the fd count at the end of the run is above its steady state.
+
+    The first tenth of the samples is warm-up. The steady state is the highest count in the
+    tenth after it, which includes the pipes and pidfds of lines in flight. The end level is
+    the lowest count in the last tenth. allowance is how many fds may still be opened for good
+    after warm-up, such as the append targets batch mode keeps open.
+    """
+    if len(samples) < 20:
+        print(f"{name}: too few samples to check for leaks")
+        return True
+    tenth = len(samples) // 10
+    steady = max(fds for fds, _ in samples[tenth:2 * tenth])
+    late = min(fds for fds, _ in samples[-tenth:])
+    zombies = max(z for _, z in samples)
+    print(f"{name}: fds {steady} -> {late} (max {max(f for f, _ in samples)}), "
+          f"max zombies {zombies}, {len(samples)} samples")
+    ok = True
+    if late > steady + allowance:
+        print(f"{name}: FAIL fd count grew from {steady} to {late}")
+        ok = False
+    if zombies > 16:
+        print(f"{name}: FAIL {zombies} zombie children at once")
+        ok = False
+    return ok
+
+
+def run_batch(ash, lines, tmp):
+    script = os.path.join(tmp, "script.ash")
+    trace = os.path.join(tmp, "trace.json")
+    with open(script, "w") as f:
+        f.write("\n".join(lines) + "\n")
+    env = dict(os.environ, ASH_TRACE=trace)
+    start = time.monotonic()
+    proc = subprocess.Popen([ash, script], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, env=env)
+    sampler = Sampler(proc.pid)
+    sampler.start()
+    proc.wait()
+    elapsed = time.monotonic() - start
+    sampler.stop()
+    print(f"batch: {len(lines)} lines in {elapsed:.2f}s, {len(lines) / elapsed:.0f} commands/sec")
+    try:
+        with open(trace + ".hist") as f:
+            for row in f:
+                if row.startswith("line "):
+                    fields = row.split()
+                    print(f"batch: per-line latency p50 {fields[3]}us p99 {fields[5]}us")
+    except OSError:
+        print("batch: no latency histogram (ash built without tracing?)")
+    return check_leaks("batch", sampler.samples, FDCACHE_CAPACITY)
+
+
+def run_interactive(ash, lines, tmp):
+    err = open(os.path.join(tmp, "stderr.txt"), "w")
+    proc = subprocess.Popen([ash], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=err, bufsize=0)
+    sampler = Sampler(proc.pid)
+    sampler.start()
+    latencies = []
+    pending = b""
+    start = time.monotonic()
+    for i, line in enumerate(lines):
+        mark = f"__ash_mark_{i}".encode()
+        sent = time.monotonic()
+        proc.stdin.write(line.encode() + b"\necho " + mark + b"\n")
+        while mark not in pending:
+            chunk = os.read(proc.stdout.fileno(), 65536)
+            if not chunk:
+                print(f"interactive: ash exited after {i} lines")
+                sampler.stop()
+                return False
+            pending += chunk
+        latencies.append(time.monotonic() - sent)
+        pending = pending[pending.index(mark) + len(mark):]
+    proc.stdin.close()
+    proc.wait()
+    elapsed = time.monotonic() - start
+    sampler.stop()
+    err.close()
+    print(f"interactive: {len(lines)} lines in {elapsed:.2f}s, {len(lines) / elapsed:.0f} commands/sec")
+    print(f"interactive: per-line round trip p50 {percentile(latencies, 50) * 1e6:.0f}us "
+          f"p99 {percentile(latencies, 99) * 1e6:.0f}us")
+    return check_leaks("interactive", sampler.samples)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-n", "--lines", type=int, default=20000)
+    parser.add_argument("--mode", choices=["batch", "interactive", "both"], default="both")
+    parser.add_argument("ash", nargs="?", default="build/ash")
+    args = parser.parse_args()
+    ash = os.path.abspath(args.ash)
+    ok = True
+    with tempfile.TemporaryDirectory() as tmp:
+        lines = make_lines(args.lines, tmp)
+        if args.mode in ("batch", "both"):
+            ok = run_batch(ash, lines, tmp) and ok
+        if args.mode in ("interactive", "both"):
+            ok = run_interactive(ash, lines, tmp) and ok
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,22 @@
+#include <benchmark/benchmark.h>
+#include "trace.h"
+
+// Cost of a span with tracing compiled in but switched off, the default for every run without ASH_TRACE
+static void BM_SpanDisabled(benchmark::State& state) {
+	for (auto _ : state) {
+		TRACE_SPAN(LINE);
+		benchmark::ClobberMemory();
+	}
+}
+BENCHMARK(BM_SpanDisabled);
+
+static void BM_SpanEnabled(benchmark::State& state) {
+	Tracer::instance().open("/dev/null");
+	for (auto _ : state) {
+		TRACE_SPAN(LINE);
+		benchmark::ClobberMemory();
+	}
+}
+BENCHMARK(BM_SpanEnabled);
+
+BENCHMARK_MAIN();
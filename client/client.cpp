@@ -0,0 +1,26 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include "daemon.h"
+
+// ash-client: runs one command line in a warm `ash --daemon` shell and exits with its status.
+// It links nothing beyond what the protocol needs (no iostreams, no parser), so it starts fast.
+// Usage: ash-client socket command...
+int main(int argc, char* argv[]) {
+	if (argc < 3) {
+		fputs("Usage: ash-client socket command...\n", stderr);
+		return 2;
+	}
+	std::string line = argv[2];
+	for (int i = 3; i < argc; i++) {
+		line += ' ';
+		line += argv[i];
+	}
+	int status = runInDaemon(argv[1], line);
+	if (status == -1) {
+		fprintf(stderr, "Error: %s: %s\n", argv[1], strerror(errno));
+		return 127;
+	}
+	return status;
+}
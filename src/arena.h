@@ -0,0 +1,25 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <memory_resource>
+
+// Monotonic arena for everything produced while lexing and parsing one line.
+// Allocations come from an inline buffer (spilling to the heap only for very long lines)
+// and are all released at once by reset() before the next line.
+class LineArena {
+public:
+	LineArena() {}
+	LineArena(const LineArena&) = delete;
+	LineArena& operator=(const LineArena&) = delete;
+	std::pmr::memory_resource* resource() {
+		return &pool;
+	}
+	void reset() {
+		pool.release();
+	}
+private:
+	alignas(std::max_align_t) std::byte buffer[16384];
+	std::pmr::monotonic_buffer_resource pool {buffer, sizeof(buffer)};
+};
+#endif
@@ -1,41 +1,328 @@
 #include <iostream>
-#include <fstream>
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <csignal>
+#include <cstdlib>
+#include <unordered_map>
+#include <unistd.h>
+#include "arena.h"
+#include "batch.h"
+#include "compiled.h"
+#include "daemon.h"
 #include "lexer.h"
 #include "parser.h"
 #include "executor.h"
+#include "script.h"
+#include "trace.h"
 
-void executeLine(std::string line) {
-	auto executor = Executor();
-	Lexer lexer(line);
-	Parser parser(lexer);
-	auto result = parser.parse();
-	executor.execute(result);
+// One executor for the whole session, so state such as the command hash table persists across lines
+Executor executor;
+LineArena arena;
+
+// Parses a line into the arena, which is reset first, so the result lives until the next line
+Sequence parseLine(std::string_view line) {
+	arena.reset();
+	Lexer lexer(line, arena.resource());
+	Parser parser(lexer, arena.resource());
+	return parser.parse();
+}
+
+int executeLine(std::string_view line) {
+	TRACE_NEXT_LINE();
+	TRACE_SPAN(LINE);
+	executor.execute(parseLine(line));
+	return executor.getLastStatus();
+}
+
+// Runs a line on its own, for -c or the daemon, and returns its status: that given to `exit` if the
+// line reaches one, 0 for an empty line and, as in bash -c, 2 for one that ends in a syntax error
+int runLine(const Sequence& sequence) {
+	if (!executor.run(sequence)) {
+		return executor.getLastStatus();
+	}
+	if (sequence.empty()) {
+		return 0;
+	}
+	return std::holds_alternative<ShellError>(sequence.back()) ? 2 : executor.getLastStatus();
 }
 
+// -c: runs one line, like sh -c, and returns its status
+int runCommandMode(std::string_view line) {
+	TRACE_NEXT_LINE();
+	TRACE_SPAN(LINE);
+	return runLine(parseLine(line));
+}
+
+// Lines of a script are memoized (see ParseCache), so a repeated line is neither lexed nor parsed
+ParseCache parseCache;
+
+int executeScriptLine(std::string_view line) {
+	TRACE_NEXT_LINE();
+	TRACE_SPAN(LINE);
+	if (const Sequence* cached = parseCache.find(line)) {
+		executor.execute(*cached);
+	} else {
+		auto result = parseLine(line);
+		parseCache.insert(line, result);
+		executor.execute(result);
+	}
+	return executor.getLastStatus();
+}
+
+// Runs a daemon request's line; `exit` ends the request, not the daemon
+int executeDaemonLine(const std::string& line) {
+	TRACE_NEXT_LINE();
+	TRACE_SPAN(LINE);
+	if (const Sequence* cached = parseCache.find(line)) {
+		return runLine(*cached);
+	} else {
+		auto result = parseLine(line);
+		parseCache.insert(line, result);
+		return runLine(result);
+	}
+}
+
+// --daemon: serves lines from clients (see daemon.h) until killed. Each runs in the client's
+// directory with the client's fds as 0-2; SIGPIPE is ignored so a client that goes away cannot
+// take the daemon with it.
+void runDaemonMode(const char* path) {
+	DaemonSocket daemon(path);
+	signal(SIGPIPE, SIG_IGN);
+	int saved[3];
+	for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+		saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+	}
+	DaemonSocket::Request request;
+	while (daemon.next(request)) {
+		for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+			dup2(request.fds[DAEMON_STDIN + fd], fd);
+		}
+		int status = 1;
+		if (fchdir(request.fds[DAEMON_CWD]) == 0) {
+			status = executeDaemonLine(request.line);
+		} else {
+			std::cerr << "Error: " << strerror(errno) << std::endl;
+		}
+		std::cout.flush();
+		std::cerr.flush();
+		std::cout.clear();
+		std::cerr.clear();
+		for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+			dup2(saved[fd], fd);
+		}
+		DaemonSocket::reply(request, status);
+	}
+	throw std::invalid_argument(std::string(path) + ": " + strerror(errno));
+}
+
+// Reads commands from stdin until EOF; the prompt is only shown when stdin is a terminal
 void runInteractiveMode() {
 	std::string line;
+	const bool prompt = isatty(STDIN_FILENO);
 	while (true) {
-		std::cout << "ash> ";
-		std::getline(std::cin, line);
+		executor.notifyJobs();
+		if (prompt) {
+			std::cout << "ash> " << std::flush;
+		}
+		if (!std::getline(std::cin, line)) {
+			break;
+		}
 		executeLine(line);
 	}
 }
 
-void runBatchMode(char* filename) {
-	std::string line;
-	std::ifstream batch(filename);
-	while (std::getline(batch, line)) {
-		executeLine(line);
+// --compile: writes the parsed lines of source to output as a compiled script (see compiled.h).
+// The source is stamped before it is read, so a change while compiling only forces a recompile.
+void compileScript(const std::string& source, const std::string& output) {
+	SourceStamp stamp = stampFile(source);
+	char* resolved = realpath(source.c_str(), nullptr);
+	std::string path = resolved ? resolved : source;
+	free(resolved);
+	MappedScript script(source.c_str());
+	CompiledScriptWriter writer;
+	std::unordered_map<std::string_view, size_t> ids;
+	std::string_view line;
+	while (script.next(line)) {
+		auto it = ids.find(line);
+		if (it != ids.end()) {
+			writer.repeat(it->second);
+		} else {
+			ids.emplace(line, writer.add(parseLine(line)));
+		}
+	}
+	writer.write(output, path, stamp);
+}
+
+void executeCompiled(const CompiledScript& compiled) {
+	for (uint64_t i = 0; i < compiled.getLineCount(); i++) {
+		TRACE_NEXT_LINE();
+		TRACE_SPAN(LINE);
+		arena.reset();
+		executor.execute(compiled.line(i, arena.resource()));
+	}
+}
+
+// A compiled script whose source has changed, or that another version of ash wrote, is first
+// recompiled in place; if that fails the source runs as text. A compiled script whose source is
+// gone still runs, as long as its version is current.
+void runCompiledScript(const char* filename, const CompiledScript& compiled) {
+	const std::string& source = compiled.getSource();
+	if (access(source.c_str(), F_OK) == 0 && (!compiled.isCurrentVersion() || !compiled.isSourceUnchanged())) {
+		try {
+			compileScript(source, filename);
+		} catch (const std::invalid_argument& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+			MappedScript script(source.c_str(), true);
+			std::string_view line;
+			while (script.next(line)) {
+				executeScriptLine(line);
+			}
+			return;
+		}
+		MappedScript script(filename);
+		executeCompiled(CompiledScript(script.contents()));
+		return;
+	}
+	if (!compiled.isCurrentVersion()) {
+		throw std::invalid_argument(std::string(filename) + ": compiled by another version of ash, and " + source + " is gone");
+	}
+	executeCompiled(compiled);
+}
+
+// With more than one job slot, lines run concurrently (see batch.h); compiled scripts always run
+// one line at a time. Files appended to are kept open across lines (see fdcache.h).
+void runBatchMode(const char* filename, size_t jobs) {
+	executor.cacheAppendFds();
+	MappedScript script(filename, true);
+	std::string_view line;
+	if (CompiledScript::isCompiled(script.contents())) {
+		runCompiledScript(filename, CompiledScript(script.contents()));
+	} else if (jobs > 1) {
+		ParallelBatch parallel(jobs, executeScriptLine, [](int status) { executor.setLastStatus(status); });
+		while (script.next(line)) {
+			parallel.run(line);
+		}
+		parallel.finish();
+	} else {
+		while (script.next(line)) {
+			executeScriptLine(line);
+		}
 	}
 	exit(0);
 }
 
+// -n: parses the script and reports syntax errors without executing anything, like bash -n
+void checkScript(const char* filename) {
+	MappedScript script(filename);
+	std::string_view line;
+	auto report = [](const Sequence& sequence) {
+		for (const auto& item : sequence) {
+			if (auto error = std::get_if<ShellError>(&item)) {
+				std::cout << error->message << '\n';
+			}
+		}
+	};
+	if (CompiledScript::isCompiled(script.contents())) {
+		CompiledScript compiled(script.contents());
+		for (uint64_t i = 0; compiled.isCurrentVersion() && i < compiled.getLineCount(); i++) {
+			arena.reset();
+			report(compiled.line(i, arena.resource()));
+		}
+		exit(0);
+	}
+	while (script.next(line)) {
+		if (const Sequence* cached = parseCache.find(line)) {
+			report(*cached);
+		} else {
+			auto parsed = parseLine(line);
+			parseCache.insert(line, parsed);
+			report(parsed);
+		}
+	}
+	exit(0);
+}
+
+// Usage: ash [-j N] [-n] [script]
+//        ash -c command
+//        ash --compile script -o script.ashc
+//        ash --daemon socket
 int main(int argc, char* argv[]) {
+#ifdef ASH_TRACING
+	Tracer::instance().open(std::getenv("ASH_TRACE"));
+#endif
+	// First, while the shell is at its smallest
+	if (const char* forkServer = std::getenv("ASH_FORK_SERVER"); forkServer != nullptr && *forkServer != '\0') {
+		executor.startForkServer();
+	}
 	try {
-		if (argc > 2) {
+		int arg = 1;
+		size_t jobs = 1;
+		bool noExec = false;
+		const char* compile = nullptr;
+		const char* output = nullptr;
+		const char* daemon = nullptr;
+		const char* command = nullptr;
+		for (; arg < argc && argv[arg][0] == '-'; arg++) {
+			std::string_view option = argv[arg];
+			if (option == "-n") {
+				noExec = true;
+			} else if (option == "-c") {
+				if (arg + 1 >= argc) {
+					throw std::invalid_argument("-c requires a command");
+				}
+				command = argv[++arg];
+			} else if (option == "--daemon") {
+				if (arg + 1 >= argc) {
+					throw std::invalid_argument("--daemon requires a socket path");
+				}
+				daemon = argv[++arg];
+			} else if (option == "--compile" || option == "-o") {
+				if (arg + 1 >= argc) {
+					throw std::invalid_argument(std::string(option) + " requires a file");
+				}
+				(option == "-o" ? output : compile) = argv[++arg];
+			} else if (option == "-j") {
+				if (arg + 1 >= argc) {
+					throw std::invalid_argument("-j requires a number of jobs");
+				}
+				std::string_view count = argv[++arg];
+				auto [end, error] = std::from_chars(count.data(), count.data() + count.size(), jobs);
+				if (error != std::errc() || end != count.data() + count.size() || jobs == 0) {
+					throw std::invalid_argument("-j requires a positive number of jobs");
+				}
+			} else {
+				throw std::invalid_argument("Unknown option " + std::string(option));
+			}
+		}
+		if (command != nullptr) {
+			if (argc - arg != 0) {
+				throw std::invalid_argument("Too many arguments");
+			}
+			return runCommandMode(command);
+		}
+		if (daemon != nullptr) {
+			if (argc - arg != 0) {
+				throw std::invalid_argument("Too many arguments");
+			}
+			runDaemonMode(daemon);
+		}
+		if (compile != nullptr || output != nullptr) {
+			if (compile == nullptr || output == nullptr || argc - arg != 0) {
+				throw std::invalid_argument("--compile requires a script and -o output");
+			}
+			compileScript(compile, output);
+			return 0;
+		}
+		if (noExec && argc - arg != 1) {
+			throw std::invalid_argument("-n requires a script");
+		}
+		if (argc - arg > 1) {
 			throw std::invalid_argument("Too many arguments");
-		} else if (argc == 2) {
-			runBatchMode(argv[1]);
+		} else if (argc - arg == 1 && noExec) {
+			checkScript(argv[arg]);
+		} else if (argc - arg == 1) {
+			runBatchMode(argv[arg], jobs);
 		} else {
 			runInteractiveMode();
 		}
@@ -0,0 +1,327 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+#include <cstdint>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "executor.h"
+#include "jobs.h"
+#include "lexer.h"
+#include "parser.h"
+#include "pipewait.h"
+#include "timing.h"
+
+// What a line run through AsyncExecutor came to
+struct JobResult {
+	// The status of the line's last pipeline, or 2 if it ends in a syntax error; if the line reached
+	// `exit`, the status that gave
+	int status {0};
+	// Of the last pipeline: its processes' statuses and the one that failed first (see
+	// Executor::getPipeStatus and getFailedStage)
+	std::vector<int> pipeStatus;
+	int failedStage {-1};
+	// Summed over the line's child processes; builtins run in the shell itself are not counted
+	struct rusage usage {};
+	// The syntax error, which is not printed
+	std::string error;
+};
+
+// A submitted line; copies share one result
+class JobHandle {
+public:
+	JobHandle() {}
+	explicit JobHandle(std::shared_future<JobResult> result) : result {std::move(result)} {}
+	// Blocks until the line has finished; a copy, so it outlives the handle
+	JobResult get() const {
+		return result.get();
+	}
+	bool isDone() const {
+		return result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	}
+	const std::shared_future<JobResult>& getFuture() const {
+		return result;
+	}
+private:
+	std::shared_future<JobResult> result;
+};
+
+// Runs lines for a program that links the shell in instead of starting it. submit() starts a line's
+// first pipeline and returns; one reaper thread waits for every child through pidfds in one epoll
+// set, and starts each later pipeline of a line once the one before it has finished. Any number of
+// threads may submit lines, which run concurrently and share one Executor, so its command hash table
+// and working directory. `exit` ends only its line. Pipelines made only of builtins still run in the
+// shell itself, writing to std::cout, when they start on the submitting thread. On the reaper thread
+// they get a child, since a builtin blocked on its input or output there would stall every line;
+// only those that use the shell's state (cd, set and the like) run there in the shell.
+class AsyncExecutor {
+public:
+	using Callback = std::function<void(const JobResult&)>;
+	// Throws std::runtime_error if the reaper cannot be set up
+	AsyncExecutor() {
+		epollFd = epoll_create1(EPOLL_CLOEXEC);
+		wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		struct epoll_event event {};
+		event.events = EPOLLIN;
+		event.data.fd = wakeFd;
+		if (epollFd == -1 || wakeFd == -1 || epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) == -1) {
+			if (epollFd != -1) close(epollFd);
+			if (wakeFd != -1) close(wakeFd);
+			throw std::runtime_error("Failed to set up the reaper");
+		}
+		reaper = std::thread([this] { reap(); });
+	}
+	AsyncExecutor(const AsyncExecutor&) = delete;
+	AsyncExecutor& operator=(const AsyncExecutor&) = delete;
+	// Waits for the submitted lines to finish, and for background processes they started
+	~AsyncExecutor() {
+		{
+			std::lock_guard lock(mutex);
+			stopping = true;
+		}
+		wake();
+		reaper.join();
+		close(epollFd);
+		close(wakeFd);
+	}
+	// Runs line without waiting for it. onDone, if given, is called with the result on the reaper
+	// thread, or before submit() returns should the line have no process to wait for.
+	JobHandle submit(std::string_view line, Callback onDone = nullptr) {
+		auto job = std::make_shared<Job>();
+		job->sequence = Parser(Lexer(line)).parse();
+		job->onDone = std::move(onDone);
+		JobHandle handle(job->promise.get_future().share());
+		std::vector<std::shared_ptr<Job>> finished;
+		{
+			std::lock_guard lock(mutex);
+			advance(job, finished, false);
+		}
+		complete(finished);
+		return handle;
+	}
+private:
+	struct Job {
+		Sequence sequence;
+		size_t next {0};
+		// The processes of the current pipeline
+		std::unique_ptr<PipelineWait> wait;
+		bool exited {false};
+		// Set while the current pipeline is `time`d
+		std::vector<StageTime> stages;
+		double start {0};
+		JobResult result;
+		std::promise<JobResult> promise;
+		Callback onDone;
+	};
+	struct Process {
+		// Null for a background pipeline, which its line does not wait for
+		std::shared_ptr<Job> job;
+		pid_t pid;
+		size_t stage;
+	};
+	Executor executor;
+	// Guards everything below, and the executor
+	std::mutex mutex;
+	int epollFd {-1};
+	// Wakes the reaper, to stop or to notice a new deadline
+	int wakeFd {-1};
+	// By pidfd. A foreground process's pidfd belongs to its job's PipelineWait.
+	std::unordered_map<int, Process> processes;
+	bool stopping {false};
+	std::thread reaper;
+
+	// Starts job's next pipelines until one leaves processes to wait for; a job with nothing left to
+	// run is added to finished
+	void advance(const std::shared_ptr<Job>& job, std::vector<std::shared_ptr<Job>>& finished, bool onReaper) {
+		while (!job->wait || !job->wait->isRunning()) {
+			if (job->wait) {
+				finishPipeline(*job);
+			}
+			if (job->exited || job->next == job->sequence.size()) {
+				finished.push_back(job);
+				return;
+			}
+			const auto& item = job->sequence[job->next++];
+			if (auto error = std::get_if<ShellError>(&item)) {
+				job->result.status = 2;
+				job->result.error = error->message;
+				continue;
+			}
+			const auto& pipeline = std::get<Pipeline>(item);
+			const double start = pipeline.timed ? monotonicSeconds() : 0;
+			Executor::Launch launch = executor.startPipeline(pipeline, start, !onReaper);
+			job->exited = launch.exit;
+			if (launch.exit) {
+				job->result.status = launch.exitStatus.value_or(job->result.status);
+			}
+			if (launch.background) {
+				watchBackground(launch.pids);
+				job->result.status = 0;
+				continue;
+			}
+			if (launch.pids.empty()) {
+				if (!launch.exit) {
+					job->result.status = launch.status;
+					job->result.pipeStatus = launch.statuses.empty() ? std::vector<int> {launch.status} : launch.statuses;
+					job->result.failedStage = firstFailedStage(job->result.pipeStatus);
+				}
+				continue;
+			}
+			if (pipeline.timed && !launch.exit) {
+				job->start = start;
+				for (const auto& name : launch.names) {
+					job->stages.push_back(StageTime {name});
+				}
+			}
+			job->wait = std::make_unique<PipelineWait>(launch.pids, launch.feedsNext, launch.stages, launch.statusFds);
+			watch(job);
+		}
+	}
+	void watch(const std::shared_ptr<Job>& job) {
+		PipelineWait& wait = *job->wait;
+		for (size_t i = 0; i < wait.size(); i++) {
+			if (int fd = wait.getPidfd(i); fd != -1 && add(fd)) {
+				processes[fd] = Process {job, wait.getPid(i), i};
+				continue;
+			}
+			// A process whose pidfd could not be watched is waited for here and now
+			int status;
+			struct rusage usage;
+			if (wait4(wait.getPid(i), &status, 0, &usage) == -1) {
+				status = 0;
+				usage = {};
+			}
+			account(*job, i, usage);
+			wait.exited(i, status);
+		}
+		if (wait.timeout() >= 0) {
+			wake();
+		}
+	}
+	void watchBackground(const std::vector<pid_t>& pids) {
+		for (pid_t pid : pids) {
+			int fd = openPidfd(pid);
+			if (fd != -1 && add(fd)) {
+				processes[fd] = Process {nullptr, pid, 0};
+			} else if (fd != -1) {
+				close(fd);
+			}
+		}
+	}
+	bool add(int fd) {
+		struct epoll_event event {};
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+	}
+	void wake() {
+		uint64_t one = 1;
+		write(wakeFd, &one, sizeof(one));
+	}
+	void account(Job& job, size_t stage, const struct rusage& usage) {
+		addUsage(job.result.usage, usage);
+		if (!job.stages.empty()) {
+			job.stages[stage].usage = usage;
+			job.stages[stage].real = monotonicSeconds() - job.start;
+		}
+	}
+	// Takes the status of a pipeline that has finished, and prints its `time` report
+	void finishPipeline(Job& job) {
+		if (!job.exited) {
+			job.result.status = job.wait->status(executor.options.pipefail);
+			job.result.pipeStatus = job.wait->getStatuses();
+			job.result.failedStage = job.wait->getFailedStage();
+		}
+		job.wait.reset();
+		if (!job.stages.empty()) {
+			StageTime total {"total", monotonicSeconds() - job.start};
+			for (const auto& stage : job.stages) {
+				addUsage(total.usage, stage.usage);
+			}
+			executor.reportTimes(job.stages, total);
+			job.stages.clear();
+		}
+	}
+	void reap() {
+		struct epoll_event events[64];
+		int timeout = -1;
+		bool done = false;
+		while (!done) {
+			int n = epoll_wait(epollFd, events, 64, timeout);
+			std::vector<std::shared_ptr<Job>> finished;
+			{
+				std::lock_guard lock(mutex);
+				for (int i = 0; i < n; i++) {
+					collect(events[i].data.fd, finished);
+				}
+				// Cut-off stages past their grace period, and when the next one will be
+				timeout = -1;
+				for (const auto& [fd, process] : processes) {
+					if (process.job) {
+						process.job->wait->expire();
+						int next = process.job->wait->timeout();
+						timeout = next >= 0 && (timeout < 0 || next < timeout) ? next : timeout;
+					}
+				}
+				done = stopping && processes.empty();
+			}
+			complete(finished);
+		}
+	}
+	void collect(int fd, std::vector<std::shared_ptr<Job>>& finished) {
+		if (fd == wakeFd) {
+			uint64_t value;
+			read(wakeFd, &value, sizeof(value));
+			return;
+		}
+		auto it = processes.find(fd);
+		if (it == processes.end()) {
+			return;
+		}
+		int status;
+		struct rusage usage;
+		pid_t result = wait4(it->second.pid, &status, WNOHANG, &usage);
+		if (result == 0) {
+			return;
+		} else if (result == -1) {
+			status = 0;
+			usage = {};
+		}
+		Process process = std::move(it->second);
+		processes.erase(it);
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+		if (!process.job) {
+			close(fd);
+			return;
+		}
+		account(*process.job, process.stage, usage);
+		process.job->wait->exited(process.stage, status);
+		if (!process.job->wait->isRunning()) {
+			advance(process.job, finished, true);
+		}
+	}
+	// Outside the lock, so a callback may submit another line
+	static void complete(const std::vector<std::shared_ptr<Job>>& finished) {
+		for (const auto& job : finished) {
+			job->promise.set_value(job->result);
+			if (job->onDone) {
+				job->onDone(job->result);
+			}
+		}
+	}
+};
+#endif
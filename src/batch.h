@@ -0,0 +1,175 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <string_view>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <variant>
+#include <vector>
+#include <cerrno>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "executor.h"
+#include "jobs.h"
+#include "lexer.h"
+#include "token.h"
+
+// Runs batch script lines concurrently, each in a forked worker, with at most `slots` in flight.
+// A worker's stdout and stderr go to memfds and are copied out in script order once every
+// earlier line has finished, so the output matches a sequential run line for line.
+// Lines starting with `exit` or a builtin that uses the shell's state (wait, cd, set and the rest
+// of Executor::usesShellState) are barriers: every line before them finishes, and then they run in
+// the shell itself, so that what they change lasts. Each line's status is handed to recordStatus in script order,
+// before any barrier runs, so an `exit` after a barrier sees the status of the line before it.
+// Workers are waited for by their own pidfds, never with waitpid(-1), so the shell's other
+// children (background jobs, the fork server) are left to whoever owns them.
+class ParallelBatch {
+public:
+	// executeLine runs one line and returns its exit code
+	ParallelBatch(size_t slots, std::function<int(std::string_view)> executeLine, std::function<void(int)> recordStatus = nullptr)
+		: slots {slots}, executeLine {std::move(executeLine)}, recordStatus {std::move(recordStatus)} {}
+	ParallelBatch(const ParallelBatch&) = delete;
+	ParallelBatch& operator=(const ParallelBatch&) = delete;
+	~ParallelBatch() {
+		finish();
+	}
+	void run(std::string_view line) {
+		std::string first = firstWord(line);
+		if (first == "exit" || Executor::usesShellState(first)) {
+			finish();
+			executeLine(line);
+		} else if (!first.empty()) {
+			while (running >= slots) {
+				reapOne();
+			}
+			start(line);
+			flush();
+		}
+	}
+	// Waits for every line in flight and writes out all remaining output
+	void finish() {
+		while (running > 0) {
+			reapOne();
+		}
+		flush();
+	}
+private:
+	struct Worker {
+		pid_t pid;
+		// -1 if pidfd_open failed; the worker is then waited for by blocking on its pid
+		int pidfd;
+		int outFd;
+		int errFd;
+		bool done;
+		int status;
+	};
+	size_t slots;
+	std::function<int(std::string_view)> executeLine;
+	std::function<void(int)> recordStatus;
+	std::deque<Worker> workers;
+	size_t running {0};
+
+	// First word of a line, "" for a blank line; a line that does not lex is handed to a worker to report
+	static std::string firstWord(std::string_view line) {
+		Lexer lexer(line);
+		auto tok = lexer.getToken();
+		if (auto ptr = std::get_if<Token>(&tok)) {
+			return ptr->type == Type::END ? "" : std::string(ptr->value);
+		}
+		return std::string(line);
+	}
+	void start(std::string_view line) {
+		int outFd = memfd_create("ash-stdout", MFD_CLOEXEC);
+		int errFd = memfd_create("ash-stderr", MFD_CLOEXEC);
+		if (outFd == -1 || errFd == -1) {
+			throw std::runtime_error("memfd_create failed");
+		}
+		std::cout.flush();
+		std::cerr.flush();
+		pid_t pid = fork();
+		if (pid < 0) {
+			throw std::runtime_error("Fork failed");
+		} else if (pid == 0) {
+			dup2(outFd, STDOUT_FILENO);
+			dup2(errFd, STDERR_FILENO);
+			int status = executeLine(line);
+			std::cout.flush();
+			std::cerr.flush();
+			_exit(status);
+		}
+		workers.push_back(Worker {pid, openPidfd(pid), outFd, errFd, false, 0});
+		running++;
+	}
+	// Waits until at least one running worker has exited and reaps every one that has
+	void reapOne() {
+		std::vector<pollfd> fds;
+		std::vector<Worker*> polled;
+		for (auto& worker : workers) {
+			if (worker.done) {
+				continue;
+			}
+			if (worker.pidfd == -1) {
+				reap(worker);
+				return;
+			}
+			fds.push_back(pollfd {worker.pidfd, POLLIN, 0});
+			polled.push_back(&worker);
+		}
+		while (poll(fds.data(), fds.size(), -1) == -1) {
+			if (errno != EINTR) {
+				throw std::runtime_error("poll failed");
+			}
+		}
+		for (size_t i = 0; i < fds.size(); i++) {
+			if (fds[i].revents != 0) {
+				reap(*polled[i]);
+			}
+		}
+	}
+	void reap(Worker& worker) {
+		int status;
+		pid_t result;
+		while ((result = waitpid(worker.pid, &status, 0)) == -1 && errno == EINTR) {}
+		worker.status = result == -1 ? 0 : exitCode(status);
+		if (worker.pidfd != -1) {
+			close(worker.pidfd);
+			worker.pidfd = -1;
+		}
+		worker.done = true;
+		running--;
+	}
+	// Writes out the output of finished lines at the front of the queue, and records their statuses
+	void flush() {
+		while (!workers.empty() && workers.front().done) {
+			if (recordStatus) {
+				recordStatus(workers.front().status);
+			}
+			copyOut(workers.front().outFd, STDOUT_FILENO);
+			copyOut(workers.front().errFd, STDERR_FILENO);
+			close(workers.front().outFd);
+			close(workers.front().errFd);
+			workers.pop_front();
+		}
+	}
+	static void copyOut(int from, int to) {
+		off_t offset = 0;
+		off_t size = lseek(from, 0, SEEK_END);
+		while (offset < size) {
+			if (sendfile(to, from, &offset, size - offset) <= 0) {
+				char buf[65536];
+				ssize_t n = pread(from, buf, sizeof(buf), offset);
+				if (n <= 0 || write(to, buf, n) != n) {
+					return;
+				}
+				offset += n;
+			}
+		}
+	}
+};
+#endif
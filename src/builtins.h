@@ -0,0 +1,580 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <iterator>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "pipeline.h"
+
+// Streams a builtin reads and writes. The fds are the descriptors behind the streams, or -1
+// when a stream is in memory (between fused pipeline stages); flush a stream before using its fd
+struct BuiltinIO {
+	std::istream& in;
+	std::ostream& out;
+	std::ostream& err;
+	int inFd {-1};
+	int outFd {-1};
+};
+
+// A builtin returns its exit code
+using Builtin = std::function<int(const Command&, BuiltinIO&)>;
+
+// Buffered std::streambuf over a file descriptor, used when a builtin's output is redirected or piped
+class FdOutBuf : public std::streambuf {
+public:
+	explicit FdOutBuf(int fd) : fd {fd} {
+		setp(buffer, buffer + sizeof(buffer));
+	}
+	~FdOutBuf() {
+		sync();
+	}
+protected:
+	int overflow(int c) override {
+		if (sync() == -1) {
+			return traits_type::eof();
+		}
+		if (c != traits_type::eof()) {
+			*pptr() = static_cast<char>(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+	int sync() override {
+		return writeAll(pbase(), pptr() - pbase()) ? (setp(buffer, buffer + sizeof(buffer)), 0) : -1;
+	}
+	std::streamsize xsputn(const char* s, std::streamsize n) override {
+		if (n < epptr() - pptr()) {
+			memcpy(pptr(), s, n);
+			pbump(static_cast<int>(n));
+			return n;
+		}
+		return sync() == 0 && writeAll(s, n) ? n : 0;
+	}
+private:
+	int fd;
+	char buffer[4096];
+	bool writeAll(const char* s, std::streamsize n) {
+		while (n > 0) {
+			ssize_t written = write(fd, s, n);
+			if (written == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			s += written;
+			n -= written;
+		}
+		return true;
+	}
+};
+
+class FdInBuf : public std::streambuf {
+public:
+	explicit FdInBuf(int fd) : fd {fd} {
+		setg(buffer, buffer, buffer);
+	}
+protected:
+	int underflow() override {
+		ssize_t n;
+		do {
+			n = read(fd, buffer, sizeof(buffer));
+		} while (n == -1 && errno == EINTR);
+		if (n <= 0) {
+			return traits_type::eof();
+		}
+		setg(buffer, buffer, buffer + n);
+		return traits_type::to_int_type(buffer[0]);
+	}
+private:
+	int fd;
+	char buffer[4096];
+};
+
+class FdOStream : public std::ostream {
+public:
+	explicit FdOStream(int fd) : std::ostream(nullptr), buf {fd} {
+		rdbuf(&buf);
+	}
+	~FdOStream() {
+		flush();
+	}
+private:
+	FdOutBuf buf;
+};
+
+class FdIStream : public std::istream {
+public:
+	explicit FdIStream(int fd) : std::istream(nullptr), buf {fd} {
+		rdbuf(&buf);
+	}
+private:
+	FdInBuf buf;
+};
+
+// Writes the backslash escape starting at s[i] and returns the index of its last character
+inline size_t writeEscape(std::string_view s, size_t i, std::ostream& out) {
+	if (i + 1 >= s.size()) {
+		out.put('\\');
+		return i;
+	}
+	char c = s[++i];
+	switch (c) {
+		case 'n': out.put('\n'); break;
+		case 't': out.put('\t'); break;
+		case 'r': out.put('\r'); break;
+		case 'a': out.put('\a'); break;
+		case 'b': out.put('\b'); break;
+		case 'f': out.put('\f'); break;
+		case 'v': out.put('\v'); break;
+		case '\\': out.put('\\'); break;
+		case '0': {
+			int value = 0;
+			size_t end = i + 1;
+			while (end < s.size() && end < i + 4 && s[end] >= '0' && s[end] <= '7') {
+				value = value * 8 + (s[end++] - '0');
+			}
+			out.put(static_cast<char>(value));
+			return end - 1;
+		}
+		default:
+			out.put('\\');
+			out.put(c);
+	}
+	return i;
+}
+
+// echo [-n] [-e|-E] args...
+inline int builtinEcho(const Command& cmd, BuiltinIO& io) {
+	bool newline = true;
+	bool escapes = false;
+	size_t i = 1;
+	for (; i < cmd.args.size(); i++) {
+		const auto& arg = cmd.args[i];
+		if (arg.size() < 2 || arg[0] != '-' || arg.find_first_not_of("neE", 1) != std::string::npos) {
+			break;
+		}
+		for (char flag : std::string_view(arg).substr(1)) {
+			if (flag == 'n') {
+				newline = false;
+			} else {
+				escapes = flag == 'e';
+			}
+		}
+	}
+	for (size_t first = i; i < cmd.args.size(); i++) {
+		if (i > first) {
+			io.out.put(' ');
+		}
+		std::string_view arg = cmd.args[i];
+		if (!escapes) {
+			io.out << arg;
+			continue;
+		}
+		for (size_t j = 0; j < arg.size(); j++) {
+			if (arg[j] == '\\') {
+				j = writeEscape(arg, j, io.out);
+			} else {
+				io.out.put(arg[j]);
+			}
+		}
+	}
+	if (newline) {
+		io.out.put('\n');
+	}
+	return 0;
+}
+
+inline int builtinTrue(const Command&, BuiltinIO&) {
+	return 0;
+}
+
+inline int builtinFalse(const Command&, BuiltinIO&) {
+	return 1;
+}
+
+inline int builtinPwd(const Command&, BuiltinIO& io) {
+	char buf[PATH_MAX];
+	if (getcwd(buf, sizeof(buf)) == nullptr) {
+		io.err << "Error: pwd: " << strerror(errno) << std::endl;
+		return 1;
+	}
+	io.out << buf << '\n';
+	return 0;
+}
+
+// printf-style formatting of one value with a spec such as "%-8.3" plus a length/conversion suffix
+template <typename T>
+std::string formatValue(const std::string& spec, T value) {
+	char small[64];
+	int n = snprintf(small, sizeof(small), spec.c_str(), value);
+	if (n < static_cast<int>(sizeof(small))) {
+		return std::string(small, n < 0 ? 0 : n);
+	}
+	std::string result(n, '\0');
+	snprintf(result.data(), n + 1, spec.c_str(), value);
+	return result;
+}
+
+// printf format [arguments]: the format is reused while arguments remain, like bash
+inline int builtinPrintf(const Command& cmd, BuiltinIO& io) {
+	if (cmd.args.size() < 2) {
+		io.err << "Error: printf: usage: printf format [arguments]" << std::endl;
+		return 2;
+	}
+	std::string_view format = cmd.args[1];
+	size_t next = 2;
+	int status = 0;
+	auto nextArg = [&]() -> std::string_view {
+		return next < cmd.args.size() ? std::string_view(cmd.args[next++]) : std::string_view();
+	};
+	auto toInteger = [&](std::string_view arg, auto& value) {
+		if (arg.empty()) {
+			value = 0;
+			return;
+		}
+		if (arg.size() >= 2 && (arg[0] == '\'' || arg[0] == '"')) {
+			value = static_cast<unsigned char>(arg[1]);
+			return;
+		}
+		auto [end, error] = std::from_chars(arg.data(), arg.data() + arg.size(), value);
+		if (error != std::errc() || end != arg.data() + arg.size()) {
+			io.err << "Error: printf: " << arg << ": invalid number" << std::endl;
+			status = 1;
+		}
+	};
+	do {
+		size_t before = next;
+		for (size_t i = 0; i < format.size(); i++) {
+			if (format[i] == '\\') {
+				i = writeEscape(format, i, io.out);
+				continue;
+			}
+			if (format[i] != '%') {
+				io.out.put(format[i]);
+				continue;
+			}
+			size_t start = i++;
+			while (i < format.size() && strchr("-+ #0", format[i]) != nullptr) {
+				i++;
+			}
+			while (i < format.size() && ((format[i] >= '0' && format[i] <= '9') || format[i] == '.')) {
+				i++;
+			}
+			if (i >= format.size()) {
+				io.out << format.substr(start);
+				break;
+			}
+			std::string spec(format.substr(start, i - start));
+			char conversion = format[i];
+			switch (conversion) {
+				case '%':
+					io.out.put('%');
+					break;
+				case 's':
+					io.out << formatValue(spec + "s", std::string(nextArg()).c_str());
+					break;
+				case 'b': {
+					std::string_view arg = nextArg();
+					for (size_t j = 0; j < arg.size(); j++) {
+						j = arg[j] == '\\' ? writeEscape(arg, j, io.out) : (io.out.put(arg[j]), j);
+					}
+					break;
+				}
+				case 'c': {
+					std::string_view arg = nextArg();
+					io.out << formatValue(spec + "c", arg.empty() ? 0 : arg[0]);
+					break;
+				}
+				case 'd':
+				case 'i': {
+					long long value = 0;
+					toInteger(nextArg(), value);
+					io.out << formatValue(spec + "lld", value);
+					break;
+				}
+				case 'u':
+				case 'o':
+				case 'x':
+				case 'X': {
+					unsigned long long value = 0;
+					toInteger(nextArg(), value);
+					io.out << formatValue(spec + "ll" + conversion, value);
+					break;
+				}
+				case 'f':
+				case 'e':
+				case 'E':
+				case 'g':
+				case 'G': {
+					std::string arg(nextArg());
+					io.out << formatValue(spec + conversion, arg.empty() ? 0.0 : strtod(arg.c_str(), nullptr));
+					break;
+				}
+				default:
+					io.out << format.substr(start, i - start + 1);
+			}
+		}
+		if (next == before) {
+			break;
+		}
+	} while (next < cmd.args.size());
+	return status;
+}
+
+// Evaluates a test/[ expression: ! -a -o ( ), string, integer and file predicates
+class TestExpression {
+public:
+	explicit TestExpression(std::vector<std::string_view> args) : args {std::move(args)} {}
+	// 0 if true, 1 if false, 2 on a malformed expression
+	int evaluate(std::ostream& err) {
+		if (args.empty()) {
+			return 1;
+		}
+		bool result = parseOr();
+		if (!error.empty() || pos != args.size()) {
+			err << "Error: test: " << (error.empty() ? "unexpected argument " + std::string(args[pos]) : error) << std::endl;
+			return 2;
+		}
+		return result ? 0 : 1;
+	}
+private:
+	std::vector<std::string_view> args;
+	size_t pos {0};
+	std::string error;
+
+	bool more(size_t n = 1) {
+		return pos + n <= args.size();
+	}
+	bool parseOr() {
+		bool result = parseAnd();
+		while (more() && args[pos] == "-o") {
+			pos++;
+			result = parseAnd() || result;
+		}
+		return result;
+	}
+	bool parseAnd() {
+		bool result = parseNot();
+		while (more() && args[pos] == "-a") {
+			pos++;
+			result = parseNot() && result;
+		}
+		return result;
+	}
+	bool parseNot() {
+		if (more(2) && args[pos] == "!") {
+			pos++;
+			return !parseNot();
+		}
+		return parsePrimary();
+	}
+	bool parsePrimary() {
+		if (!more()) {
+			error = "argument expected";
+			return false;
+		}
+		if (args[pos] == "(" && more(3)) {
+			pos++;
+			bool result = parseOr();
+			if (!more() || args[pos] != ")") {
+				error = "missing )";
+				return false;
+			}
+			pos++;
+			return result;
+		}
+		if (more(3) && isBinary(args[pos + 1])) {
+			std::string_view left = args[pos];
+			std::string_view op = args[pos + 1];
+			std::string_view right = args[pos + 2];
+			pos += 3;
+			return binary(left, op, right);
+		}
+		if (more(2) && args[pos].size() == 2 && args[pos][0] == '-' && strchr("nzefdrwxsLh", args[pos][1]) != nullptr) {
+			char op = args[pos][1];
+			std::string_view operand = args[pos + 1];
+			pos += 2;
+			return unary(op, operand);
+		}
+		return !args[pos++].empty();
+	}
+	static bool isBinary(std::string_view op) {
+		return op == "=" || op == "==" || op == "!=" || op == "-eq" || op == "-ne" ||
+			op == "-lt" || op == "-le" || op == "-gt" || op == "-ge";
+	}
+	bool binary(std::string_view left, std::string_view op, std::string_view right) {
+		if (op == "=" || op == "==") {
+			return left == right;
+		} else if (op == "!=") {
+			return left != right;
+		}
+		long long a = integer(left);
+		long long b = integer(right);
+		if (op == "-eq") return a == b;
+		if (op == "-ne") return a != b;
+		if (op == "-lt") return a < b;
+		if (op == "-le") return a <= b;
+		if (op == "-gt") return a > b;
+		return a >= b;
+	}
+	long long integer(std::string_view s) {
+		long long value = 0;
+		auto [end, result] = std::from_chars(s.data(), s.data() + s.size(), value);
+		if (result != std::errc() || end != s.data() + s.size()) {
+			error = std::string(s) + ": integer expression expected";
+		}
+		return value;
+	}
+	bool unary(char op, std::string_view operand) {
+		if (op == 'n') {
+			return !operand.empty();
+		} else if (op == 'z') {
+			return operand.empty();
+		}
+		std::string path(operand);
+		struct stat st;
+		if (op == 'L' || op == 'h') {
+			return lstat(path.c_str(), &st) == 0 && S_ISLNK(st.st_mode);
+		}
+		if (stat(path.c_str(), &st) == -1) {
+			return false;
+		}
+		switch (op) {
+			case 'f': return S_ISREG(st.st_mode);
+			case 'd': return S_ISDIR(st.st_mode);
+			case 's': return st.st_size > 0;
+			case 'r': return access(path.c_str(), R_OK) == 0;
+			case 'w': return access(path.c_str(), W_OK) == 0;
+			case 'x': return access(path.c_str(), X_OK) == 0;
+			default: return true;
+		}
+	}
+};
+
+// Copies everything from one fd to another without bringing the bytes into user space where the
+// kernel allows it: splice when either end is a pipe, copy_file_range between regular files and
+// sendfile from a regular file to anything else. Each step falls back to the next when the kernel
+// refuses the pair, ending with read/write, which also reports any real error.
+inline bool copyFd(int from, int to) {
+	struct stat in, out;
+	if (fstat(from, &in) == -1 || fstat(to, &out) == -1) {
+		return false;
+	}
+	ssize_t n;
+	if (S_ISFIFO(in.st_mode) || S_ISFIFO(out.st_mode)) {
+		while ((n = splice(from, nullptr, to, nullptr, 1 << 20, SPLICE_F_MOVE)) > 0 || (n == -1 && errno == EINTR)) {
+		}
+		if (n == 0) {
+			return true;
+		}
+	}
+	if (S_ISREG(in.st_mode) && S_ISREG(out.st_mode)) {
+		while ((n = copy_file_range(from, nullptr, to, nullptr, 1 << 30, 0)) > 0 || (n == -1 && errno == EINTR)) {
+		}
+		if (n == 0) {
+			return true;
+		}
+	}
+	if (S_ISREG(in.st_mode)) {
+		while ((n = sendfile(to, from, nullptr, 1 << 30)) > 0 || (n == -1 && errno == EINTR)) {
+		}
+		if (n == 0) {
+			return true;
+		}
+	}
+	char buf[65536];
+	while ((n = read(from, buf, sizeof(buf))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		for (ssize_t done = 0; done < n;) {
+			ssize_t written = write(to, buf + done, n - done);
+			if (written == -1 && errno != EINTR) {
+				return false;
+			}
+			done += std::max<ssize_t>(written, 0);
+		}
+	}
+	return true;
+}
+
+// The builtin cat takes no options: a cat given any (-n, -A, --, ...) is left to the cat program
+inline bool catHandles(const Command& cmd) {
+	return std::none_of(cmd.args.begin() + 1, cmd.args.end(), [](const auto& arg) { return arg.size() > 1 && arg[0] == '-'; });
+}
+
+// cat [file...]: stdin is read when there are no files or for "-". Between fds the copy is
+// zero-copy (see copyFd); only an in-memory stream between fused stages is copied by hand.
+inline int builtinCat(const Command& cmd, BuiltinIO& io) {
+	int status = 0;
+	std::vector<std::string_view> names(cmd.args.begin() + 1, cmd.args.end());
+	if (names.empty()) {
+		names.push_back("-");
+	}
+	for (std::string_view name : names) {
+		int fd = io.inFd;
+		if (name != "-") {
+			fd = open(std::string(name).c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd == -1) {
+				io.err << "Error: cat: " << name << ": " << strerror(errno) << std::endl;
+				status = 1;
+				continue;
+			}
+		}
+		bool copied = true;
+		if (fd == -1) {
+			std::copy(std::istreambuf_iterator<char>(io.in), std::istreambuf_iterator<char>(), std::ostreambuf_iterator<char>(io.out));
+		} else if (io.outFd != -1) {
+			io.out.flush();
+			copied = copyFd(fd, io.outFd);
+		} else {
+			char buf[65536];
+			ssize_t n;
+			while ((n = read(fd, buf, sizeof(buf))) > 0 || (n == -1 && errno == EINTR)) {
+				io.out.write(buf, std::max<ssize_t>(n, 0));
+			}
+			copied = n == 0;
+		}
+		if (!copied) {
+			io.err << "Error: cat: " << name << ": " << strerror(errno) << std::endl;
+			status = 1;
+		}
+		if (fd != io.inFd) {
+			close(fd);
+		}
+	}
+	return status;
+}
+
+// test expr, or [ expr ]
+inline int builtinTest(const Command& cmd, BuiltinIO& io) {
+	size_t end = cmd.args.size();
+	if (cmd.args[0] == "[") {
+		if (cmd.args.back() != "]") {
+			io.err << "Error: [: missing ]" << std::endl;
+			return 2;
+		}
+		end--;
+	}
+	std::vector<std::string_view> args(cmd.args.begin() + 1, cmd.args.begin() + end);
+	return TestExpression(std::move(args)).evaluate(io.err);
+}
+#endif
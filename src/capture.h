@@ -0,0 +1,117 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <string>
+#include <string_view>
+#include <stdexcept>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// One captured output stream (see Executor::capture). Output is read straight into the caller's
+// string, which grows as it needs to. Past spillSize, the output moves to a memfd and later data is
+// spliced into it without passing through user space; the memfd is mapped once the output has ended.
+// Either way, view() is the whole output, with no copy made to return it.
+class Capture {
+public:
+	static constexpr size_t DEFAULT_SPILL_SIZE = 4 << 20;
+	explicit Capture(std::string& buffer, size_t spillSize = DEFAULT_SPILL_SIZE) : buffer {buffer}, spillSize {spillSize} {}
+	Capture(const Capture&) = delete;
+	Capture& operator=(const Capture&) = delete;
+	~Capture() {
+		if (mapping != MAP_FAILED) munmap(mapping, size);
+		if (memfd != -1) close(memfd);
+	}
+	// Valid once the capture has finished, until the Capture is destroyed
+	std::string_view view() const {
+		if (memfd == -1) {
+			return buffer;
+		}
+		return mapping == MAP_FAILED ? std::string_view() : std::string_view(static_cast<const char*>(mapping), size);
+	}
+	// Whether the output moved to a memfd, in which case the caller's string is left empty
+	bool isSpilled() const {
+		return memfd != -1;
+	}
+	// The memfd holding spilled output, for passing on elsewhere; -1 if the output is in the string
+	int getFd() const {
+		return memfd;
+	}
+	// Moves what fd has available into the capture; false at end of file or on a read error
+	bool readFrom(int fd) {
+		if (memfd == -1 && buffer.size() + CHUNK > spillSize) {
+			spill();
+		}
+		ssize_t n;
+		if (memfd != -1) {
+			loff_t offset = size;
+			while ((n = splice(fd, nullptr, memfd, &offset, CHUNK, SPLICE_F_MOVE)) == -1 && errno == EINTR) {
+			}
+			size += n > 0 ? n : 0;
+			return n > 0;
+		}
+		size_t used = buffer.size();
+		buffer.resize(used + CHUNK);
+		while ((n = read(fd, buffer.data() + used, CHUNK)) == -1 && errno == EINTR) {
+		}
+		buffer.resize(used + (n > 0 ? n : 0));
+		return n > 0;
+	}
+	// Maps spilled output for view(); called once the output has ended
+	void finish() {
+		if (memfd != -1 && mapping == MAP_FAILED && size > 0) {
+			mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, memfd, 0);
+		}
+	}
+private:
+	// As much as a default pipe holds
+	static constexpr size_t CHUNK = 64 << 10;
+	std::string& buffer;
+	size_t spillSize;
+	int memfd {-1};
+	size_t size {0};
+	void* mapping {MAP_FAILED};
+
+	void spill() {
+		memfd = memfd_create("ash-capture", MFD_CLOEXEC);
+		if (memfd == -1) {
+			throw std::runtime_error("memfd_create failed");
+		}
+		for (size_t done = 0; done < buffer.size();) {
+			ssize_t n = write(memfd, buffer.data() + done, buffer.size() - done);
+			if (n == -1 && errno != EINTR) {
+				throw std::runtime_error("Failed to spill captured output");
+			}
+			done += n > 0 ? n : 0;
+		}
+		size = buffer.size();
+		buffer.clear();
+		buffer.shrink_to_fit();
+	}
+};
+
+// Reads both pipes into their captures until each has reached end of file, then finishes them
+inline void drainCaptures(int outFd, Capture& out, int errFd, Capture& err) {
+	struct pollfd fds[2] = {{outFd, POLLIN, 0}, {errFd, POLLIN, 0}};
+	Capture* captures[2] = {&out, &err};
+	int open = 2;
+	while (open > 0) {
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		for (int i = 0; i < 2; i++) {
+			if (fds[i].fd != -1 && fds[i].revents && !captures[i]->readFrom(fds[i].fd)) {
+				fds[i].fd = -1;
+				open--;
+			}
+		}
+	}
+	out.finish();
+	err.finish();
+}
+#endif
@@ -0,0 +1,362 @@
+#ifndef COMPILED_H
+#define COMPILED_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdexcept>
+#include <memory_resource>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "pipeline.h"
+#include "shellerror.h"
+
+// Compiled scripts (.ashc): the parsed ASTs of a batch script in a compact binary form that runs
+// without lexing or parsing. Identical lines share one encoded Sequence. Integers are native
+// byte order and read with memcpy, so the file can be used straight from an mmap.
+//
+//   header      magic "ASHC", u32 version, then the source script's path (u32 length, bytes),
+//               which every version keeps here so any .ashc can be recompiled from its source
+//   stamp       u64 source FNV-1a hash, u64 source size, i64 source mtime (ns)
+//   counts      u32 distinct Sequence count, u64 line count
+//   offsets     u64 file offset of each distinct Sequence
+//   lines       u32 Sequence index of each script line
+//   sequences   u32 item count, then per item u8 kind: 0 = Pipeline (u8 timed, u64 pipe size,
+//               string cpus, u32 command count, commands), 1 = ShellError (u8 type, string message)
+//   command     u8 background, u32 arg count, strings, then the Redirect: u32 op count, per FdOp
+//               u8 kind, i32 fd, i32 from, string path, i32 flags, then the Placement: string cpus,
+//               i32 nice, u32 limit count, per limit i32 resource, u64 value
+//   string      u32 length, bytes
+constexpr char ASHC_MAGIC[4] = {'A', 'S', 'H', 'C'};
+// Bump whenever the AST or the encoding changes; older files are recompiled from their source
+constexpr uint32_t ASHC_VERSION = 4;
+
+// What a compiled script remembers about its source, to tell whether it is still current
+struct SourceStamp {
+	uint64_t hash {0};
+	uint64_t size {0};
+	int64_t mtime {0};
+};
+
+// 64-bit FNV-1a, continued from hash
+inline uint64_t fnv1a(std::string_view data, uint64_t hash = 14695981039346656037ULL) {
+	for (unsigned char c : data) {
+		hash = (hash ^ c) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+inline int64_t mtimeNanos(const struct stat& st) {
+	return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+// Stamp of the file at path; throws std::invalid_argument if it cannot be read
+inline SourceStamp stampFile(const std::string& path) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		std::string error = strerror(errno);
+		if (fd != -1) close(fd);
+		throw std::invalid_argument(path + ": " + error);
+	}
+	SourceStamp stamp {fnv1a(""), static_cast<uint64_t>(st.st_size), mtimeNanos(st)};
+	std::vector<char> buf(1 << 20);
+	ssize_t n;
+	while ((n = read(fd, buf.data(), buf.size())) > 0 || (n == -1 && errno == EINTR)) {
+		stamp.hash = fnv1a(std::string_view(buf.data(), n > 0 ? n : 0), stamp.hash);
+	}
+	close(fd);
+	return stamp;
+}
+
+// Builds a compiled script line by line, in order: add() appends a line with its parsed Sequence,
+// repeat() a line equal to an earlier one, which then shares its encoding
+class CompiledScriptWriter {
+public:
+	// Returns the id to repeat() the line by
+	size_t add(const Sequence& sequence) {
+		size_t id = offsets.size();
+		offsets.push_back(blob.size());
+		encode(sequence);
+		lines.push_back(static_cast<uint32_t>(id));
+		return id;
+	}
+	void repeat(size_t id) {
+		lines.push_back(static_cast<uint32_t>(id));
+	}
+	// The compiled script's bytes, for a file or for any other consumer of parsed commands
+	std::string serialize(const std::string& source, const SourceStamp& stamp) const {
+		std::string out;
+		out.append(ASHC_MAGIC, sizeof(ASHC_MAGIC));
+		put(out, ASHC_VERSION);
+		put(out, static_cast<uint32_t>(source.size()));
+		out += source;
+		put(out, stamp.hash);
+		put(out, stamp.size);
+		put(out, stamp.mtime);
+		put(out, static_cast<uint32_t>(offsets.size()));
+		put(out, static_cast<uint64_t>(lines.size()));
+		uint64_t base = out.size() + offsets.size() * sizeof(uint64_t) + lines.size() * sizeof(uint32_t);
+		for (uint64_t offset : offsets) {
+			put(out, base + offset);
+		}
+		for (uint32_t line : lines) {
+			put(out, line);
+		}
+		out += blob;
+		return out;
+	}
+	// Writes to a temporary file renamed over path, so a reader that has the old file mapped keeps
+	// a consistent copy; throws std::invalid_argument on failure
+	void write(const std::string& path, const std::string& source, const SourceStamp& stamp) const {
+		std::string out = serialize(source, stamp);
+		std::string temporary = path + ".tmp";
+		int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		bool written = fd != -1;
+		for (size_t done = 0; written && done < out.size();) {
+			ssize_t n = ::write(fd, out.data() + done, out.size() - done);
+			written = n > 0 || (n == -1 && errno == EINTR);
+			done += n > 0 ? n : 0;
+		}
+		std::string error = strerror(errno);
+		if (fd != -1) close(fd);
+		if (!written || rename(temporary.c_str(), path.c_str()) == -1) {
+			error = written ? strerror(errno) : error;
+			unlink(temporary.c_str());
+			throw std::invalid_argument(path + ": " + error);
+		}
+	}
+private:
+	std::vector<uint64_t> offsets;
+	std::vector<uint32_t> lines;
+	std::string blob;
+
+	template <typename T>
+	static void put(std::string& out, T value) {
+		out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+	}
+	void putString(std::string_view s) {
+		put(blob, static_cast<uint32_t>(s.size()));
+		blob += s;
+	}
+	void encode(const Sequence& sequence) {
+		put(blob, static_cast<uint32_t>(sequence.size()));
+		for (const auto& item : sequence) {
+			if (auto error = std::get_if<ShellError>(&item)) {
+				put(blob, uint8_t {1});
+				put(blob, static_cast<uint8_t>(error->type));
+				putString(error->message);
+				continue;
+			}
+			const auto& pipeline = std::get<Pipeline>(item);
+			put(blob, uint8_t {0});
+			put(blob, static_cast<uint8_t>(pipeline.timed));
+			put(blob, static_cast<uint64_t>(pipeline.pipeSize));
+			putString(pipeline.cpus);
+			put(blob, static_cast<uint32_t>(pipeline.commands.size()));
+			for (const auto& cmd : pipeline.commands) {
+				put(blob, static_cast<uint8_t>(cmd.background));
+				put(blob, static_cast<uint32_t>(cmd.args.size()));
+				for (const auto& arg : cmd.args) {
+					putString(arg);
+				}
+				put(blob, static_cast<uint32_t>(cmd.redirection.ops.size()));
+				for (const auto& op : cmd.redirection.ops) {
+					put(blob, static_cast<uint8_t>(op.kind));
+					put(blob, static_cast<int32_t>(op.fd));
+					put(blob, static_cast<int32_t>(op.from));
+					putString(op.path);
+					put(blob, static_cast<int32_t>(op.flags));
+				}
+				const Placement& p = cmd.placement;
+				putString(p.cpus);
+				put(blob, static_cast<int32_t>(p.nice));
+				put(blob, static_cast<uint32_t>(p.limits.size()));
+				for (const auto& limit : p.limits) {
+					put(blob, static_cast<int32_t>(limit.resource));
+					put(blob, static_cast<uint64_t>(limit.value));
+				}
+			}
+		}
+	}
+};
+
+// Reads a compiled script from its bytes (typically a mapping), which must outlive it.
+// Malformed input throws std::invalid_argument rather than being trusted.
+class CompiledScript {
+public:
+	static bool isCompiled(std::string_view bytes) {
+		return bytes.size() >= sizeof(ASHC_MAGIC) && memcmp(bytes.data(), ASHC_MAGIC, sizeof(ASHC_MAGIC)) == 0;
+	}
+	explicit CompiledScript(std::string_view bytes) : bytes {bytes} {
+		if (!isCompiled(bytes)) {
+			throw std::invalid_argument("not a compiled script");
+		}
+		size_t pos = sizeof(ASHC_MAGIC);
+		version = get<uint32_t>(pos);
+		uint32_t pathLength = get<uint32_t>(pos);
+		source = std::string(take(pos, pathLength));
+		if (version != ASHC_VERSION) {
+			return;
+		}
+		stamp.hash = get<uint64_t>(pos);
+		stamp.size = get<uint64_t>(pos);
+		stamp.mtime = get<int64_t>(pos);
+		sequences = get<uint32_t>(pos);
+		lines = get<uint64_t>(pos);
+		if (lines > bytes.size()) {
+			throw std::invalid_argument("corrupt compiled script");
+		}
+		offsetsAt = pos;
+		take(pos, sequences * sizeof(uint64_t));
+		linesAt = pos;
+		take(pos, lines * sizeof(uint32_t));
+	}
+	// False for a file written by another version of ash, which must be recompiled
+	bool isCurrentVersion() const {
+		return version == ASHC_VERSION;
+	}
+	const std::string& getSource() const {
+		return source;
+	}
+	// Whether the source still matches: an unchanged size and mtime are trusted, anything else is
+	// settled by rehashing the source. False if the source cannot be read.
+	bool isSourceUnchanged() const {
+		struct stat st;
+		if (stat(source.c_str(), &st) == -1) {
+			return false;
+		}
+		if (static_cast<uint64_t>(st.st_size) == stamp.size && mtimeNanos(st) == stamp.mtime) {
+			return true;
+		}
+		try {
+			return stampFile(source).hash == stamp.hash;
+		} catch (const std::invalid_argument&) {
+			return false;
+		}
+	}
+	uint64_t getLineCount() const {
+		return lines;
+	}
+	// Decodes the Sequence of script line i into resource
+	Sequence line(uint64_t i, std::pmr::memory_resource* resource) const {
+		size_t pos = linesAt + i * sizeof(uint32_t);
+		uint32_t id = get<uint32_t>(pos);
+		if (id >= sequences) {
+			throw std::invalid_argument("corrupt compiled script");
+		}
+		pos = offsetsAt + id * sizeof(uint64_t);
+		pos = get<uint64_t>(pos);
+		return decode(pos, resource);
+	}
+private:
+	std::string_view bytes;
+	uint32_t version {0};
+	SourceStamp stamp;
+	uint32_t sequences {0};
+	uint64_t lines {0};
+	std::string source;
+	size_t offsetsAt {0};
+	size_t linesAt {0};
+
+	std::string_view take(size_t& pos, uint64_t length) const {
+		if (pos > bytes.size() || length > bytes.size() - pos) {
+			throw std::invalid_argument("corrupt compiled script");
+		}
+		std::string_view result = bytes.substr(pos, length);
+		pos += length;
+		return result;
+	}
+	template <typename T>
+	T get(size_t& pos) const {
+		T value;
+		memcpy(&value, take(pos, sizeof(T)).data(), sizeof(T));
+		return value;
+	}
+	std::pmr::string getString(size_t& pos, std::pmr::memory_resource* resource) const {
+		uint32_t length = get<uint32_t>(pos);
+		std::string_view s = take(pos, length);
+		return std::pmr::string(s, resource);
+	}
+	// A CPU list as the parser accepts them (see parseCpuList), or empty
+	std::pmr::string getCpus(size_t& pos, std::pmr::memory_resource* resource) const {
+		std::pmr::string cpus = getString(pos, resource);
+		if (!cpus.empty() && !parseCpuList(cpus)) {
+			throw std::invalid_argument("corrupt compiled script");
+		}
+		return cpus;
+	}
+	// Values the parser would never produce are rejected as well as truncated data, since the
+	// executor trusts them: fds outside 0..9, unknown error types, nice steps and CPU lists
+	Sequence decode(size_t pos, std::pmr::memory_resource* resource) const {
+		Sequence sequence(resource);
+		uint32_t items = get<uint32_t>(pos);
+		for (uint32_t i = 0; i < items; i++) {
+			if (get<uint8_t>(pos) == 1) {
+				uint8_t type = get<uint8_t>(pos);
+				if (type > SYNTAX_ERROR) {
+					throw std::invalid_argument("corrupt compiled script");
+				}
+				uint32_t length = get<uint32_t>(pos);
+				sequence.push_back(ShellError {static_cast<ErrorType>(type), std::string(take(pos, length))});
+				continue;
+			}
+			Pipeline pipeline {.commands = std::pmr::vector<Command>(resource), .cpus = std::pmr::string(resource)};
+			pipeline.timed = get<uint8_t>(pos) != 0;
+			pipeline.pipeSize = get<uint64_t>(pos);
+			pipeline.cpus = getCpus(pos, resource);
+			uint32_t commands = get<uint32_t>(pos);
+			for (uint32_t c = 0; c < commands; c++) {
+				Command cmd {
+					.args = Args(resource),
+					.redirection = {
+						.ops = std::pmr::vector<FdOp>(resource)
+					},
+					.placement = {
+						.cpus = std::pmr::string(resource),
+						.limits = std::pmr::vector<ResourceLimit>(resource)
+					}
+				};
+				cmd.background = get<uint8_t>(pos) != 0;
+				uint32_t argc = get<uint32_t>(pos);
+				for (uint32_t a = 0; a < argc; a++) {
+					cmd.args.push_back(getString(pos, resource));
+				}
+				uint32_t ops = get<uint32_t>(pos);
+				for (uint32_t o = 0; o < ops; o++) {
+					uint8_t kind = get<uint8_t>(pos);
+					if (kind > FdOp::CLOSE) {
+						throw std::invalid_argument("corrupt compiled script");
+					}
+					// Braced, so the fields are read in order
+					FdOp op {static_cast<FdOp::Kind>(kind), get<int32_t>(pos), get<int32_t>(pos), getString(pos, resource), get<int32_t>(pos)};
+					if (op.badFd().has_value()) {
+						throw std::invalid_argument("corrupt compiled script");
+					}
+					// As written: the parser has already left out redundant steps
+					cmd.redirection.ops.push_back(std::move(op));
+				}
+				Placement& p = cmd.placement;
+				p.cpus = getCpus(pos, resource);
+				p.nice = get<int32_t>(pos);
+				// The parser clamps nice steps to the span of nice values
+				if (p.nice < -40 || p.nice > 40) {
+					throw std::invalid_argument("corrupt compiled script");
+				}
+				uint32_t limits = get<uint32_t>(pos);
+				for (uint32_t l = 0; l < limits; l++) {
+					int resourceId = get<int32_t>(pos);
+					p.limits.push_back(ResourceLimit {resourceId, get<uint64_t>(pos)});
+				}
+				pipeline.commands.push_back(std::move(cmd));
+			}
+			sequence.push_back(std::move(pipeline));
+		}
+		return sequence;
+	}
+};
+#endif
@@ -0,0 +1,150 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "fdpass.h"
+
+// A warm shell served on a Unix socket (ash --daemon path), so a one-line command costs a connect
+// rather than a process start, and the shell's command hash table and parse cache stay warm across
+// calls. A request is one message (see fdpass.h): the command line, with the client's fds 0-2 and
+// working directory attached. The reply is the line's exit status as an i32. Requests are run one
+// at a time, in the order they arrive, so a client that connects but does not send a whole request
+// within the request timeout is dropped rather than left to hold up the rest.
+enum DaemonFd { DAEMON_STDIN, DAEMON_STDOUT, DAEMON_STDERR, DAEMON_CWD, DAEMON_FDS };
+
+inline bool daemonAddress(const char* path, struct sockaddr_un& address) {
+	address = {};
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	strcpy(address.sun_path, path);
+	return true;
+}
+
+// Client side: runs line in the daemon listening at path, with the caller's fds 0-2 and working
+// directory; returns its exit status, or -1 with errno set if the daemon could not be reached
+inline int runInDaemon(const char* path, std::string_view line) {
+	struct sockaddr_un address;
+	if (!daemonAddress(path, address)) {
+		return -1;
+	}
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	int32_t status = -1;
+	bool done = sock != -1 && cwd != -1
+		&& connect(sock, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0
+		&& sendMessage(sock, line, {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd})
+		&& readAll(sock, &status, sizeof(status));
+	int error = errno;
+	if (sock != -1) close(sock);
+	if (cwd != -1) close(cwd);
+	errno = error;
+	return done ? status : -1;
+}
+
+// Server side: the listening socket, removed again when destroyed
+class DaemonSocket {
+public:
+	struct Request {
+		int connection {-1};
+		std::string line;
+		std::vector<int> fds;
+	};
+	static constexpr int REQUEST_TIMEOUT = 2000; // ms
+	// Throws std::invalid_argument if path cannot be listened on. A socket file left behind by a
+	// daemon that is gone is replaced; one that a live daemon listens on is not.
+	explicit DaemonSocket(const char* path, int requestTimeout = REQUEST_TIMEOUT) : path {path}, requestTimeout {requestTimeout} {
+		struct sockaddr_un address;
+		if (!daemonAddress(path, address) || (sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+			fail();
+		}
+		auto bindTo = [&] {
+			return bind(sock, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0;
+		};
+		if (!bindTo() && (errno != EADDRINUSE || !isStale(address) || unlink(path) == -1 || !bindTo())) {
+			fail();
+		}
+		bound = true;
+		if (listen(sock, SOMAXCONN) == -1) {
+			fail();
+		}
+	}
+	DaemonSocket(const DaemonSocket&) = delete;
+	DaemonSocket& operator=(const DaemonSocket&) = delete;
+	~DaemonSocket() {
+		close(sock);
+		unlink(path.c_str());
+	}
+	// Waits for the next well-formed request; false only if the socket itself fails
+	bool next(Request& request) {
+		while (true) {
+			request.connection = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+			if (request.connection == -1) {
+				if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+					continue;
+				}
+				return false;
+			}
+			struct timeval timeout {requestTimeout / 1000, requestTimeout % 1000 * 1000};
+			setsockopt(request.connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			if (receiveMessage(request.connection, request.line, request.fds) && request.fds.size() == DAEMON_FDS) {
+				return true;
+			}
+			finish(request);
+		}
+	}
+	// Sends the status and releases the request's connection and fds
+	static void reply(Request& request, int status) {
+		int32_t code = status;
+		sendAll(request.connection, &code, sizeof(code));
+		finish(request);
+	}
+private:
+	std::string path;
+	int requestTimeout;
+	int sock {-1};
+	bool bound {false};
+
+	[[noreturn]] void fail() {
+		std::string error = path + ": " + strerror(errno);
+		if (sock != -1) close(sock);
+		if (bound) unlink(path.c_str());
+		throw std::invalid_argument(error);
+	}
+	// A socket file nobody listens on, left behind by a daemon that is gone; errno is EADDRINUSE
+	// when it is not
+	static bool isStale(const struct sockaddr_un& address) {
+		struct stat st;
+		bool stale = false;
+		if (stat(address.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+			int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			stale = probe != -1 && connect(probe, reinterpret_cast<const struct sockaddr*>(&address), sizeof(address)) == -1 && errno == ECONNREFUSED;
+			if (probe != -1) close(probe);
+		}
+		errno = EADDRINUSE;
+		return stale;
+	}
+	static void finish(Request& request) {
+		for (int fd : request.fds) {
+			close(fd);
+		}
+		request.fds.clear();
+		close(request.connection);
+		request.connection = -1;
+	}
+};
+#endif
@@ -2,170 +2,794 @@
 #define EXECUTOR_H
 
 #include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
 #include <stdexcept>
 #include <string>
 #include <cstring>
 #include <vector>
 #include <regex>
 #include <optional>
+#include <unordered_map>
 #include <cctype>
 #include <variant>
 #include <filesystem>
 #include <cstdlib>
+#include <charconv>
+#include <thread>
+#include <exception>
+#include <climits>
+#include <cstdio>
+#include <cerrno>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/wait.h>
+#include <poll.h>
 #include "parser.h"
 #include "lexer.h"
 #include "token.h"
 #include "shellerror.h"
 #include "pipeline.h"
+#include "pipewait.h"
+#include "spawner.h"
+#include "forkserver.h"
+#include "pathcache.h"
+#include "jobs.h"
+#include "builtins.h"
+#include "capture.h"
+#include "fdcache.h"
+#include "timing.h"
+#include "trace.h"
+
+// The most an unprivileged process may size a pipe to, from /proc/sys/fs/pipe-max-size; read once
+inline size_t pipeMaxSize() {
+	static const size_t maxSize = [] {
+		size_t size = 1 << 20;
+		if (FILE* file = fopen("/proc/sys/fs/pipe-max-size", "re")) {
+			if (fscanf(file, "%zu", &size) != 1) {
+				size = 1 << 20;
+			}
+			fclose(file);
+		}
+		return size;
+	}();
+	return maxSize;
+}
+
+// A close-on-exec pipe whose buffer holds size bytes, or as many as pipe-max-size allows; 0 keeps
+// the kernel's default. Failing to resize, say past the user's pipe-user-pages-soft, is not an
+// error: the pipe works all the same, just with the smaller buffer.
+inline bool openPipe(int fds[2], size_t size) {
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		return false;
+	}
+	if (size > 0) {
+		fcntl(fds[1], F_SETPIPE_SZ, static_cast<int>(std::min({size, pipeMaxSize(), size_t {INT_MAX}})));
+	}
+	return true;
+}
 
 class Executor {
 public:
-	Executor() {}
-	void execute(std::vector<std::variant<Pipeline, ShellError>> sequence) {
+	Executor() {
+		builtins["echo"] = builtinEcho;
+		builtins["true"] = builtinTrue;
+		builtins["false"] = builtinFalse;
+		builtins["printf"] = builtinPrintf;
+		builtins["test"] = builtinTest;
+		builtins["["] = builtinTest;
+		builtins["pwd"] = builtinPwd;
+		builtins["cat"] = builtinCat;
+		builtins["cd"] = [this](const Command& cmd, BuiltinIO& io) { return executeCd(cmd, io); };
+		builtins["hash"] = [this](const Command& cmd, BuiltinIO& io) { return executeHash(cmd, io); };
+		builtins["jobs"] = [this](const Command& cmd, BuiltinIO& io) { return executeJobs(cmd, io); };
+		builtins["wait"] = [this](const Command& cmd, BuiltinIO& io) { return executeWait(cmd, io); };
+		builtins["set"] = [this](const Command& cmd, BuiltinIO& io) { return executeSet(cmd, io); };
+	}
+	Executor(const Executor&) = delete;
+	Executor& operator=(const Executor&) = delete;
+	// Exit code of the last foreground pipeline or wait
+	int getLastStatus() const {
+		return lastStatus;
+	}
+	// For a line run somewhere else, as in a ParallelBatch worker: its status becomes the one a bare
+	// `exit` gives
+	void setLastStatus(int status) {
+		lastStatus = status;
+	}
+	// Builtins that read or change the shell's own state (its directory, hash table, jobs or
+	// options), so only a fork of the shell itself can run them in a child
+	static bool usesShellState(std::string_view name) {
+		return name == "cd" || name == "hash" || name == "jobs" || name == "wait" || name == "set";
+	}
+	// Exit codes of the last foreground pipeline's stages in pipeline order, like bash's PIPESTATUS
+	const std::vector<int>& getPipeStatus() const {
+		return pipeStatus;
+	}
+	// Which of those stages failed first, not counting stages cut off because the stage they fed
+	// had exited; -1 if none failed
+	int getFailedStage() const {
+		return failedStage;
+	}
+	// Keeps the files of `>>` redirections open across lines and hands spawned programs dups of
+	// them (see fdcache.h); for batch scripts, which append to the same logs line after line
+	void cacheAppendFds(size_t capacity = FdCache::DEFAULT_CAPACITY) {
+		appendFds.emplace(capacity);
+	}
+	// Null unless cacheAppendFds was called
+	const FdCache* getAppendFdCache() const {
+		return appendFds ? &*appendFds : nullptr;
+	}
+	// Child processes started so far, spawned programs and forked builtins alike
+	size_t getSpawnCount() const {
+		return spawnCount;
+	}
+	// Starts a fork server (see forkserver.h) to create this shell's children from then on;
+	// false if it could not be started
+	bool startForkServer() {
+		return forkServer.start([this](const Command* first, size_t count) { return runForked(first, count); });
+	}
+	// Prints and forgets background jobs that finished since the last call
+	void notifyJobs() {
+		jobs.poll();
+		for (const auto& job : jobs.takeFinished()) {
+			std::cout << "[" << job.id << "] " << jobState(job) << "\t" << job.command << std::endl;
+		}
+	}
+	// Runs sequence; at `exit`, exits the process with its status
+	void execute(const Sequence& sequence) {
+		if (!run(sequence)) {
+			exit(lastStatus);
+		}
+	}
+	// Like execute(), but stops at `exit` and returns false instead of exiting the process;
+	// getLastStatus() is then the status `exit` gave
+	bool run(const Sequence& sequence) {
 		for (const auto& item : sequence) {
 			if (auto ptr = std::get_if<ShellError>(&item)) {
-				std::cout << ptr->message << std::endl;
+				*out << ptr->message << std::endl;
 			} else {
-				auto pipeline = std::get<Pipeline>(item);
+				const auto& pipeline = std::get<Pipeline>(item);
 				if (!executePipeline(pipeline)) {
-					exit(0);
+					return false;
 				}
 			}
 		}
+		return true;
+	}
+	// Like run(), but everything the sequence writes to stdout and stderr, from builtins, the shell's
+	// own messages and child processes alike, goes to capturedOut and capturedErr. Returns once both
+	// streams have ended, so after any background process still holding them has exited too.
+	bool capture(const Sequence& sequence, Capture& capturedOut, Capture& capturedErr) {
+		int outPipe[2];
+		int errPipe[2];
+		if (pipe2(outPipe, O_CLOEXEC) == -1) {
+			throw std::runtime_error("Failed to create pipe");
+		}
+		if (pipe2(errPipe, O_CLOEXEC) == -1) {
+			close(outPipe[0]);
+			close(outPipe[1]);
+			throw std::runtime_error("Failed to create pipe");
+		}
+		std::thread reader([&] { drainCaptures(outPipe[0], capturedOut, errPipe[0], capturedErr); });
+		bool result = true;
+		std::exception_ptr error;
+		{
+			FdOStream outStream(outPipe[1]);
+			FdOStream errStream(errPipe[1]);
+			outFd = outPipe[1];
+			errFd = errPipe[1];
+			out = &outStream;
+			err = &errStream;
+			try {
+				result = run(sequence);
+			} catch (...) {
+				error = std::current_exception();
+			}
+			outFd = STDOUT_FILENO;
+			errFd = STDERR_FILENO;
+			out = &std::cout;
+			err = &std::cerr;
+		}
+		close(outPipe[1]);
+		close(errPipe[1]);
+		reader.join();
+		close(outPipe[0]);
+		close(errPipe[0]);
+		if (error) {
+			std::rethrow_exception(error);
+		}
+		return result;
 	}
 private:
+	// The async API (see async.h) starts pipelines here and waits for them itself
+	friend class AsyncExecutor;
+	// Where a child running several builtin stages writes their statuses (see PipelineWait)
+	static constexpr int STATUS_FD = 3;
+	PathCache pathCache;
+	JobTable jobs;
+	ForkServer forkServer;
+	std::optional<FdCache> appendFds;
+	std::unordered_map<std::string, Builtin> builtins;
+	int lastStatus {0};
+	std::vector<int> pipeStatus;
+	int failedStage {-1};
+	size_t spawnCount {0};
+	// Shell options, changed with `set -o name` and `set +o name`
+	struct Options {
+		// A pipeline's status is that of its last stage to fail, rather than of its last stage;
+		// stages cut off because their reader exited do not count (see PipelineWait)
+		bool pipefail {false};
+		// Buffer size of the pipes between stages, unless a pipeline sets its own with a leading
+		// `pipesize=SIZE`; 0 keeps the kernel's default (64K)
+		size_t pipeSize {0};
+	};
+	Options options;
+	// Where output goes: fds 1 and 2, or the pipes of a capture() in progress
+	int outFd {STDOUT_FILENO};
+	int errFd {STDERR_FILENO};
+	std::ostream* out {&std::cout};
+	std::ostream* err {&std::cerr};
+	// A pipeline whose processes have been started but not waited for
+	struct Launch {
+		// Its processes in stage order, so the last one's status is the pipeline's
+		std::vector<pid_t> pids;
+		// What each process runs, for `time`
+		std::vector<std::string> names;
+		// Whether each process's stdout is the pipe into the next one (see PipelineWait)
+		std::vector<bool> feedsNext;
+		// How many stages each process runs, and the read end of the pipe a process running several
+		// reports their statuses on, or -1 (see PipelineWait)
+		std::vector<size_t> stages;
+		std::vector<int> statusFds;
+		// Each stage's status, when there is nothing to wait for
+		std::vector<int> statuses;
+		// The pipeline's status when there is nothing to wait for: that of builtins run in the shell
+		// itself, or 127 if no stage could be started
+		int status {127};
+		bool background {false};
+		// The pipeline reached `exit`; pids are the stages before it
+		bool exit {false};
+		// The N of `exit N`; without one, the last status stands
+		std::optional<int> exitStatus;
+	};
 	bool executePipeline(const Pipeline& pipeline) {
+		const double start = pipeline.timed ? monotonicSeconds() : 0;
+		Launch launch = startPipeline(pipeline, start);
+		TRACE_SPAN(WAIT);
+		if (launch.exit) {
+			int status = launch.exitStatus.value_or(lastStatus);
+			waitAll(launch.pids);
+			for (int fd : launch.statusFds) {
+				if (fd != -1) close(fd);
+			}
+			lastStatus = status;
+			return false;
+		} else if (launch.background) {
+			if (!launch.pids.empty()) {
+				int id = jobs.add(launch.pids, describe(pipeline.commands.data(), pipeline.commands.size()));
+				*out << "[" << id << "] " << launch.pids.back() << std::endl;
+			}
+		} else if (!launch.pids.empty()) {
+			waitPipeline(launch, pipeline.timed, start);
+		}
+		return true;
+	}
+	// Starts pipeline's processes; a foreground pipeline made only of builtins runs to completion
+	// here instead, and so does its `time` report, timed from start. With builtinsInShell false,
+	// only one whose builtins all use the shell's state does; the rest get a child like any other
+	// pipeline, for callers that must not block on a builtin's input or output.
+	Launch startPipeline(const Pipeline& pipeline, double start, bool builtinsInShell = true) {
+		jobs.poll();
+
+		Launch launch;
 		const size_t numCommands = pipeline.commands.size();
-		int prevPipeFd[2] = {-1, -1};
-		std::vector<pid_t> pids;
+		for (const auto& cmd : pipeline.commands) {
+			if (cmd.args.empty()) {
+				*err << "Error: Empty command in pipeline." << std::endl;
+				return launch;
+			}
+		}
+		launch.background = std::any_of(pipeline.commands.begin(), pipeline.commands.end(),
+			[](const Command& cmd) { return cmd.background; });
+		// A foreground pipeline made only of builtins runs in the shell itself, with no pipe or fork,
+		// unless it is placed on CPUs or given limits, which only a child can take
+		if (!launch.background && pipeline.cpus.empty() && isBuiltin(pipeline.commands[0]) && pipeline.commands[0].placement.empty() &&
+				std::all_of(pipeline.commands.begin() + 1, pipeline.commands.end(), [this](const Command& cmd) { return fuses(cmd); }) &&
+				(builtinsInShell || std::all_of(pipeline.commands.begin(), pipeline.commands.end(),
+					[](const Command& cmd) { return usesShellState(cmd.args[0]); }))) {
+			struct rusage before;
+			getrusage(RUSAGE_SELF, &before);
+			TRACE_SPAN(BUILTIN);
+			BuiltinIO io {std::cin, *out, *err, STDIN_FILENO, outFd};
+			launch.statuses = runBuiltins(pipeline.commands.data(), numCommands, io);
+			launch.status = lastStatus = pipelineStatus(launch.statuses, options.pipefail);
+			pipeStatus = launch.statuses;
+			failedStage = firstFailedStage(pipeStatus);
+			out->flush();
+			if (pipeline.timed) {
+				StageTime total {describe(pipeline.commands.data(), numCommands), monotonicSeconds() - start};
+				getrusage(RUSAGE_SELF, &total.usage);
+				subtractTime(total.usage.ru_utime, before.ru_utime);
+				subtractTime(total.usage.ru_stime, before.ru_stime);
+				total.usage.ru_nvcsw -= before.ru_nvcsw;
+				total.usage.ru_nivcsw -= before.ru_nivcsw;
+				reportTimes({}, total);
+			}
+			return launch;
+		}
+		int prevPipeFd = -1;
+		// Processes so far, started or not, for spreading them over the pipeline's `cpus=` list
+		size_t process = 0;
+		// The stage after the last process started, which that process feeds if it has started too
+		size_t nextStage = 0;
+		auto started = [&](pid_t pid, size_t first, size_t count, bool piped, int statusFd) {
+			if (!launch.pids.empty() && nextStage != first) {
+				launch.feedsNext.back() = false;
+			}
+			launch.pids.push_back(pid);
+			launch.stages.push_back(count);
+			launch.statusFds.push_back(statusFd);
+			launch.names.push_back(describe(&pipeline.commands[first], count));
+			launch.feedsNext.push_back(piped && !pipeline.commands[first + count - 1].redirection.sets(STDOUT_FILENO));
+			nextStage = first + count;
+		};
 
 		for (size_t i = 0; i < numCommands; i++) {
-			if (pipeline.commands[i].args[0] == "exit") {
-				if (prevPipeFd[0] != -1) close(prevPipeFd[0]);
-				if (prevPipeFd[1] != -1) close(prevPipeFd[1]);
-				for (pid_t pid : pids) {
-					int status;
-					waitpid(pid, &status, 0);
-				}
-				return false;
-			} else if (pipeline.commands[i].args[0] == "cd") {
-				executeCd(pipeline.commands[i]);
-				continue;
+			const Command& cmd = pipeline.commands[i];
+			if (cmd.args[0] == "exit") {
+				if (prevPipeFd != -1) close(prevPipeFd);
+				launch.exit = true;
+				launch.exitStatus = exitStatus(cmd);
+				return launch;
+			}
+			// Adjacent builtin stages are fused into a single child; kernel pipes are only used
+			// where a run of builtins meets an external command, or a stage that does not fuse (see
+			// fuses()).
+			size_t count = 1;
+			while (isBuiltin(cmd) && cmd.placement.empty() && i + count < numCommands && fuses(pipeline.commands[i + count])) {
+				count++;
 			}
-			bool pipeIn = i > 0;
-			bool pipeOut = i < numCommands - 1;
+			const size_t last = i + count - 1;
 			int currPipeFd[2] = {-1, -1};
-			if (pipeOut) {
-				if (pipe(currPipeFd) == -1) {
+			if (last < numCommands - 1) {
+				if (!openPipe(currPipeFd, pipeline.pipeSize ? pipeline.pipeSize : options.pipeSize)) {
 					throw std::runtime_error("Failed to create pipe");
 				}
 			}
 
-			pid_t pid = fork();
-			if (pid < 0) {
-				throw std::runtime_error("Fork failed");
-			} else if (pid == 0) {
-				if (pipeIn) {
-					dup2(prevPipeFd[0], STDIN_FILENO);
-				}
-				if (pipeOut) {
-					dup2(currPipeFd[1], STDOUT_FILENO);
-				}
-				if (prevPipeFd[0] != -1) close(prevPipeFd[0]);
-				if (prevPipeFd[1] != -1) close(prevPipeFd[1]);
-				if (currPipeFd[0] != -1) close(currPipeFd[0]);
-				if (currPipeFd[1] != -1) close(currPipeFd[1]);
-				callCommand(pipeline.commands[i], pipeIn, pipeOut);
+			SpawnPlan plan;
+			if (prevPipeFd != -1) {
+				plan.dup(prevPipeFd, STDIN_FILENO);
+			}
+			if (currPipeFd[1] != -1) {
+				plan.dup(currPipeFd[1], STDOUT_FILENO);
+			} else if (outFd != STDOUT_FILENO) {
+				plan.dup(outFd, STDOUT_FILENO);
+			}
+			if (errFd != STDERR_FILENO) {
+				plan.dup(errFd, STDERR_FILENO);
+			}
+			addPlacement(plan, cmd, pipeline.cpus, process++);
 
-				exit(EXIT_FAILURE);
+			int error = 0;
+			pid_t pid = -1;
+			std::optional<std::string> path;
+			TRACE_SPAN(SPAWN);
+			if (isBuiltin(cmd)) {
+				// The stages' own redirections are applied by runBuiltin in the child
+				if (std::any_of(&cmd, &cmd + count, [](const Command& stage) { return stage.background; })) {
+					plan.newSession();
+				}
+				// Several stages in the foreground report their statuses back on STATUS_FD
+				int statusPipe[2] = {-1, -1};
+				if (count > 1 && !launch.background && pipe2(statusPipe, O_CLOEXEC) == 0) {
+					plan.dup(statusPipe[1], STATUS_FD);
+					plan.closeInherited(STATUS_FD + 1);
+				}
+				if ((pid = forkBuiltins(plan, &cmd, count)) == -1) {
+					*err << "Error: " << cmd.args[0] << ": " << strerror(errno) << std::endl;
+					if (statusPipe[0] != -1) close(statusPipe[0]);
+				} else {
+					started(pid, i, count, currPipeFd[1] != -1, statusPipe[0]);
+				}
+				if (statusPipe[1] != -1) close(statusPipe[1]);
 			} else {
-				pids.push_back(pid);
-
-				if (pipeIn) {
-					close(prevPipeFd[0]);
-					close(prevPipeFd[1]);
+				if (cmd.background) {
+					plan.newSession();
+				}
+				if (!addRedirects(plan, cmd.redirection)) {
+					// Refused, and reported, there
+				} else if (!(path = pathCache.lookup(cmd.args[0])).has_value()) {
+					*err << "Error: " << cmd.args[0] << ": command not found" << std::endl;
+				} else if ((pid = spawnProgram(plan, path->c_str(), Argv(cmd.args), error)) == -1) {
+					*err << "Error: " << cmd.args[0] << ": " << strerror(error) << std::endl;
+				} else {
+					spawnCount++;
+					started(pid, i, 1, currPipeFd[1] != -1, -1);
 				}
-				prevPipeFd[0] = currPipeFd[0];
-				prevPipeFd[1] = currPipeFd[1];
 			}
-		}
 
-		if (prevPipeFd[0] != -1) close(prevPipeFd[0]);
-		if (prevPipeFd[1] != -1) close(prevPipeFd[1]);
+			if (prevPipeFd != -1) close(prevPipeFd);
+			if (currPipeFd[1] != -1) close(currPipeFd[1]);
+			prevPipeFd = currPipeFd[0];
+			i = last;
+		}
 
-		for (pid_t pid : pids) {
-			int status;
-			waitpid(pid, &status, 0);
+		if (prevPipeFd != -1) close(prevPipeFd);
+		return launch;
+	}
+	// The N of `exit [N]`, modulo 256 as for a process's status, or nullopt without one; 2 if N is
+	// not a number. Further arguments are ignored, as in dash.
+	std::optional<int> exitStatus(const Command& cmd) {
+		if (cmd.args.size() < 2) {
+			return std::nullopt;
 		}
-		return true;
+		std::string_view arg = cmd.args[1];
+		int status = 0;
+		auto [end, error] = std::from_chars(arg.data(), arg.data() + arg.size(), status);
+		if (arg.empty() || error != std::errc() || end != arg.data() + arg.size()) {
+			*err << "Error: exit: " << arg << ": numeric argument required" << std::endl;
+			return 2;
+		}
+		return status & 0xff;
 	}
-	char** convertArgs(std::vector<std::string> vec) {
-		char** args = new char*[vec.size() + 1];
-		for (size_t i = 0; i < vec.size(); i++) {
-			args[i] = new char[vec[i].length() + 1];
-			strcpy(args[i], vec[i].c_str());
+	// The stage's `pin`, `nice` and `limit` prefixes. Without a `pin`, the process is pinned to the
+	// process-th CPU of the pipeline's `cpus=` list, wrapping around, so adjacent stages land on
+	// adjacent CPUs of the list. The descriptor limit the job table raised for the shell goes back
+	// to what the shell was given, unless a `limit nofile` sets it.
+	void addPlacement(SpawnPlan& plan, const Command& cmd, std::string_view spread, size_t process) {
+		const Placement& placement = cmd.placement;
+		std::vector<int> cpus;
+		if (!placement.cpus.empty()) {
+			parseCpuList(placement.cpus, &cpus);
+		} else if (!spread.empty() && parseCpuList(spread, &cpus)) {
+			cpus = {cpus[process % cpus.size()]};
+		}
+		if (!cpus.empty()) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			for (int cpu : cpus) {
+				CPU_SET(cpu, &set);
+			}
+			plan.setAffinity(set);
+		}
+		plan.setNice(placement.nice);
+		if (const auto& inherited = jobs.getInheritedFdLimit()) {
+			plan.setLimit(RLIMIT_NOFILE, inherited->rlim_cur, inherited->rlim_max);
+		}
+		for (const auto& limit : placement.limits) {
+			plan.setLimit(limit.resource, limit.value);
 		}
-		args[vec.size()] = nullptr;
-		return args;
 	}
-	void callCommand(const Command& cmd, bool pipeIn, bool pipeOut) {
-		int coutfd = -1;
-		int cinfd = -1;
-		int cerrfd = -1;
-		int status;
-
-		if (cmd.redirection.coutFile != "" && !pipeIn) {
-			coutfd = open(cmd.redirection.coutFile.c_str(), O_WRONLY | O_CREAT | (cmd.redirection.coutFileAppend ? O_APPEND : O_TRUNC), 0644);
+	// Whether cmd runs as a builtin; a cat with options runs the program (see catHandles)
+	bool isBuiltin(const Command& cmd) const {
+		if (cmd.args[0] == "cat" && !catHandles(cmd)) {
+			return false;
+		}
+		return builtins.count(std::string(cmd.args[0])) > 0;
+	}
+	// What a builtin stage does with the output of the stage before it. Only cat reads its input:
+	// a cat of stdin alone with no redirections passes it on unchanged, while one that reads it
+	// among files, or redirects, mixes it with something else.
+	enum class StageInput { IGNORED, PASSED, MIXED };
+	static StageInput stageInput(const Command& cmd) {
+		if (cmd.args[0] != "cat" || cmd.redirection.sets(STDIN_FILENO)) {
+			return StageInput::IGNORED;
+		}
+		size_t dashes = std::count(cmd.args.begin() + 1, cmd.args.end(), "-");
+		if (dashes + 1 == cmd.args.size()) {
+			return cmd.redirection.ops.empty() ? StageInput::PASSED : StageInput::MIXED;
 		}
-		if (cmd.redirection.cerrFile != "") {
-			cerrfd = open(cmd.redirection.cerrFile.c_str(), O_WRONLY | O_CREAT | (cmd.redirection.cerrFileAppend ? O_APPEND : O_TRUNC), 0644);
+		return dashes > 0 ? StageInput::MIXED : StageInput::IGNORED;
+	}
+	// Whether a builtin stage can be fused behind the stage before it. One that mixes its input with
+	// other data would have to hold the whole input in memory, so it gets a pipe instead. A stage
+	// with a placement of its own gets a child of its own.
+	bool fuses(const Command& cmd) const {
+		return isBuiltin(cmd) && cmd.placement.empty() && stageInput(cmd) != StageInput::MIXED;
+	}
+	// Through the fork server while one is running, or here should it have stopped. An executable
+	// the kernel will not run (ENOEXEC: a script without a #! line) is run by /bin/sh, as execvp
+	// and sh itself do.
+	pid_t spawnProgram(const SpawnPlan& plan, const char* path, const Argv& argv, int& error) {
+		pid_t pid = spawnExec(plan, path, argv, error);
+		if (pid == -1 && error == ENOEXEC) {
+			std::vector<std::string_view> args {"/bin/sh", path};
+			for (char* const* arg = argv.data() + 1; *arg != nullptr; arg++) {
+				args.push_back(*arg);
+			}
+			pid = spawnExec(plan, "/bin/sh", Argv(args), error);
 		}
-		if (cmd.redirection.cinFile != "" && !pipeOut) {
-			cinfd = open(cmd.redirection.cinFile.c_str(), O_RDONLY);
+		return pid;
+	}
+	pid_t spawnExec(const SpawnPlan& plan, const char* path, const Argv& argv, int& error) {
+		if (forkServer.isRunning()) {
+			pid_t pid = forkServer.spawn(plan, path, argv, error);
+			if (forkServer.isRunning()) {
+				return pid;
+			}
+		}
+		return plan.spawn(path, argv, error);
+	}
+	// Runs builtin stages first[0..count) as one unit, one after another, with nothing buffered
+	// between them (see fuses()). A stage whose output the next one ignores writes nowhere. A stage
+	// that only passes its input on is not run at all: the stage before it writes straight to where
+	// its output goes, and the stage counts as succeeding. Only the first stage reads io.in.
+	// Returns each stage's status.
+	std::vector<int> runBuiltins(const Command* first, size_t count, BuiltinIO& io) {
+		std::ostream discard(nullptr);
+		std::istringstream noInput;
+		std::vector<int> statuses(count, 0);
+		for (size_t i = 0; i < count; i++) {
+			if (i > 0 && stageInput(first[i]) == StageInput::PASSED) {
+				continue;
+			}
+			size_t next = i + 1;
+			while (next < count && stageInput(first[next]) == StageInput::PASSED) {
+				next++;
+			}
+			const bool last = next == count;
+			BuiltinIO stageIO {
+				i == 0 ? io.in : noInput,
+				last ? io.out : discard,
+				io.err,
+				i == 0 ? io.inFd : -1,
+				last ? io.outFd : -1,
+			};
+			statuses[i] = runBuiltin(builtins.at(std::string(first[i].args[0])), first[i], stageIO);
+		}
+		return statuses;
+	}
+	// Runs one builtin in the current process. Its redirections are applied to a table of what
+	// each fd refers to for the call, opening files just for it; they override the streams in io, as
+	// a redirection overrides a pipe. Fds that end up referring to the same file share one stream, so
+	// `> file 2>&1` keeps the two in order.
+	int runBuiltin(const Builtin& builtin, const Command& cmd, BuiltinIO& io) {
+		// io's own streams, an fd opened here, or nothing
+		enum : int { CLOSED = -1, IO_IN = -2, IO_OUT = -3, IO_ERR = -4 };
+		if (!fdsInRange(cmd.redirection, io.err)) {
+			return 1;
+		}
+		// The parser takes single digit fds
+		int table[FdOp::MAX_FD + 1] = {IO_IN, IO_OUT, IO_ERR, CLOSED, CLOSED, CLOSED, CLOSED, CLOSED, CLOSED, CLOSED};
+		std::vector<int> opened;
+		bool applied = true;
+		for (const auto& op : cmd.redirection.ops) {
+			if (op.kind == FdOp::OPEN) {
+				int fd = ::open(op.path.c_str(), op.flags | O_CLOEXEC, 0644);
+				if (fd == -1) {
+					io.err << "Error: " << op.path << ": " << strerror(errno) << std::endl;
+					applied = false;
+					break;
+				}
+				opened.push_back(fd);
+				table[op.fd] = fd;
+			} else if (op.kind == FdOp::DUP) {
+				if (table[op.from] == CLOSED) {
+					io.err << "Error: " << op.from << ": " << strerror(EBADF) << std::endl;
+					applied = false;
+					break;
+				}
+				table[op.fd] = table[op.from];
+			} else {
+				table[op.fd] = CLOSED;
+			}
+		}
+		int status = 1;
+		if (applied) {
+			std::optional<FdIStream> fileIn;
+			// One per file, by its fd here
+			std::optional<FdOStream> fileStreams[2];
+			int streamFds[2] = {CLOSED, CLOSED};
+			auto output = [&](int fd) -> std::ostream& {
+				if (fd == IO_OUT) {
+					return io.out;
+				} else if (fd == IO_ERR) {
+					return io.err;
+				}
+				int i = streamFds[0] == fd || !fileStreams[0] ? 0 : 1;
+				if (!fileStreams[i]) {
+					// Nothing open there, or `>&0`: writes fail, as they would on a bad fd
+					fileStreams[i].emplace(fd >= 0 ? fd : -1);
+					streamFds[i] = fd;
+				}
+				return *fileStreams[i];
+			};
+			if (table[STDIN_FILENO] != IO_IN) {
+				fileIn.emplace(table[STDIN_FILENO] >= 0 ? table[STDIN_FILENO] : -1);
+			}
+			std::ostream& out = output(table[STDOUT_FILENO]);
+			std::ostream& err = output(table[STDERR_FILENO]);
+			BuiltinIO redirected {
+				fileIn ? static_cast<std::istream&>(*fileIn) : io.in,
+				out,
+				err,
+				fileIn ? std::max(table[STDIN_FILENO], -1) : io.inFd,
+				table[STDOUT_FILENO] == IO_OUT ? io.outFd : std::max(table[STDOUT_FILENO], -1),
+			};
+			status = builtin(cmd, redirected);
+		}
+		for (int fd : opened) {
+			close(fd);
+		}
+		return status;
+	}
+	// Builtin stages inside a pipeline, or in the background, run in one child, so they can stream
+	// alongside the other stages; returns -1 with errno set if the child cannot be created. The child
+	// comes from the fork server unless a stage needs the shell's own state.
+	pid_t forkBuiltins(const SpawnPlan& plan, const Command* first, size_t count) {
+		std::cout.flush();
+		std::cerr.flush();
+		out->flush();
+		err->flush();
+		if (forkServer.isRunning() && std::none_of(first, first + count, [](const Command& cmd) { return usesShellState(cmd.args[0]); })) {
+			int error;
+			pid_t pid = forkServer.run(plan, first, count, error);
+			if (forkServer.isRunning()) {
+				spawnCount += pid != -1;
+				errno = error;
+				return pid;
+			}
 		}
-		
 		pid_t pid = fork();
-		char** args = convertArgs(cmd.args);
 		if (pid == 0) {
-			if (cmd.background) {
-				setsid();
+			if (!plan.apply()) {
+				std::cerr << "Error: " << first->args[0] << ": " << strerror(errno) << std::endl;
+				_exit(1);
 			}
-			if (coutfd != -1) {
-				dup2(coutfd, STDOUT_FILENO);
+			_exit(runForked(first, count));
+		} else if (pid > 0) {
+			spawnCount++;
+		}
+		return pid;
+	}
+	// The body of a child running builtin stages, its fds already set up. Its status is the last
+	// stage's; each stage's goes to STATUS_FD if the plan set that up, as only it opens fds past 2.
+	int runForked(const Command* first, size_t count) {
+		const bool reports = fcntl(STATUS_FD, F_GETFD) != -1;
+		std::vector<int> statuses;
+		{
+			FdIStream in(STDIN_FILENO);
+			FdOStream out(STDOUT_FILENO);
+			FdOStream err(STDERR_FILENO);
+			BuiltinIO io {in, out, err, STDIN_FILENO, STDOUT_FILENO};
+			statuses = runBuiltins(first, count, io);
+		}
+		if (reports) {
+			write(STATUS_FD, statuses.data(), statuses.size() * sizeof(int));
+		}
+		return statuses.back();
+	}
+	static std::string describe(const Command* first, size_t count) {
+		std::string text;
+		for (const Command* cmd = first; cmd != first + count; cmd++) {
+			if (!text.empty()) {
+				text += " | ";
 			}
-			if (cerrfd != -1) {
-				dup2(cerrfd, STDERR_FILENO);
+			for (size_t i = 0; i < cmd->args.size(); i++) {
+				text += i == 0 ? "" : " ";
+				text += cmd->args[i];
 			}
-			if (cinfd != -1) {
-				dup2(cinfd, STDIN_FILENO);
+		}
+		return text;
+	}
+	void waitAll(const std::vector<pid_t>& pids) {
+		for (pid_t pid : pids) {
+			int status;
+			if (waitpid(pid, &status, 0) == pid && pid == pids.back()) {
+				lastStatus = exitCode(status);
 			}
-			execvp(args[0], args);
-		} else {
-			// weird bug here
-			if (cmd.background) {
-				std::cout << "[" << pid << "] " << args[0] << std::endl;
-			} else {
-				wait(&status);
+		}
+	}
+	// Reaps a foreground pipeline's processes together, in the order they exit, through their
+	// pidfds, cutting off stages whose reader has exited (see PipelineWait). A `time`d pipeline's
+	// stages each get their own wall time; wait4 supplies the resource usage.
+	void waitPipeline(const Launch& launch, bool timed, double start) {
+		PipelineWait wait(launch.pids, launch.feedsNext, launch.stages, launch.statusFds);
+		std::vector<StageTime> stages(timed ? launch.pids.size() : 0);
+		auto reap = [&](size_t i, int options) {
+			int status;
+			struct rusage usage;
+			pid_t result = wait4(wait.getPid(i), &status, options, &usage);
+			if (result == 0) {
+				return;
+			} else if (result == -1) {
+				status = 0;
+				usage = {};
 			}
-			if (coutfd != -1) {
-				close(coutfd);
+			if (timed) {
+				stages[i] = StageTime {launch.names[i], monotonicSeconds() - start, usage};
 			}
-			if (cerrfd != -1) {
-				close(cerrfd);
+			wait.exited(i, status);
+		};
+		// A process whose pidfd could not be opened is waited for up front
+		for (size_t i = 0; i < wait.size(); i++) {
+			if (wait.getPidfd(i) == -1) {
+				reap(i, 0);
 			}
-			if (cinfd != -1) {
-				close(cinfd);
+		}
+		std::vector<struct pollfd> fds;
+		std::vector<size_t> polled;
+		while (wait.isRunning()) {
+			fds.clear();
+			polled.clear();
+			for (size_t i = 0; i < wait.size(); i++) {
+				if (wait.getPidfd(i) != -1) {
+					fds.push_back({wait.getPidfd(i), POLLIN, 0});
+					polled.push_back(i);
+				}
+			}
+			// Should poll itself fail, the remaining stages are reaped with blocking waits
+			bool failed = poll(fds.data(), fds.size(), wait.timeout()) == -1 && errno != EINTR;
+			for (size_t k = 0; k < fds.size(); k++) {
+				if (fds[k].revents || failed) {
+					reap(polled[k], failed ? 0 : WNOHANG);
+				}
+			}
+			wait.expire();
+		}
+		lastStatus = wait.status(options.pipefail);
+		pipeStatus = wait.getStatuses();
+		failedStage = wait.getFailedStage();
+		if (timed) {
+			StageTime total {"total", monotonicSeconds() - start};
+			for (const auto& stage : stages) {
+				addUsage(total.usage, stage.usage);
+			}
+			reportTimes(stages, total);
+		}
+	}
+	// `time` output goes to stderr, one line per stage and one for the pipeline, in TIMEFORMAT
+	void reportTimes(const std::vector<StageTime>& stages, const StageTime& total) {
+		const char* format = std::getenv("TIMEFORMAT");
+		format = format ? format : DEFAULT_TIMEFORMAT;
+		for (const auto& stage : stages) {
+			*err << formatTime(format, stage) << std::endl;
+		}
+		*err << formatTime(format, total) << std::endl;
+	}
+	// Redirections are applied after the pipe dups, so an explicit file wins over the pipe. When
+	// they involve fds above 2, the shell's own are closed before them, so those they set up stay
+	// open for the program; otherwise an append can be a dup of a cached fd of the shell's.
+	// False, having said so, if an op names an fd the parser would not take
+	bool addRedirects(SpawnPlan& plan, const Redirect& redirection) {
+		if (!fdsInRange(redirection, *err)) {
+			return false;
+		}
+		bool ownFds = std::any_of(redirection.ops.begin(), redirection.ops.end(),
+			[](const FdOp& op) { return op.fd > STDERR_FILENO || op.from > STDERR_FILENO; });
+		if (ownFds) {
+			plan.closeInherited();
+		}
+		for (const auto& op : redirection.ops) {
+			int cached = -1;
+			if (op.kind == FdOp::OPEN && appendFds && !ownFds && FdCache::isCacheable(op.flags)) {
+				cached = appendFds->get(op.path, op.flags);
+			}
+			if (cached != -1) {
+				plan.dup(cached, op.fd);
+			} else if (op.kind == FdOp::OPEN) {
+				plan.open(op.fd, op.path.c_str(), op.flags);
+			} else if (op.kind == FdOp::DUP) {
+				plan.dup(op.from, op.fd);
+			} else {
+				plan.close(op.fd);
 			}
-
 		}
-		for (size_t i = 0; i < cmd.args.size(); i++) {
-			delete[] args[i];
+		return true;
+	}
+	// Redirections come from the parser or a compiled script, which both keep to single digit fds;
+	// anything else is refused rather than trusted
+	static bool fdsInRange(const Redirect& redirection, std::ostream& err) {
+		if (auto fd = redirection.badFd()) {
+			err << "Error: " << *fd << ": " << strerror(EBADF) << std::endl;
+			return false;
 		}
-		delete[] args;
+		return true;
 	}
-	void executeCd(const Command& cmd) {
+	int executeCd(const Command& cmd, BuiltinIO& io) {
 		if (cmd.args.size() == 1) {
 			std::filesystem::current_path(std::getenv("HOME"));
 		} else if (cmd.args.size() == 2) {
@@ -173,11 +797,139 @@ private:
 			if (std::filesystem::is_directory(newpath)) {
 				std::filesystem::current_path(newpath);
 			} else {
-				std::cout << "Error: Invalid directory";
+				io.out << "Error: Invalid directory";
+				return 1;
+			}
+		} else {
+			io.out << "Error: Too many arguments.";
+			return 1;
+		}
+		return 0;
+	}
+	// hash: list cached command paths, hash -r: forget them, hash name...: look names up now
+	int executeHash(const Command& cmd, BuiltinIO& io) {
+		if (cmd.args.size() == 1) {
+			const auto& entries = pathCache.getEntries();
+			if (entries.empty()) {
+				io.out << "hash: hash table empty" << std::endl;
+				return 0;
 			}
+			io.out << "hits\tcommand" << std::endl;
+			for (const auto& [name, entry] : entries) {
+				io.out << std::setw(4) << entry.hits << "\t" << entry.path << std::endl;
+			}
+		} else if (cmd.args[1] == "-r") {
+			pathCache.clear();
 		} else {
-			std::cout << "Error: Too many arguments.";
+			int status = 0;
+			for (size_t i = 1; i < cmd.args.size(); i++) {
+				if (!pathCache.lookup(cmd.args[i]).has_value()) {
+					io.out << "Error: hash: " << cmd.args[i] << ": not found" << std::endl;
+					status = 1;
+				}
+			}
+			return status;
+		}
+		return 0;
+	}
+	static std::string jobState(const JobTable::Job& job) {
+		if (!job.done) {
+			return "Running";
+		}
+		return job.status == 0 ? "Done" : "Exit " + std::to_string(job.status);
+	}
+	// jobs: list background jobs, jobs -l: also their pids and, once finished, resource usage
+	int executeJobs(const Command& cmd, BuiltinIO& io) {
+		bool details = cmd.args.size() > 1 && cmd.args[1] == "-l";
+		jobs.poll();
+		for (const auto& [id, job] : jobs.getJobs()) {
+			io.out << "[" << id << "] " << jobState(job) << "\t" << job.command << std::endl;
+			if (!details) {
+				continue;
+			}
+			io.out << "    pids:";
+			for (pid_t pid : job.pids) {
+				io.out << " " << pid;
+			}
+			io.out << std::endl;
+			if (job.done) {
+				io.out << std::fixed << std::setprecision(3)
+					<< "    user " << job.usage.ru_utime.tv_sec + job.usage.ru_utime.tv_usec / 1e6 << "s"
+					<< " sys " << job.usage.ru_stime.tv_sec + job.usage.ru_stime.tv_usec / 1e6 << "s"
+					<< " maxrss " << job.usage.ru_maxrss << "KB" << std::endl;
+				io.out.unsetf(std::ios::floatfield);
+			}
+		}
+		return 0;
+	}
+	// wait: all jobs, wait N / wait %N: job N, wait -n: the next job to finish
+	int executeWait(const Command& cmd, BuiltinIO& io) {
+		if (cmd.args.size() == 1) {
+			jobs.waitAll();
+			return 0;
+		}
+		int status = 0;
+		for (size_t i = 1; i < cmd.args.size(); i++) {
+			std::string_view arg = cmd.args[i];
+			std::optional<int> jobStatus;
+			if (arg == "-n") {
+				jobStatus = jobs.waitNext();
+			} else {
+				if (!arg.empty() && arg[0] == '%') {
+					arg.remove_prefix(1);
+				}
+				int id = 0;
+				auto [end, error] = std::from_chars(arg.data(), arg.data() + arg.size(), id);
+				if (error == std::errc() && end == arg.data() + arg.size()) {
+					jobStatus = jobs.wait(id);
+				}
+				if (!jobStatus.has_value()) {
+					io.out << "Error: wait: " << cmd.args[i] << ": no such job" << std::endl;
+				}
+			}
+			status = jobStatus.value_or(127);
+		}
+		return status;
+	}
+	// set -o: list the options, set -o name: turn one on, set +o name: turn it off. pipesize takes
+	// a value, as in `set -o pipesize=1M`; `set +o pipesize` goes back to the kernel's default.
+	int executeSet(const Command& cmd, BuiltinIO& io) {
+		if (cmd.args.size() == 1 || (cmd.args.size() == 2 && cmd.args[1] == "-o")) {
+			io.out << "pipefail\t" << (options.pipefail ? "on" : "off") << std::endl;
+			io.out << "pipesize\t";
+			if (options.pipeSize) {
+				io.out << options.pipeSize << std::endl;
+			} else {
+				io.out << "default" << std::endl;
+			}
+			return 0;
+		}
+		int status = 0;
+		for (size_t i = 1; i < cmd.args.size(); i++) {
+			std::string_view flag = cmd.args[i];
+			if ((flag != "-o" && flag != "+o") || i + 1 == cmd.args.size()) {
+				io.err << "Error: set: usage: set [-o|+o] option" << std::endl;
+				return 2;
+			}
+			std::string_view name = cmd.args[++i];
+			if (name == "pipefail") {
+				options.pipefail = flag == "-o";
+			} else if (name == "pipesize" && flag == "+o") {
+				options.pipeSize = 0;
+			} else if (name.substr(0, 9) == "pipesize=" && flag == "-o") {
+				auto size = parseSize(name.substr(9));
+				if (!size.has_value() || *size == 0) {
+					io.err << "Error: set: " << name.substr(9) << ": invalid pipe size" << std::endl;
+					status = 1;
+					continue;
+				}
+				options.pipeSize = *size;
+			} else {
+				io.err << "Error: set: " << name << ": invalid option name" << std::endl;
+				status = 1;
+			}
 		}
+		return status;
 	}
 };
 #endif
@@ -0,0 +1,109 @@
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Append targets kept open across lines, for batch scripts that append to the same few logs over
+// and over (`cmd >> run.log`): a child gets a dup of the cached fd instead of opening the file
+// itself. Entries are keyed by path and open flags and remember the file's device and inode. Each
+// lookup stats the path, and an entry whose path no longer leads to that file is dropped. This
+// happens when the file was renamed or deleted, as in log rotation, or when a relative path now
+// resolves elsewhere. At most capacity files are held open; the least recently used is closed to
+// make room.
+class FdCache {
+public:
+	static constexpr size_t DEFAULT_CAPACITY = 16;
+	explicit FdCache(size_t capacity = DEFAULT_CAPACITY) : capacity {capacity} {}
+	FdCache(const FdCache&) = delete;
+	FdCache& operator=(const FdCache&) = delete;
+	~FdCache() {
+		clear();
+	}
+	// Only appends can share one open file: a truncating open has to truncate every time
+	static bool isCacheable(int flags) {
+		return (flags & O_APPEND) && !(flags & O_TRUNC);
+	}
+	// An fd open on path with flags, owned by the cache, which a child can dup; -1 if the file cannot
+	// be opened here, in which case the child should open it itself and report the error
+	int get(std::string_view path, int flags) {
+		if (capacity == 0) {
+			return -1;
+		}
+		std::string key(path);
+		key += '\0';
+		key += std::to_string(flags);
+		auto it = entries.find(key);
+		struct stat st;
+		bool exists = stat(key.c_str(), &st) == 0;
+		if (it != entries.end()) {
+			Entry& entry = *it->second;
+			if (exists && st.st_dev == entry.dev && st.st_ino == entry.ino) {
+				hits++;
+				lru.splice(lru.begin(), lru, it->second);
+				return entry.fd;
+			}
+			invalidations++;
+			erase(it);
+		}
+		misses++;
+		int fd = ::open(key.c_str(), flags | O_CLOEXEC, 0644);
+		if (fd == -1 || fstat(fd, &st) == -1) {
+			if (fd != -1) close(fd);
+			return -1;
+		}
+		if (entries.size() >= capacity) {
+			erase(entries.find(lru.back().key));
+		}
+		lru.push_front(Entry {key, fd, st.st_dev, st.st_ino});
+		entries.emplace(std::move(key), lru.begin());
+		return fd;
+	}
+	void clear() {
+		for (const auto& entry : lru) {
+			close(entry.fd);
+		}
+		lru.clear();
+		entries.clear();
+	}
+	size_t getSize() const {
+		return entries.size();
+	}
+	size_t getHits() const {
+		return hits;
+	}
+	size_t getMisses() const {
+		return misses;
+	}
+	// Entries dropped because their path had come to lead elsewhere
+	size_t getInvalidations() const {
+		return invalidations;
+	}
+private:
+	struct Entry {
+		// The path, NUL, then the flags: the path alone as a C string
+		std::string key;
+		int fd;
+		dev_t dev;
+		ino_t ino;
+	};
+	size_t capacity;
+	// Most recently used first
+	std::list<Entry> lru;
+	std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+	size_t hits {0};
+	size_t misses {0};
+	size_t invalidations {0};
+
+	void erase(std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it) {
+		close(it->second->fd);
+		lru.erase(it->second);
+		entries.erase(it);
+	}
+};
+#endif
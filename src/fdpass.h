@@ -0,0 +1,120 @@
+#ifndef FDPASS_H
+#define FDPASS_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Messages over a Unix stream socket: a u32 length, then the payload, with file descriptors
+// attached to the first bytes as SCM_RIGHTS. Sends never raise SIGPIPE; a peer that has gone
+// away is just a failed send. A payload is at most MAX_MESSAGE bytes, so a peer cannot make the
+// receiver allocate whatever its length claims.
+constexpr size_t MAX_PASSED_FDS = 16;
+constexpr size_t MAX_MESSAGE = 8 << 20;
+
+inline bool readAll(int fd, void* data, size_t size) {
+	for (size_t done = 0; done < size;) {
+		ssize_t n = read(fd, static_cast<char*>(data) + done, size - done);
+		if (n == 0 || (n == -1 && errno != EINTR)) {
+			return false;
+		}
+		done += n > 0 ? n : 0;
+	}
+	return true;
+}
+
+inline bool sendAll(int sock, const void* data, size_t size) {
+	for (size_t done = 0; done < size;) {
+		ssize_t n = send(sock, static_cast<const char*>(data) + done, size - done, MSG_NOSIGNAL);
+		if (n == -1 && errno != EINTR) {
+			return false;
+		}
+		done += n > 0 ? n : 0;
+	}
+	return true;
+}
+
+// False with errno set if the message could not be sent whole
+inline bool sendMessage(int sock, std::string_view payload, const std::vector<int>& fds) {
+	if (fds.size() > MAX_PASSED_FDS) {
+		errno = EINVAL;
+		return false;
+	}
+	if (payload.size() > MAX_MESSAGE) {
+		errno = EMSGSIZE;
+		return false;
+	}
+	uint32_t length = payload.size();
+	struct iovec iov[2] = {{&length, sizeof(length)}, {const_cast<char*>(payload.data()), payload.size()}};
+	alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)] {};
+	struct msghdr msg {};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if (!fds.empty()) {
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+		memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+	}
+	ssize_t n;
+	while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+	}
+	if (n == -1) {
+		return false;
+	}
+	size_t sent = n;
+	if (sent < sizeof(length)) {
+		if (!sendAll(sock, reinterpret_cast<char*>(&length) + sent, sizeof(length) - sent)) {
+			return false;
+		}
+		sent = sizeof(length);
+	}
+	sent -= sizeof(length);
+	return sendAll(sock, payload.data() + sent, payload.size() - sent);
+}
+
+// Receives the fds close-on-exec; false at end of stream or on error. Received fds are the
+// caller's to close, even when false is returned, as it is for a length over MAX_MESSAGE.
+inline bool receiveMessage(int sock, std::string& payload, std::vector<int>& fds) {
+	uint32_t length = 0;
+	struct iovec iov {&length, sizeof(length)};
+	alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+	struct msghdr msg {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t n;
+	while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+	}
+	if (n <= 0) {
+		return false;
+	}
+	fds.clear();
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			size_t start = fds.size();
+			fds.resize(start + count);
+			memcpy(fds.data() + start, CMSG_DATA(cmsg), count * sizeof(int));
+		}
+	}
+	if (static_cast<size_t>(n) < sizeof(length) && !readAll(sock, reinterpret_cast<char*>(&length) + n, sizeof(length) - n)) {
+		return false;
+	}
+	if (length > MAX_MESSAGE) {
+		errno = EMSGSIZE;
+		return false;
+	}
+	payload.resize(length);
+	return readAll(sock, payload.data(), length);
+}
+#endif
@@ -0,0 +1,400 @@
+#ifndef FORKSERVER_H
+#define FORKSERVER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <variant>
+#include <iostream>
+#include <functional>
+#include <memory_resource>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "pipeline.h"
+#include "spawner.h"
+#include "compiled.h"
+#include "fdpass.h"
+
+// Fork server ("zygote"): a helper process forked while the shell is still small, which creates the
+// shell's children on request. fork() copies the page tables of the whole caller, so its cost grows
+// with everything the shell accumulates; the helper's cost stays that of a freshly started shell.
+// Children are cloned with CLONE_PARENT, which makes them the shell's own children: the shell
+// waits for them, opens their pidfds and collects their rusage as if it had created them itself.
+//
+// A request is one message on a Unix socket (see fdpass.h): the SpawnPlan, then either a program with its argv and
+// environment or builtin commands (in the compiled script encoding, see compiled.h). The shell's
+// working directory, its fds 0-2 and every fd the plan dups from travel along as SCM_RIGHTS, so a
+// child starts from the shell's current state rather than the helper's. The reply is the child's
+// pid or an errno.
+class ForkServer {
+public:
+	// Runs builtin stages first[0..count) in a child the server created, its fds already set up;
+	// returns their exit status
+	using Runner = std::function<int(const Command* first, size_t count)>;
+
+	ForkServer() {}
+	ForkServer(const ForkServer&) = delete;
+	ForkServer& operator=(const ForkServer&) = delete;
+	~ForkServer() {
+		stop();
+	}
+	// Forks the helper; false if it could not be started, in which case callers create their
+	// children themselves. Meant to be called early, while the shell's address space is small.
+	bool start(Runner runner) {
+		int fds[2];
+		if (isRunning() || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+			return isRunning();
+		}
+		std::cout.flush();
+		std::cerr.flush();
+		pid_t parent = getpid();
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(fds[0]);
+			serve(fds[1], parent, runner);
+		}
+		close(fds[1]);
+		if (pid == -1) {
+			close(fds[0]);
+			return false;
+		}
+		sock = fds[0];
+		server = pid;
+		owner = parent;
+		return true;
+	}
+	// Only the process that started the helper may use it: a forked child of the shell inherits the
+	// socket, but children created on its behalf would not be its own
+	bool isRunning() const {
+		return sock != -1 && getpid() == owner;
+	}
+	pid_t getPid() const {
+		return server;
+	}
+	// Like SpawnPlan::spawn. Failing to reach the helper stops it, leaving isRunning() false, so the
+	// caller can fall back to spawning by itself.
+	pid_t spawn(const SpawnPlan& plan, const char* path, const Argv& argv, int& error) {
+		Message message(SPAWN, plan);
+		message.putString(path);
+		message.putStrings(argv.data());
+		message.putStrings(environ);
+		return request(message, error);
+	}
+	// Runs builtin stages in a new child through the Runner given to start(); errors as for spawn()
+	pid_t run(const SpawnPlan& plan, const Command* first, size_t count, int& error) {
+		Message message(RUN, plan);
+		Sequence sequence;
+		Pipeline pipeline;
+		pipeline.commands.assign(first, first + count);
+		sequence.push_back(std::move(pipeline));
+		CompiledScriptWriter writer;
+		writer.add(sequence);
+		message.putString(writer.serialize("", SourceStamp {}));
+		return request(message, error);
+	}
+	void stop() {
+		if (sock == -1 || getpid() != owner) {
+			return;
+		}
+		close(sock);
+		sock = -1;
+		kill(server, SIGKILL);
+		waitpid(server, nullptr, 0);
+	}
+private:
+	enum Kind : uint8_t { SPAWN, RUN };
+	// Received fds: the working directory, then the shell's fds 0-2, then those the plan dups from
+	enum Slot { CWD, SHELL_STDIN, FIRST_PLAN_FD = SHELL_STDIN + 3 };
+	static constexpr size_t STACK_SIZE = 64 << 10;
+	struct Reply {
+		pid_t pid;
+		int error;
+	};
+	int sock {-1};
+	pid_t server {-1};
+	pid_t owner {-1};
+
+	// A request as sent: each string is u32-length-prefixed and NUL-terminated, so the helper can
+	// hand it to execve in place
+	class Message {
+	public:
+		std::string bytes;
+		std::vector<int> fds;
+
+		Message(Kind kind, const SpawnPlan& plan) {
+			fds.push_back(::open(".", O_PATH | O_DIRECTORY | O_CLOEXEC));
+			fds.insert(fds.end(), {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO});
+			put<uint8_t>(kind);
+			put<uint8_t>(plan.session);
+			put<uint32_t>(plan.actions.size());
+			// Once the shell's fds are closed, every fd is the child's own
+			bool ownFds = false;
+			for (const auto& action : plan.actions) {
+				put<uint8_t>(action.kind);
+				put<int32_t>(action.fd);
+				if (action.kind == SpawnPlan::Action::OPEN) {
+					putString(action.path);
+					put<int32_t>(action.flags);
+				} else if (action.kind != SpawnPlan::Action::DUP) {
+					ownFds |= action.kind == SpawnPlan::Action::CLOSE_FROM;
+				} else if (action.from <= STDERR_FILENO || ownFds) {
+					// The child's own fd as set up so far
+					put<int32_t>(action.from);
+				} else {
+					// A shell fd, shipped along: negated slot
+					put<int32_t>(-static_cast<int32_t>(fds.size()));
+					fds.push_back(action.from);
+				}
+			}
+			put<uint8_t>(plan.pinned);
+			put<cpu_set_t>(plan.cpus);
+			put<int32_t>(plan.niceness);
+			put<uint32_t>(plan.limits.size());
+			for (const auto& limit : plan.limits) {
+				put<int32_t>(limit.resource);
+				put<uint64_t>(limit.soft);
+				put<uint64_t>(limit.hard);
+			}
+		}
+		Message(const Message&) = delete;
+		Message& operator=(const Message&) = delete;
+		~Message() {
+			if (fds[CWD] != -1) {
+				close(fds[CWD]);
+			}
+		}
+		template <typename T>
+		void put(T value) {
+			bytes.append(reinterpret_cast<const char*>(&value), sizeof(value));
+		}
+		void putString(std::string_view s) {
+			put<uint32_t>(s.size());
+			bytes += s;
+			bytes += '\0';
+		}
+		void putStrings(char* const* strings) {
+			uint32_t count = 0;
+			while (strings[count] != nullptr) {
+				count++;
+			}
+			put<uint32_t>(count);
+			for (uint32_t i = 0; i < count; i++) {
+				putString(strings[i]);
+			}
+		}
+	};
+	// Reads a Message's fields; anything out of bounds marks it bad instead
+	class Reader {
+	public:
+		bool bad {false};
+
+		explicit Reader(std::string_view bytes) : bytes {bytes} {}
+		template <typename T>
+		T get() {
+			T value {};
+			if (bytes.size() - pos < sizeof(T)) {
+				bad = true;
+				return value;
+			}
+			memcpy(&value, bytes.data() + pos, sizeof(T));
+			pos += sizeof(T);
+			return value;
+		}
+		std::string_view getString() {
+			uint32_t length = get<uint32_t>();
+			if (bad || bytes.size() - pos <= length) {
+				bad = true;
+				return "";
+			}
+			std::string_view s = bytes.substr(pos, length);
+			pos += length + 1;
+			return s;
+		}
+		// A null-terminated array of the strings, which stay in the message
+		std::vector<char*> getStrings() {
+			uint32_t count = get<uint32_t>();
+			std::vector<char*> strings;
+			for (uint32_t i = 0; i < count && !bad; i++) {
+				strings.push_back(const_cast<char*>(getString().data()));
+			}
+			strings.push_back(nullptr);
+			return strings;
+		}
+	private:
+		std::string_view bytes;
+		size_t pos {0};
+	};
+	// What a spawned child needs, shared with it through CLONE_VM until it execs
+	struct Child {
+		const SpawnPlan* plan;
+		const int* fds;
+		const char* path;
+		char* const* argv;
+		char* const* envp;
+		int error;
+	};
+
+	pid_t request(Message& message, int& error) {
+		if (message.fds[CWD] == -1) {
+			error = errno;
+			return -1;
+		}
+		Reply reply;
+		if (!sendMessage(sock, message.bytes, message.fds) || !readAll(sock, &reply, sizeof(reply))) {
+			stop();
+			error = EPIPE;
+			return -1;
+		}
+		error = reply.error;
+		if (error != 0) {
+			// A child that failed to exec has already exited, and is the shell's to reap
+			if (reply.pid > 0) {
+				waitpid(reply.pid, nullptr, 0);
+			}
+			return -1;
+		}
+		return reply.pid;
+	}
+
+	// The helper: serves requests until the shell closes its end of the socket or dies
+	[[noreturn]] static void serve(int sock, pid_t parent, const Runner& runner) {
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		if (getppid() != parent) {
+			_exit(0);
+		}
+		// Hold on to nothing of the shell's: children get their fds from each request
+		int null = ::open("/dev/null", O_RDWR);
+		for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+			if (fd != null) {
+				dup2(null, fd);
+			}
+		}
+		if (sock > STDERR_FILENO + 1) {
+			close_range(STDERR_FILENO + 1, sock - 1, 0);
+		}
+		close_range(sock + 1, ~0U, 0);
+		std::vector<char> stack(STACK_SIZE);
+		while (true) {
+			std::string bytes;
+			std::vector<int> fds;
+			if (!receiveMessage(sock, bytes, fds)) {
+				_exit(0);
+			}
+			Reply reply = handle(bytes, fds, runner, stack);
+			for (int fd : fds) {
+				close(fd);
+			}
+			if (!sendAll(sock, &reply, sizeof(reply))) {
+				_exit(0);
+			}
+		}
+	}
+	static Reply handle(std::string_view bytes, const std::vector<int>& fds, const Runner& runner, std::vector<char>& stack) {
+		Reader in(bytes);
+		auto kind = in.get<uint8_t>();
+		SpawnPlan plan;
+		plan.session = in.get<uint8_t>() != 0;
+		uint32_t actions = in.get<uint32_t>();
+		for (uint32_t i = 0; i < actions && !in.bad; i++) {
+			auto action = in.get<uint8_t>();
+			int fd = in.get<int32_t>();
+			if (action == SpawnPlan::Action::OPEN) {
+				const char* path = in.getString().data();
+				plan.open(fd, path, in.get<int32_t>());
+				continue;
+			} else if (action == SpawnPlan::Action::CLOSE) {
+				plan.close(fd);
+				continue;
+			} else if (action == SpawnPlan::Action::CLOSE_FROM) {
+				plan.closeInherited(fd);
+				continue;
+			}
+			int from = in.get<int32_t>();
+			if (from < 0) {
+				in.bad |= static_cast<size_t>(-static_cast<int64_t>(from)) >= fds.size();
+				from = in.bad ? -1 : fds[-from];
+			}
+			plan.dup(from, fd);
+		}
+		bool pinned = in.get<uint8_t>() != 0;
+		cpu_set_t cpus = in.get<cpu_set_t>();
+		if (pinned) {
+			plan.setAffinity(cpus);
+		}
+		plan.setNice(in.get<int32_t>());
+		uint32_t limits = in.get<uint32_t>();
+		for (uint32_t i = 0; i < limits && !in.bad; i++) {
+			int resource = in.get<int32_t>();
+			rlim_t soft = in.get<uint64_t>();
+			plan.setLimit(resource, soft, in.get<uint64_t>());
+		}
+		if (in.bad || fds.size() < FIRST_PLAN_FD) {
+			return Reply {-1, EINVAL};
+		}
+		if (kind == SPAWN) {
+			const char* path = in.getString().data();
+			std::vector<char*> argv = in.getStrings();
+			std::vector<char*> envp = in.getStrings();
+			if (in.bad) {
+				return Reply {-1, EINVAL};
+			}
+			// As posix_spawn does: the child borrows this process's memory until it execs, so it
+			// costs no copy at all, and reports a failure to exec through child.error
+			Child child {&plan, fds.data(), path, argv.data(), envp.data(), 0};
+			pid_t pid = clone(execChild, stack.data() + stack.size(), CLONE_PARENT | CLONE_VM | CLONE_VFORK | SIGCHLD, &child);
+			return Reply {pid, pid == -1 ? errno : child.error};
+		}
+		std::pmr::monotonic_buffer_resource arena;
+		Sequence sequence(&arena);
+		try {
+			sequence = CompiledScript(in.getString()).line(0, &arena);
+		} catch (const std::invalid_argument&) {
+			return Reply {-1, EINVAL};
+		}
+		auto pipeline = sequence.empty() ? nullptr : std::get_if<Pipeline>(&sequence[0]);
+		if (in.bad || pipeline == nullptr || pipeline->commands.empty()) {
+			return Reply {-1, EINVAL};
+		}
+		// A copy of this small process, as fork() would make, but the shell's child
+		pid_t pid = static_cast<pid_t>(syscall(SYS_clone, CLONE_PARENT | SIGCHLD, nullptr, nullptr, nullptr, 0));
+		if (pid == 0) {
+			if (!prepare(plan, fds.data())) {
+				std::cerr << "Error: " << pipeline->commands[0].args[0] << ": " << strerror(errno) << std::endl;
+				_exit(1);
+			}
+			_exit(runner(pipeline->commands.data(), pipeline->commands.size()));
+		}
+		return Reply {pid, pid == -1 ? errno : 0};
+	}
+	// In a new child: the shell's working directory and fds 0-2, then the plan itself
+	static bool prepare(const SpawnPlan& plan, const int* fds) {
+		if (fchdir(fds[CWD]) == -1) {
+			return false;
+		}
+		for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+			if (dup2(fds[SHELL_STDIN + fd], fd) == -1) {
+				return false;
+			}
+		}
+		return plan.apply();
+	}
+	static int execChild(void* arg) {
+		Child* child = static_cast<Child*>(arg);
+		if (prepare(*child->plan, child->fds)) {
+			execve(child->path, child->argv, child->envp);
+		}
+		child->error = errno;
+		_exit(127);
+	}
+};
+#endif
@@ -0,0 +1,280 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <optional>
+#include <unordered_map>
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "timing.h"
+
+// Shell-style exit code for a wait status
+inline int exitCode(int status) {
+	if (WIFSIGNALED(status)) {
+		return 128 + WTERMSIG(status);
+	}
+	return WEXITSTATUS(status);
+}
+
+// Called through syscall(2) since not every libc declares pidfd_open usably from C++
+inline int openPidfd(pid_t pid) {
+	return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+}
+
+// Background jobs, reaped asynchronously: every process gets a pidfd registered with one epoll
+// instance, so checking for finished jobs costs one epoll_wait plus work per exited process,
+// never a scan over all running jobs. A process whose pidfd cannot be opened or registered (say
+// at EMFILE) is kept aside and reaped by wait4 on its pid instead: polled without blocking, and
+// blocked on when its job, or any job, is waited for.
+class JobTable {
+public:
+	struct Job {
+		int id;
+		std::string command;
+		std::vector<pid_t> pids;
+		size_t running;
+		int status {0};
+		struct rusage usage {};
+		bool done {false};
+	};
+	JobTable() {}
+	JobTable(const JobTable&) = delete;
+	JobTable& operator=(const JobTable&) = delete;
+	~JobTable() {
+		for (const auto& [fd, process] : processes) {
+			close(fd);
+		}
+		if (epollFd != -1) {
+			close(epollFd);
+		}
+	}
+	// Registers the processes of a background pipeline; the last pid's status is the job's status
+	int add(const std::vector<pid_t>& pids, std::string command) {
+		setup();
+		int id = nextId++;
+		Job& job = jobs[id] = Job {id, std::move(command), pids, 0};
+		for (size_t i = 0; i < pids.size(); i++) {
+			Process process {id, pids[i], i + 1 == pids.size()};
+			int fd = epollFd == -1 ? -1 : openPidfd(pids[i]);
+			struct epoll_event event {};
+			event.events = EPOLLIN;
+			event.data.fd = fd;
+			if (fd != -1 && epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0) {
+				processes[fd] = process;
+			} else {
+				if (fd != -1) {
+					close(fd);
+				}
+				unwatched.push_back(process);
+			}
+			job.running++;
+		}
+		if (job.running == 0) {
+			finish(job);
+		}
+		return id;
+	}
+	// Reaps whatever has exited without blocking
+	void poll() {
+		dispatch(0);
+	}
+	// Blocks until job id has finished and forgets it; nullopt if there is no such job here to wait for
+	std::optional<int> wait(int id) {
+		auto it = jobs.find(id);
+		if (it == jobs.end()) {
+			return std::nullopt;
+		}
+		while (!it->second.done) {
+			if (!dispatch(-1, id)) {
+				return std::nullopt;
+			}
+		}
+		int status = it->second.status;
+		forget(id);
+		return status;
+	}
+	// Blocks until any job finishes (or returns one that already has) and forgets it;
+	// nullopt if there are no jobs left to wait for
+	std::optional<int> waitNext() {
+		while (finished.empty() && dispatch(-1)) {
+		}
+		if (finished.empty()) {
+			return std::nullopt;
+		}
+		return wait(finished.front());
+	}
+	void waitAll() {
+		while (dispatch(-1)) {
+		}
+		finished.clear();
+		jobs.clear();
+	}
+	// Finished jobs not yet reported or waited for, oldest first; they are forgotten once taken
+	std::vector<Job> takeFinished() {
+		std::vector<Job> result;
+		for (int id : finished) {
+			result.push_back(std::move(jobs.at(id)));
+			jobs.erase(id);
+		}
+		finished.clear();
+		return result;
+	}
+	const std::map<int, Job>& getJobs() const {
+		return jobs;
+	}
+	// The RLIMIT_NOFILE this process had before the table raised it, which its children should get
+	// back; nullopt if it was left alone
+	const std::optional<struct rlimit>& getInheritedFdLimit() const {
+		return inheritedFdLimit;
+	}
+private:
+	struct Process {
+		int job;
+		pid_t pid;
+		bool last;
+	};
+	// Statuses of finished jobs nobody has collected are kept up to this many, like bash's CHILD_MAX
+	static constexpr size_t MAX_FINISHED = 4096;
+	int epollFd {-1};
+	pid_t owner {-1};
+	int nextId {1};
+	std::map<int, Job> jobs;
+	std::unordered_map<int, Process> processes;
+	// Processes without a pidfd
+	std::vector<Process> unwatched;
+	std::deque<int> finished;
+	std::optional<struct rlimit> inheritedFdLimit;
+
+	// Created on first use so shells that never background anything pay nothing; without an epoll
+	// instance every process is unwatched
+	void setup() {
+		if (epollFd != -1) {
+			return;
+		}
+		epollFd = epoll_create1(EPOLL_CLOEXEC);
+		if (owner != -1) {
+			return;
+		}
+		owner = getpid();
+		// Each running process holds a pidfd, so allow as many descriptors as the hard limit does
+		struct rlimit limit;
+		if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+			inheritedFdLimit = limit;
+			limit.rlim_cur = limit.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &limit);
+		}
+	}
+	// Returns false when there is nothing this process can wait for. A forked child (a builtin
+	// in a pipeline) shares the epoll instance but not the children, and reaping there would
+	// deregister the shell's pidfds. To block, an unwatched process of job `waitingFor` (or of
+	// any job if that is 0) is waited for in preference to the epoll instance.
+	bool dispatch(int timeout, int waitingFor = 0) {
+		if ((processes.empty() && unwatched.empty()) || getpid() != owner) {
+			return false;
+		}
+		if (!unwatched.empty()) {
+			size_t before = unwatched.size();
+			for (size_t i = 0; i < unwatched.size();) {
+				if (!reapUnwatched(i, WNOHANG)) {
+					i++;
+				}
+			}
+			if (timeout == 0 || unwatched.size() < before) {
+				return true;
+			}
+			auto blockOn = std::find_if(unwatched.begin(), unwatched.end(), [&](const Process& process) {
+				return waitingFor == 0 || process.job == waitingFor;
+			});
+			if (blockOn == unwatched.end() && processes.empty()) {
+				blockOn = unwatched.begin();
+			}
+			if (blockOn != unwatched.end()) {
+				reapUnwatched(blockOn - unwatched.begin(), 0);
+				return true;
+			}
+		}
+		struct epoll_event events[64];
+		int n = epoll_wait(epollFd, events, 64, timeout);
+		for (int i = 0; i < n; i++) {
+			reap(events[i].data.fd);
+		}
+		return true;
+	}
+	void reap(int fd) {
+		auto it = processes.find(fd);
+		if (it == processes.end()) {
+			return;
+		}
+		Process process = it->second;
+		int status;
+		struct rusage usage;
+		if (!waitFor(process, WNOHANG, status, usage)) {
+			return;
+		}
+		processes.erase(it);
+		// Deregister explicitly: epoll keeps reporting an fd until every reference to its file is gone
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+		close(fd);
+		finish(process, status, usage);
+	}
+	// Returns whether unwatched process i has exited and been reaped, and so removed
+	bool reapUnwatched(size_t i, int options) {
+		Process process = unwatched[i];
+		int status;
+		struct rusage usage;
+		if (!waitFor(process, options, status, usage)) {
+			return false;
+		}
+		unwatched.erase(unwatched.begin() + i);
+		finish(process, status, usage);
+		return true;
+	}
+	static bool waitFor(const Process& process, int options, int& status, struct rusage& usage) {
+		pid_t result;
+		while ((result = wait4(process.pid, &status, options, &usage)) == -1 && errno == EINTR) {
+		}
+		if (result == 0) {
+			return false;
+		} else if (result == -1) {
+			status = 0;
+			usage = {};
+		}
+		return true;
+	}
+	void finish(const Process& process, int status, const struct rusage& usage) {
+		Job& job = jobs.at(process.job);
+		addUsage(job.usage, usage);
+		if (process.last) {
+			job.status = exitCode(status);
+		}
+		if (--job.running == 0) {
+			finish(job);
+		}
+	}
+	void finish(Job& job) {
+		job.done = true;
+		finished.push_back(job.id);
+		if (finished.size() > MAX_FINISHED) {
+			jobs.erase(finished.front());
+			finished.pop_front();
+		}
+	}
+	void forget(int id) {
+		jobs.erase(id);
+		for (auto it = finished.begin(); it != finished.end(); ++it) {
+			if (*it == id) {
+				finished.erase(it);
+				break;
+			}
+		}
+	}
+};
+#endif
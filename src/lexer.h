@@ -4,8 +4,10 @@
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <forward_list>
+#include <memory_resource>
 #include <vector>
-#include <regex>
 #include <optional>
 #include <cctype>
 #include <variant>
@@ -14,7 +16,12 @@
 
 class Lexer {
 public:
-	Lexer(std::string s) :line {s}, pos {0} {}
+	// Tokens are views into s, which must outlive the lexer and its tokens.
+	// Escaped literals are the only values that differ from the source; they are stored in resource.
+	Lexer(std::string_view s, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+		: line {s}, pos {0}, unescaped {resource} {}
+	// Copies keep the source lexer's resource instead of falling back to the default one
+	Lexer(const Lexer& other) : line {other.line}, pos {other.pos}, unescaped {other.unescaped, other.unescaped.get_allocator()} {}
 	std::variant<Token, ShellError> getToken() {
 		findToken();
 		if (pos == line.length()) {
@@ -42,70 +49,91 @@ public:
 		return lexLiteral();
 	}
 private:
-	std::string line;
+	std::string_view line;
 	size_t pos;
+	std::pmr::forward_list<std::pmr::string> unescaped;
 	void findToken() {
 		while (pos < line.length() && isspace(line[pos])) {
 			pos++;
 		}
 	}
 	std::variant<Token, ShellError> lexQuote() {
-		std::string value;
-		pos++;
+		size_t start = ++pos;
 		while (pos < line.length() && line[pos] != '"') {
-			value += line[pos];
 			pos++;
 		}
 		if (pos == line.length()) {
 			return ShellError {ErrorType::UNCLOSED_QUOTE, "Error: Unclosed Quote"};
 		}
 		pos++;
-		return Token {Type::QUOTE, std::move(value)};
+		return Token {Type::QUOTE, line.substr(start, pos - start - 1)};
 	}
 	// If current position points to redirect, greedy reads redirect and updates position
-	// Redirect in form: 1) >, <, 2) \d>, >>, &>, 3) \d>>, &>>, >&\d, 4) \d>&\d
+	// Redirect in form: 1) >, <, 2) \d>, \d<, >>, &>, 3) \d>>, &>>, >&\d, <&\d, 4) \d>&\d, \d<&\d,
+	// where a \d after & may also be - (close)
 	std::optional<Token> lexRedirect() {
-		std::regex pattern;
-		std::string s;
-		if (pos + 3 < line.length()) {
-			pattern.assign(R"(\d>&\d)");
-			s = line.substr(pos, 4);
-			if (std::regex_match(s, pattern)) {
-				pos += 4;
-				return Token {Type::REDIRECT, std::move(s)};
-			}
+		size_t length = redirectLength();
+		if (length == 0) {
+			return std::nullopt;
 		}
-		if (pos + 2 < line.length()) {
-			pattern.assign(R"(([\d&]>>)|(>&\d))");
-			s = line.substr(pos, 3);
-			if (std::regex_match(s, pattern)) {
-				pos += 3;
-				return Token {Type::REDIRECT, std::move(s)};
+		Token tok {Type::REDIRECT, line.substr(pos, length)};
+		pos += length;
+		return tok;
+	}
+	// Length of the longest redirect starting at pos, or 0 if there is none
+	size_t redirectLength() {
+		char c0 = peek(0);
+		char c1 = peek(1);
+		char c2 = peek(2);
+		if (isDigit(c0)) {
+			if (c1 != '>' && c1 != '<') {
+				return 0;
 			}
-		}
-		if (pos + 1 < line.length()) {
-			pattern.assign(R"([\d>&]>)");
-			s = line.substr(pos, 2);
-			if (std::regex_match(s, pattern)) {
-				pos += 2;
-				return Token {Type::REDIRECT, std::move(s)};
+			if (c2 == '&' && isDupTarget(peek(3))) {
+				return 4;
 			}
+			return c1 == '>' && c2 == '>' ? 3 : 2;
 		}
-		if (line[pos] == '>') {
-			pos++;
-			return Token {Type::REDIRECT, ">"};
+		if (c0 == '&') {
+			if (c1 != '>') {
+				return 0;
+			}
+			return c2 == '>' ? 3 : 2;
 		}
-		if (line[pos] == '<') {
-			pos++;
-			return Token {Type::REDIRECT, "<"};
+		if (c0 == '>' || c0 == '<') {
+			if (c1 == '&' && isDupTarget(c2)) {
+				return 3;
+			}
+			return c0 == '>' && c1 == '>' ? 2 : 1;
 		}
-		return std::nullopt;
+		return 0;
+	}
+	bool isDupTarget(char c) {
+		return isDigit(c) || c == '-';
+	}
+	// Character at pos + offset, or '\0' past the end of the line
+	char peek(size_t offset) {
+		return pos + offset < line.length() ? line[pos + offset] : '\0';
+	}
+	bool isDigit(char c) {
+		return c >= '0' && c <= '9';
 	}
 	bool isSpecial(char c) {
 		return c == '|' || c == '&' || c == ';' || c == '<' || c == '>';
 	}
 	Token lexLiteral() {
-		std::string s = "";
+		size_t start = pos;
+		while (pos < line.length() && !isspace(line[pos]) && !isSpecial(line[pos])) {
+			if (line[pos] == '\\') {
+				pos = start;
+				return lexEscapedLiteral();
+			}
+			pos++;
+		}
+		return Token {Type::LITERAL, line.substr(start, pos - start)};
+	}
+	Token lexEscapedLiteral() {
+		std::pmr::string& s = unescaped.emplace_front();
 		bool escape = false;
 		while (pos < line.length() && !isspace(line[pos])) {
 			if (line[pos] != '\\') {
@@ -119,7 +147,7 @@ private:
 			}
 			pos++;
 		}
-		return Token {Type::LITERAL, std::move(s)};
+		return Token {Type::LITERAL, s};
 	}
 };
 #endif
@@ -5,20 +5,40 @@
 #include <string>
 #include <vector>
 #include <variant>
-#include <regex>
+#include <string_view>
+#include <optional>
+#include <charconv>
+#include <algorithm>
+#include <memory_resource>
+#include <fcntl.h>
+#include <unistd.h>
 #include "lexer.h"
 #include "token.h"
 #include "shellerror.h"
 #include "pipeline.h"
+#include "trace.h"
 
 class Parser {
 public:
-	Parser(Lexer lexer) : lexer {std::move(lexer)} {}
-	std::vector<std::variant<Pipeline, ShellError>> parse() {
-		std::vector<std::variant<Pipeline, ShellError>> result;
+	// The returned AST is allocated from resource
+	Parser(Lexer lexer, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+		: lexer {std::move(lexer)}, resource {resource} {}
+	Sequence parse() {
+#ifdef ASH_TRACING
+		uint64_t start = Tracer::enabled() ? Tracer::now() : 0;
+#endif
+		Sequence result(resource);
 		while (!isTokenType(Type::END)) {
 			result.push_back(readPipeline());
 		}
+#ifdef ASH_TRACING
+		// Lexing is interleaved with parsing, so the lex span is the time summed over getToken calls
+		if (Tracer::enabled()) {
+			uint64_t total = Tracer::now() - start;
+			Tracer::instance().record(Tracer::LEX, start, lexTime);
+			Tracer::instance().record(Tracer::PARSE, start + lexTime, total - lexTime);
+		}
+#endif
 		return result;
 	}
 	std::string getString() {
@@ -26,9 +46,22 @@ public:
 	}
 private:
 	Lexer lexer;
+	std::pmr::memory_resource* resource;
 	std::string cachedResult = "No result yet\n";
-	std::variant<Token, ShellError> token = ShellError {ErrorType::SYNTAX_ERROR, "Error: Parser did not initialize current token"};
+	// Parsing starts as if a separator had just been read
+	std::variant<Token, ShellError> token = Token {Type::SEMI, ";"};
+#ifdef ASH_TRACING
+	uint64_t lexTime {0};
+#endif
 	void getToken() {
+#ifdef ASH_TRACING
+		if (Tracer::enabled()) {
+			uint64_t start = Tracer::now();
+			token = lexer.getToken();
+			lexTime += Tracer::now() - start;
+			return;
+		}
+#endif
 		token = lexer.getToken();
 	}
 	bool isTokenType(Type type) {
@@ -43,12 +76,11 @@ private:
 	bool atCommandEnd() {
 		return isTokenType(Type::SEMI) || isTokenType(Type::END) || isTokenType(Type::PIPE);
 	}
-	//Advance to first token of next pipeline (or end)
+	//Advance to the separator ending the pipeline (or end), which the next readPipeline steps over
 	void advanceToNewPipeline() {
-		while (!isTokenType(Type::SEMI) && !isTokenType(Type::END)) {
+		while (!atPipelineEnd()) {
 			getToken();
 		}
-		getToken();
 	}
 	//Advance to last token of command (delimiter)
 	void advanceToCommandEnd() {
@@ -57,32 +89,76 @@ private:
 		}
 	}
 	std::variant<Pipeline, ShellError> readPipeline() {
-		Pipeline pipeline;
-		std::variant<Command, ShellError> command;
-		do {
+		Pipeline pipeline {.commands = std::pmr::vector<Command>(resource), .cpus = std::pmr::string(resource)};
+		getToken();
+		// Leading unquoted `time`, which times the whole pipeline as in bash, `pipesize=SIZE`, which
+		// sizes its pipes, and `cpus=LIST`, which spreads its processes over CPUs, are keywords, in
+		// any order
+		while (isTokenType(Type::LITERAL)) {
+			std::string_view word = getArgument();
+			if (word == "time" && !pipeline.timed) {
+				pipeline.timed = true;
+			} else if (word.substr(0, 9) == "pipesize=" && pipeline.pipeSize == 0) {
+				auto size = parseSize(word.substr(9));
+				if (!size.has_value() || *size == 0) {
+					return skipPipeline("Error: Invalid pipe size.");
+				}
+				pipeline.pipeSize = *size;
+			} else if (word.substr(0, 5) == "cpus=" && pipeline.cpus.empty()) {
+				if (!parseCpuList(word.substr(5))) {
+					return skipPipeline("Error: Invalid CPU list.");
+				}
+				pipeline.cpus = word.substr(5);
+			} else {
+				break;
+			}
 			getToken();
-			command = readCommand();
+		}
+		while (true) {
+			auto command = readCommand();
 			if (std::holds_alternative<ShellError>(command)) {
 				advanceToNewPipeline();
 				return std::get<ShellError>(command);
 			}
-			pipeline.commands.push_back(std::get<Command>(command));
-		} while (isTokenType(Type::PIPE));
+			pipeline.commands.push_back(std::move(std::get<Command>(command)));
+			if (!isTokenType(Type::PIPE)) {
+				break;
+			}
+			getToken();
+		}
 
 		return pipeline;
 	}
+	// A syntax error in the pipeline's leading keywords
+	ShellError skipPipeline(const char* message) {
+		advanceToNewPipeline();
+		return ShellError {ErrorType::SYNTAX_ERROR, message};
+	}
 	//Advance to delimiter ending command
 	//Assumes current token is start of command
 	std::variant<Command, ShellError> readCommand() {
-		Command command;
+		Command command {
+			.args = Args(resource),
+			.redirection = {
+				.ops = std::pmr::vector<FdOp>(resource)
+			},
+			.placement = {
+				.cpus = std::pmr::string(resource),
+				.limits = std::pmr::vector<ResourceLimit>(resource)
+			}
+		};
+		if (auto error = readPlacement(command.placement, command.args)) {
+			advanceToCommandEnd();
+			return *error;
+		}
 		while (!atCommandEnd()) {
 			if (std::holds_alternative<ShellError>(token)) {
+				ShellError error = std::get<ShellError>(token);
 				advanceToCommandEnd();
-				return std::get<ShellError>(token);
+				return error;
 			}
-			Token currentToken = std::get<Token>(token);
 			if (isTokenType(Type::QUOTE) || isTokenType(Type::LITERAL)) {
-				command.args.push_back(std::move(currentToken.value));
+				command.args.emplace_back(getArgument());
 				getToken();
 			} else if (isTokenType(Type::REDIRECT)) {
 				auto result = readRedirect(command);
@@ -101,111 +177,88 @@ private:
 		}
 		return command;
 	}
+	// Leading unquoted `pin CPUS`, `nice N` and `limit NAME=VALUE` prefixes, in any order. A `nice`
+	// not followed by a number is the command itself (nice(1)), and is added to args.
+	std::optional<ShellError> readPlacement(Placement& placement, Args& args) {
+		while (isTokenType(Type::LITERAL)) {
+			std::string_view word = getArgument();
+			if (word != "pin" && word != "nice" && word != "limit") {
+				return std::nullopt;
+			}
+			// The token goes on to the next, so keep just which keyword it was
+			const char keyword = word[0];
+			getToken();
+			std::string_view value = isArgument() ? getArgument() : std::string_view();
+			if (keyword == 'p') {
+				if (!parseCpuList(value)) {
+					return ShellError {ErrorType::SYNTAX_ERROR, "Error: pin: Invalid CPU list."};
+				}
+				placement.cpus = value;
+			} else if (keyword == 'n') {
+				// As in nice(1), `nice -N` is an old spelling of `nice N`, and `nice --N` lowers the
+				// nice value by N
+				std::string_view number = value;
+				bool lower = false;
+				if (number.size() > 1 && number[0] == '-') {
+					number.remove_prefix(1);
+					lower = number.size() > 1 && number[0] == '-';
+					number.remove_prefix(lower ? 1 : 0);
+				}
+				unsigned increment = 0;
+				auto [end, error] = std::from_chars(number.data(), number.data() + number.size(), increment);
+				if (number.empty() || error != std::errc() || end != number.data() + number.size()) {
+					args.emplace_back("nice");
+					return std::nullopt;
+				}
+				// Nice values span 40, so a bigger step goes as far as one can
+				int step = static_cast<int>(std::min(increment, 40u));
+				placement.nice = lower ? -step : step;
+			} else {
+				auto limit = parseLimit(value);
+				if (!limit.has_value()) {
+					return ShellError {ErrorType::SYNTAX_ERROR, "Error: limit: Invalid resource limit."};
+				}
+				placement.limits.push_back(*limit);
+			}
+			getToken();
+		}
+		return std::nullopt;
+	}
 	bool isArgument() {
 		return isTokenType(Type::LITERAL) || isTokenType(Type::QUOTE);
 	}
-	std::string getArgument() {
-		Token tok = std::get<Token>(token);
-		return std::move(tok.value);
+	std::string_view getArgument() {
+		return std::get<Token>(token).value;
 	}
+	// Adds the redirection at the current token to cmd's; returns 1 if it is malformed. Forms are
+	// [N]<, [N]>, [N]>> and &>[>] with a file, and [N]<&M, [N]>&M and [N]>&- with single digit fds.
 	int readRedirect(Command& cmd) {
-		Token tok = std::get<Token>(token);
+		std::string_view op = std::get<Token>(token).value;
 		getToken();
-		if (tok.value == "<") {
-			if (isArgument()) {
-				cmd.redirection.cinFile = getArgument();
-				getToken();
-				return 0;
-			}
-			return 1;
-		} else if (tok.value == ">") {
-			if (isArgument()) {
-				cmd.redirection.coutFile = getArgument();
-				getToken();
-				return 0;
-			}
-			return 1;
-		} else if (tok.value == ">>") {
-			if (isArgument()) {
-				cmd.redirection.coutFile = getArgument();
-				cmd.redirection.coutFileAppend = true;
-				getToken();
-				return 0;
-			}
-			return 1;
-		} else if (tok.value == "&>") {
-			if (isArgument()) {
-				cmd.redirection.coutFile = getArgument();
-				cmd.redirection.cerrFile = getArgument();
-				getToken();
-				return 0;
-			}
-			return 1;
-		} else if (tok.value == "&>>") {
-			if (isArgument()) {
-				cmd.redirection.coutFile = getArgument();
-				cmd.redirection.cerrFile = getArgument();
-				cmd.redirection.coutFileAppend = true;
-				cmd.redirection.cerrFileAppend = true;
-				getToken();
-				return 0;
-			}
-			return 1;
-		}
-		std::regex pattern;
-		std::smatch matches;
-		pattern.assign(R"((\d)>&(\d))");
-		if (std::regex_search(tok.value, matches, pattern)) {
-			if (std::stoi(matches[1]) == 1) {
-				cmd.redirection.coutTo = std::stoi(matches[2]);
-			} else if (std::stoi(matches[1]) == 2) {
-				cmd.redirection.cerrTo = std::stoi(matches[2]);
+		// &> and &>> send stderr along with stdout
+		bool both = op[0] == '&';
+		bool hasFd = op[0] >= '0' && op[0] <= '9';
+		std::string_view rest = op.substr(hasFd || both ? 1 : 0);
+		bool input = rest[0] == '<';
+		int fd = hasFd ? op[0] - '0' : input ? STDIN_FILENO : STDOUT_FILENO;
+		if (rest.size() == 3 && rest[1] == '&') {
+			if (rest[2] == '-') {
+				cmd.redirection.add(FdOp {FdOp::CLOSE, fd});
 			} else {
-				return 1;
+				cmd.redirection.add(FdOp {FdOp::DUP, fd, rest[2] - '0'});
 			}
 			return 0;
 		}
-		pattern.assign(R"((\d)>>)");
-		if (std::regex_search(tok.value, matches, pattern)) {
-			if (isArgument()) {
-				if (std::stoi(matches[1]) == 1) {
-					cmd.redirection.coutFile = getArgument();
-					cmd.redirection.coutFileAppend = true;
-				} else if (std::stoi(matches[1]) == 2) {
-					cmd.redirection.cerrFile = getArgument();
-					cmd.redirection.cerrFileAppend = true;
-				} else {
-					return 1;
-				}
-				getToken();
-				return 0;
-			}
+		if (!isArgument()) {
 			return 1;
 		}
-		pattern.assign(R"(>&(\d))");
-		if (std::regex_search(tok.value, matches, pattern)) {
-			if (std::stoi(matches[1]) == 2) {
-				cmd.redirection.coutTo = 2;
-				return 0;
-			} else {
-				return 1;
-			}
+		int flags = input ? O_RDONLY : O_WRONLY | O_CREAT | (rest == ">>" ? O_APPEND : O_TRUNC);
+		cmd.redirection.add(FdOp {FdOp::OPEN, fd, -1, std::pmr::string(getArgument(), resource), flags});
+		if (both) {
+			cmd.redirection.add(FdOp {FdOp::DUP, STDERR_FILENO, STDOUT_FILENO});
 		}
-		pattern.assign(R"((\d)>)");
-		if (std::regex_search(tok.value, matches, pattern)) {
-			if (isArgument()) {
-				if (std::stoi(matches[1]) == 1) {
-					cmd.redirection.coutFile = getArgument();
-				} else if (std::stoi(matches[1]) == 2) {
-					cmd.redirection.cerrFile = getArgument();
-				} else {
-					return 1;
-				}
-				getToken();
-				return 0;
-			}
-		}
-		return 1;
+		getToken();
+		return 0;
 	}
 };
 #endif
@@ -0,0 +1,132 @@
+#ifndef PATHCACHE_H
+#define PATHCACHE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <unordered_map>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bash-style command hash table: command name -> absolute path resolved through PATH.
+// The table is dropped when PATH changes. An entry is dropped when the directory it was found
+// in, or any directory before it in PATH, changes mtime or comes or goes: a binary was added,
+// removed or renamed there, possibly one that now shadows the entry.
+class PathCache {
+public:
+	struct Entry {
+		std::string path;
+		size_t dir;
+		unsigned hits;
+	};
+	// Returns the path to execute for name, or nullopt if it is not found in PATH
+	std::optional<std::string> lookup(std::string_view name) {
+		if (name.find('/') != std::string::npos) {
+			return std::string(name);
+		}
+		checkPath();
+		auto it = entries.find(std::string(name));
+		if (it != entries.end()) {
+			size_t changed = firstChangedDir(it->second.dir);
+			if (changed > it->second.dir) {
+				it->second.hits++;
+				return it->second.path;
+			}
+			forgetFrom(changed);
+		}
+		for (size_t i = 0; i < dirs.size(); i++) {
+			recordDir(i);
+			std::string candidate = dirs[i] + "/";
+			candidate += name;
+			struct stat st;
+			if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(candidate.c_str(), X_OK) == 0) {
+				entries[std::string(name)] = Entry {candidate, i, 1};
+				return candidate;
+			}
+		}
+		return std::nullopt;
+	}
+	void clear() {
+		entries.clear();
+		mtimes.assign(dirs.size(), std::nullopt);
+	}
+	const std::unordered_map<std::string, Entry>& getEntries() {
+		checkPath();
+		return entries;
+	}
+private:
+	std::optional<std::string> pathValue;
+	std::vector<std::string> dirs;
+	// A directory's mtime, or nullopt if it did not exist
+	using DirStamp = std::optional<timespec>;
+	// Per directory, its stamp when first searched since it last changed; nullopt until then
+	std::vector<std::optional<DirStamp>> mtimes;
+	std::unordered_map<std::string, Entry> entries;
+
+	void checkPath() {
+		const char* env = std::getenv("PATH");
+		std::string current = env ? env : "/bin:/usr/bin";
+		if (pathValue == current) {
+			return;
+		}
+		pathValue = current;
+		dirs.clear();
+		size_t start = 0;
+		while (true) {
+			size_t end = current.find(':', start);
+			std::string dir = current.substr(start, end == std::string::npos ? std::string::npos : end - start);
+			dirs.push_back(dir.empty() ? "." : dir);
+			if (end == std::string::npos) {
+				break;
+			}
+			start = end + 1;
+		}
+		clear();
+	}
+	DirStamp statDir(size_t dir) {
+		struct stat st;
+		if (stat(dirs[dir].c_str(), &st) == -1) {
+			return std::nullopt;
+		}
+		return st.st_mtim;
+	}
+	void recordDir(size_t dir) {
+		if (!mtimes[dir].has_value()) {
+			mtimes[dir] = statDir(dir);
+		}
+	}
+	bool dirUnchanged(size_t dir) {
+		if (!mtimes[dir].has_value()) {
+			return false;
+		}
+		DirStamp now = statDir(dir);
+		const DirStamp& then = *mtimes[dir];
+		if (!now.has_value() || !then.has_value()) {
+			return now.has_value() == then.has_value();
+		}
+		return now->tv_sec == then->tv_sec && now->tv_nsec == then->tv_nsec;
+	}
+	// The first of directories 0..last to have changed, or last + 1 if none has
+	size_t firstChangedDir(size_t last) {
+		for (size_t dir = 0; dir <= last; dir++) {
+			if (!dirUnchanged(dir)) {
+				return dir;
+			}
+		}
+		return last + 1;
+	}
+	// Drops the entries that dir or a directory after it resolved, since dir may now shadow them
+	void forgetFrom(size_t dir) {
+		for (auto it = entries.begin(); it != entries.end();) {
+			if (it->second.dir >= dir) {
+				it = entries.erase(it);
+			} else {
+				++it;
+			}
+		}
+		mtimes[dir] = std::nullopt;
+	}
+};
+#endif
@@ -3,45 +3,153 @@
 
 #include <string>
 #include <vector>
+#include <memory_resource>
 #include <variant>
+#include <optional>
+#include <string_view>
+#include <charconv>
+#include <cstdint>
+#include <utility>
 #include <iostream>
+#include <sched.h>
+#include <sys/resource.h>
 #include "shellerror.h"
 
-enum RedirectType { IN, OUT, APPEND };
+// One step of a command's redirections, as open(2), dup2(2) or close(2) would take it
+struct FdOp {
+	enum Kind : uint8_t { OPEN, DUP, CLOSE };
+	Kind kind;
+	// The fd the step sets
+	int fd;
+	// DUP: the fd it becomes a copy of
+	int from {-1};
+	// OPEN: the file and its open flags
+	std::pmr::string path {""};
+	int flags {0};
+	// The parser takes single digit fds
+	static constexpr int MAX_FD = 9;
 
+	// The first fd it names that is outside the range the parser takes, if any
+	std::optional<int> badFd() const {
+		if (fd < 0 || fd > MAX_FD) {
+			return fd;
+		}
+		if (kind == DUP && (from < 0 || from > MAX_FD)) {
+			return from;
+		}
+		return std::nullopt;
+	}
+
+	bool operator==(const FdOp& other) const {
+		return kind == other.kind && fd == other.fd && from == other.from && path == other.path && flags == other.flags;
+	}
+	friend std::ostream& operator<<(std::ostream& os, const FdOp& op) {
+		if (op.kind == OPEN) {
+			return os << op.fd << " = open(" << op.path << ", " << op.flags << ")";
+		} else if (op.kind == DUP) {
+			return os << op.fd << " = dup(" << op.from << ")";
+		}
+		return os << "close(" << op.fd << ")";
+	}
+};
+
+// A command's redirections: fd operations applied in order after its pipes are set up, so
+// `> out 2>&1` sends both to out while `2>&1 > out` sends only stdout there, as in sh. The parser
+// builds the list once; steps that could have no effect are left out as it goes (see add()).
 struct Redirect {
-	int coutTo{1};
-    int cerrTo{2};
-    std::string coutFile {""};
-    bool coutFileAppend {false};
-    std::string cerrFile {""};
-    bool cerrFileAppend {false};
-    std::string cinFile {""};
+	std::pmr::vector<FdOp> ops {};
+
+	// Appends op. A step that makes an fd a copy of itself is a no-op, and an earlier dup or close of
+	// the same fd that nothing has read since is undone by op, so neither is kept. An earlier open
+	// is, since it creates or truncates its file either way.
+	void add(FdOp op) {
+		if (op.kind == FdOp::DUP && op.fd == op.from) {
+			return;
+		}
+		for (size_t i = ops.size(); i-- > 0;) {
+			if (ops[i].kind == FdOp::DUP && ops[i].from == op.fd) {
+				break;
+			}
+			if (ops[i].fd == op.fd) {
+				if (ops[i].kind != FdOp::OPEN) {
+					ops.erase(ops.begin() + i);
+				}
+				break;
+			}
+		}
+		ops.push_back(std::move(op));
+	}
+	// The first fd an op names outside the range the parser takes, if any (see FdOp::badFd)
+	std::optional<int> badFd() const {
+		for (const auto& op : ops) {
+			if (auto fd = op.badFd()) {
+				return fd;
+			}
+		}
+		return std::nullopt;
+	}
+	// Whether the redirections change what fd refers to
+	bool sets(int fd) const {
+		for (const auto& op : ops) {
+			if (op.fd == fd) {
+				return true;
+			}
+		}
+		return false;
+	}
 
 	bool operator==(const Redirect& other) const {
-		return coutTo == other.coutTo && cerrTo == other.cerrTo && coutFile == other.coutFile && cerrFile == other.cerrFile && cinFile == other.cinFile;
-	}
-friend std::ostream& operator<<(std::ostream& os, const Redirect& redirect) {
-	os << "Redirect {\n"
-	   << "  coutTo: " << redirect.coutTo << "\n"
-	   << "  cerrTo: " << redirect.cerrTo << "\n"
-	   << "  coutFile: " << redirect.coutFile << "\n"
-	   << "  coutFileAppend: " << (redirect.coutFileAppend ? "true" : "false") << "\n"
-	   << "  cerrFile: " << redirect.cerrFile << "\n"
-	   << "  cerrFileAppend: " << (redirect.cerrFileAppend ? "true" : "false") << "\n"
-	   << "  cinFile: " << redirect.cinFile << "\n"
-	   << "}";
-	return os;
-}
+		return ops == other.ops;
+	}
+	friend std::ostream& operator<<(std::ostream& os, const Redirect& redirect) {
+		os << "Redirect {";
+		for (const auto& op : redirect.ops) {
+			os << " " << op << ";";
+		}
+		return os << " }";
+	}
+};
+
+// The AST uses pmr containers so the parser can place a whole line in a per-line arena (see arena.h).
+// Copies fall back to the default resource, so a copied AST outlives the arena it came from.
+using Args = std::pmr::vector<std::pmr::string>;
+
+struct ResourceLimit {
+	// RLIMIT_*
+	int resource;
+	// Both the soft and the hard limit, or RLIM_INFINITY
+	uint64_t value;
+
+	bool operator==(const ResourceLimit& other) const {
+		return resource == other.resource && value == other.value;
+	}
+};
+
+// Set up in a stage's process before it runs, from the `pin CPUS`, `nice N` and `limit NAME=VALUE`
+// prefixes
+struct Placement {
+	// CPUs to run on, as a list like "0-3,8" (see parseCpuList); empty to keep the shell's
+	std::pmr::string cpus {""};
+	// Added to the shell's nice value
+	int nice {0};
+	std::pmr::vector<ResourceLimit> limits {};
+
+	bool empty() const {
+		return cpus.empty() && nice == 0 && limits.empty();
+	}
+	bool operator==(const Placement& other) const {
+		return cpus == other.cpus && nice == other.nice && limits == other.limits;
+	}
 };
 
 struct Command {
-	std::vector<std::string> args{};
+	Args args{};
 	Redirect redirection{};
 	bool background{false};
+	Placement placement{};
 	
 	bool operator==(const Command& other) const {
-		return args == other.args && redirection == other.redirection && background == other.background;
+		return args == other.args && redirection == other.redirection && background == other.background && placement == other.placement;
 	}
 	friend std::ostream& operator<<(std::ostream& os, const Command& cmd) {
 		os << "Command {\nArgs: [";
@@ -50,16 +158,28 @@ struct Command {
 		}
 		os << "]\nRedirections[";
 		os << cmd.redirection;
-		os << "]\n}\n";
+		os << "]\n";
+		if (!cmd.placement.empty()) {
+			os << "Placement { cpus: " << cmd.placement.cpus << ", nice: " << cmd.placement.nice << ", limits: " << cmd.placement.limits.size() << " }\n";
+		}
+		os << "}\n";
 		return os;
 	}
 };
 
 struct Pipeline {
-	std::vector<Command> commands;
+	std::pmr::vector<Command> commands;
+	// Prefixed with the `time` keyword
+	bool timed {false};
+	// Buffer size of the pipes between its stages, from a leading `pipesize=SIZE`; 0 for the
+	// shell's `pipesize` option
+	size_t pipeSize {0};
+	// From a leading `cpus=LIST`: each process of the pipeline is pinned to the next CPU of the
+	// list, in the list's order, unless its stage has a `pin` of its own
+	std::pmr::string cpus {""};
 
 	bool operator==(const Pipeline& other) const {
-		return commands == other.commands;
+		return commands == other.commands && timed == other.timed && pipeSize == other.pipeSize && cpus == other.cpus;
 	}
 	friend std::ostream& operator<<(std::ostream& os, const Pipeline& pipeline) {
 		os << "\nPipeline{\n";
@@ -71,6 +191,94 @@ struct Pipeline {
 	}
 };
 
+using Sequence = std::pmr::vector<std::variant<Pipeline, ShellError>>;
+
+// A size as written after `pipesize=` or in a `limit`: a count, or with a K, M or G suffix; nullopt
+// if malformed
+inline std::optional<size_t> parseSize(std::string_view text) {
+	size_t size = 0;
+	auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), size);
+	if (error != std::errc() || end == text.data()) {
+		return std::nullopt;
+	}
+	std::string_view suffix(end, text.data() + text.size() - end);
+	int shift = suffix == "" ? 0 : suffix == "K" || suffix == "k" ? 10 : suffix == "M" || suffix == "m" ? 20 : suffix == "G" || suffix == "g" ? 30 : -1;
+	if (shift == -1 || size > (SIZE_MAX >> shift)) {
+		return std::nullopt;
+	}
+	return size << shift;
+}
+
+// A CPU list like "0-3,8,10": numbers and ranges, separated by commas. Appends the CPUs to cpus, if
+// given, in the order written; false if the list is malformed or names a CPU past CPU_SETSIZE.
+inline bool parseCpuList(std::string_view text, std::vector<int>* cpus = nullptr) {
+	if (text.empty()) {
+		return false;
+	}
+	const char* pos = text.data();
+	const char* end = text.data() + text.size();
+	while (true) {
+		int first = 0;
+		auto result = std::from_chars(pos, end, first);
+		if (result.ec != std::errc() || result.ptr == pos) {
+			return false;
+		}
+		int last = first;
+		pos = result.ptr;
+		if (pos != end && *pos == '-') {
+			result = std::from_chars(pos + 1, end, last);
+			if (result.ec != std::errc() || result.ptr == pos + 1) {
+				return false;
+			}
+			pos = result.ptr;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE) {
+			return false;
+		}
+		for (int cpu = first; cpus != nullptr && cpu <= last; cpu++) {
+			cpus->push_back(cpu);
+		}
+		if (pos == end) {
+			return true;
+		}
+		if (*pos++ != ',') {
+			return false;
+		}
+	}
+}
+
+// A `limit NAME=VALUE` prefix: NAME is a resource as ulimit calls it in RLIMIT_* (nofile, as,
+// cpu, ...), VALUE a size as for parseSize or "unlimited"; nullopt if either is not recognised
+inline std::optional<ResourceLimit> parseLimit(std::string_view text) {
+	static constexpr std::pair<std::string_view, int> resources[] = {
+		{"as", RLIMIT_AS}, {"core", RLIMIT_CORE}, {"cpu", RLIMIT_CPU}, {"data", RLIMIT_DATA},
+		{"fsize", RLIMIT_FSIZE}, {"locks", RLIMIT_LOCKS}, {"memlock", RLIMIT_MEMLOCK},
+		{"msgqueue", RLIMIT_MSGQUEUE}, {"nice", RLIMIT_NICE}, {"nofile", RLIMIT_NOFILE},
+		{"nproc", RLIMIT_NPROC}, {"rss", RLIMIT_RSS}, {"rtprio", RLIMIT_RTPRIO},
+		{"sigpending", RLIMIT_SIGPENDING}, {"stack", RLIMIT_STACK},
+	};
+	size_t equals = text.find('=');
+	if (equals == std::string_view::npos) {
+		return std::nullopt;
+	}
+	std::string_view name = text.substr(0, equals);
+	std::string_view value = text.substr(equals + 1);
+	for (const auto& [resourceName, resource] : resources) {
+		if (name != resourceName) {
+			continue;
+		}
+		if (value == "unlimited") {
+			return ResourceLimit {resource, RLIM_INFINITY};
+		}
+		auto size = parseSize(value);
+		if (!size.has_value()) {
+			return std::nullopt;
+		}
+		return ResourceLimit {resource, *size};
+	}
+	return std::nullopt;
+}
+
 inline std::ostream& operator<<(std::ostream& os, const std::variant<Pipeline, ShellError>& v) {
     std::visit([&os](const auto& val) { os << val; }, v);
     return os;
@@ -0,0 +1,222 @@
+#ifndef PIPEWAIT_H
+#define PIPEWAIT_H
+
+#include <algorithm>
+#include <numeric>
+#include <cerrno>
+#include <vector>
+#include <csignal>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "jobs.h"
+#include "timing.h"
+
+inline int signalPidfd(int fd, int sig) {
+	return static_cast<int>(syscall(SYS_pidfd_send_signal, fd, sig, nullptr, 0));
+}
+
+// A pipeline's status from its stages' statuses: the last stage's or, with pipefail, that of the
+// last stage to fail
+inline int pipelineStatus(const std::vector<int>& statuses, bool pipefail) {
+	if (!pipefail) {
+		return statuses.empty() ? 0 : statuses.back();
+	}
+	auto failed = std::find_if(statuses.rbegin(), statuses.rend(), [](int status) { return status != 0; });
+	return failed == statuses.rend() ? 0 : *failed;
+}
+
+// The stage that failed first, or -1 if none did
+inline int firstFailedStage(const std::vector<int>& statuses) {
+	auto failed = std::find_if(statuses.begin(), statuses.end(), [](int status) { return status != 0; });
+	return failed == statuses.end() ? -1 : static_cast<int>(failed - statuses.begin());
+}
+
+// The processes of one foreground pipeline, waited for together through pidfds: the owner polls
+// getPidfd() of the running ones, with timeout(), calls exited() as it reaps each and expire()
+// after every wait. A process whose output goes only into the next one can make no more progress
+// once that has exited, so it is cut off. If it is still running GRACE_MS later, it is sent
+// SIGPIPE, as it would get on its next write, and after another GRACE_MS, in case it ignores
+// SIGPIPE, SIGTERM. The grace lets a stage that was about to exit anyway, or that fails on its
+// next write, end with its own status.
+//
+// A process may run several stages, as a fused run of builtins does. It then writes each stage's
+// status, as an int, to a pipe whose read end is given here, so statuses are still per stage.
+class PipelineWait {
+public:
+	static constexpr int GRACE_MS = 100;
+	// feedsNext[i] is whether process i's stdout is the pipe into process i + 1. stages[i], if
+	// given, is how many stages process i runs, and statusFds[i] the pipe it reports their
+	// statuses on, or -1; the statusFds are closed here.
+	PipelineWait(const std::vector<pid_t>& pids, const std::vector<bool>& feedsNext,
+			const std::vector<size_t>& stages = {}, const std::vector<int>& statusFds = {})
+		: pids {pids}, feedsNext {feedsNext}, stages {stages}, statusFds {statusFds}, pidfds(pids.size(), -1),
+		statuses(pids.size(), 0), reported(pids.size()), cutAt(pids.size(), -1), signals(pids.size(), 0),
+		done(pids.size(), false), running {pids.size()} {
+		this->stages.resize(pids.size(), 1);
+		this->statusFds.resize(pids.size(), -1);
+		for (size_t i = 0; i < pids.size(); i++) {
+			pidfds[i] = openPidfd(pids[i]);
+		}
+	}
+	PipelineWait(const PipelineWait&) = delete;
+	PipelineWait& operator=(const PipelineWait&) = delete;
+	~PipelineWait() {
+		for (int fd : pidfds) {
+			if (fd != -1) close(fd);
+		}
+		for (int fd : statusFds) {
+			if (fd != -1) close(fd);
+		}
+	}
+	size_t size() const {
+		return pids.size();
+	}
+	pid_t getPid(size_t i) const {
+		return pids[i];
+	}
+	// -1 once process i has exited, or if it has no pidfd and so must be waited for by blocking
+	int getPidfd(size_t i) const {
+		return pidfds[i];
+	}
+	bool isRunning() const {
+		return running > 0;
+	}
+	bool isRunning(size_t i) const {
+		return !done[i];
+	}
+	// Records that process i has been reaped with status, and cuts off the one feeding it
+	void exited(size_t i, int status) {
+		if (done[i]) {
+			return;
+		}
+		done[i] = true;
+		running--;
+		if (pidfds[i] != -1) {
+			close(pidfds[i]);
+			pidfds[i] = -1;
+		}
+		statuses[i] = exitCode(status);
+		if (statusFds[i] != -1) {
+			readStatuses(i);
+		}
+		if (failed == -1) {
+			size_t first = std::accumulate(stages.begin(), stages.begin() + i, size_t {0});
+			int stage = firstFailedStage(reported[i]);
+			if (stage != -1) {
+				failed = static_cast<int>(first + stage);
+			} else if (statuses[i] != 0 && !diedOfCutOff(i) && reported[i].size() < stages[i]) {
+				failed = static_cast<int>(first + reported[i].size());
+			}
+		}
+		if (i > 0 && feedsNext[i - 1] && !done[i - 1] && cutAt[i - 1] < 0) {
+			cutAt[i - 1] = monotonicSeconds();
+		}
+	}
+	// Milliseconds until a cut-off process is due its next signal, or -1 if none is
+	int timeout() const {
+		double next = -1;
+		for (size_t i = 0; i < pids.size(); i++) {
+			if (isDue(i) && (next < 0 || dueAt(i) < next)) {
+				next = dueAt(i);
+			}
+		}
+		if (next < 0) {
+			return -1;
+		}
+		return std::max(0, static_cast<int>((next - monotonicSeconds()) * 1000) + 1);
+	}
+	// Signals cut-off processes whose grace period is over
+	void expire() {
+		double now = monotonicSeconds();
+		for (size_t i = 0; i < pids.size(); i++) {
+			if (isDue(i) && now >= dueAt(i)) {
+				signal(i, signals[i]++ == 0 ? SIGPIPE : SIGTERM);
+			}
+		}
+	}
+	// The last stage's status or, with pipefail, that of the last stage to fail. A process that
+	// died of being cut off has not failed: it may well have been about to exit anyway.
+	int status(bool pipefail) const {
+		std::vector<int> all = getStatuses();
+		if (pipefail) {
+			size_t stage = all.size();
+			for (size_t i = pids.size(); i-- > 0;) {
+				for (size_t k = stages[i]; k-- > 0;) {
+					stage--;
+					if (all[stage] != 0 && (k < reported[i].size() || !diedOfCutOff(i))) {
+						return all[stage];
+					}
+				}
+			}
+			return 0;
+		}
+		return all.empty() ? 0 : all.back();
+	}
+	// Exit codes in pipeline order, one per stage. The stages of a process that did not report
+	// them all, because it was killed, take the process's own status from the first unreported on.
+	std::vector<int> getStatuses() const {
+		std::vector<int> all;
+		for (size_t i = 0; i < pids.size(); i++) {
+			for (size_t k = 0; k < stages[i]; k++) {
+				all.push_back(k < reported[i].size() ? reported[i][k] : statuses[i]);
+			}
+		}
+		return all;
+	}
+	// The process that failed first, not counting those that died of being cut off; -1 if none did
+	int getFailedStage() const {
+		return failed;
+	}
+private:
+	std::vector<pid_t> pids;
+	std::vector<bool> feedsNext;
+	std::vector<size_t> stages;
+	std::vector<int> statusFds;
+	std::vector<int> pidfds;
+	// Of each process, and of each stage that a process running several reported
+	std::vector<int> statuses;
+	std::vector<std::vector<int>> reported;
+	// When each process was cut off, or -1
+	std::vector<double> cutAt;
+	// How many signals each cut-off process has been sent: SIGPIPE, then SIGTERM
+	std::vector<int> signals;
+	std::vector<bool> done;
+	size_t running;
+	int failed {-1};
+
+	// Once process i has exited, its status pipe holds whatever it wrote and then ends
+	void readStatuses(size_t i) {
+		std::vector<int> values(stages[i]);
+		char* buffer = reinterpret_cast<char*>(values.data());
+		const size_t size = values.size() * sizeof(int);
+		size_t bytes = 0;
+		ssize_t n;
+		while (bytes < size && ((n = read(statusFds[i], buffer + bytes, size - bytes)) > 0 || (n == -1 && errno == EINTR))) {
+			bytes += std::max<ssize_t>(n, 0);
+		}
+		values.resize(bytes / sizeof(int));
+		reported[i] = std::move(values);
+		close(statusFds[i]);
+		statusFds[i] = -1;
+	}
+	bool isDue(size_t i) const {
+		return cutAt[i] >= 0 && !done[i] && signals[i] < 2;
+	}
+	double dueAt(size_t i) const {
+		return cutAt[i] + (signals[i] + 1) * GRACE_MS / 1000.0;
+	}
+	bool diedOfCutOff(size_t i) const {
+		return (signals[i] >= 1 && statuses[i] == 128 + SIGPIPE) || (signals[i] == 2 && statuses[i] == 128 + SIGTERM);
+	}
+	// Through the pidfd while there is one; otherwise the process is not yet reaped, so its pid
+	// cannot have been reused
+	void signal(size_t i, int sig) {
+		if (pidfds[i] != -1) {
+			signalPidfd(pidfds[i], sig);
+		} else {
+			kill(pids[i], sig);
+		}
+	}
+};
+#endif
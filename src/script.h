@@ -0,0 +1,159 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "pipeline.h"
+
+// A batch script read through mmap. Lines are views into the mapping, so the lexer works on the
+// mapped bytes directly; pages of lines already handed out are dropped again every few MB, so
+// resident memory stays flat however large the script is. Scripts up to COPY_LIMIT, and anything
+// that cannot be mapped (a pipe, /dev/stdin), are read into memory instead.
+//
+// Touching a mapped page that the file no longer covers raises SIGBUS, so a script that truncates
+// or rewrites itself as it runs must not crash the shell. A small one runs on from its copy. A
+// mapped one is opened as watched when lines run between calls to next(): each call then checks
+// the file's size first, and the script ends where the file now does.
+class MappedScript {
+public:
+	static constexpr size_t COPY_LIMIT = 4 << 20;
+	explicit MappedScript(const char* path, bool watched = false) {
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			throw std::invalid_argument(std::string(path) + ": " + strerror(errno));
+		}
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && static_cast<size_t>(st.st_size) > COPY_LIMIT) {
+			void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapping != MAP_FAILED) {
+				madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+				data = static_cast<const char*>(mapping);
+				size = mapped = st.st_size;
+			}
+		}
+		if (data == nullptr) {
+			char buf[65536];
+			ssize_t n;
+			while ((n = read(fd, buf, sizeof(buf))) > 0 || (n == -1 && errno == EINTR)) {
+				buffer.append(buf, n > 0 ? n : 0);
+			}
+			data = buffer.data();
+			size = buffer.size();
+		}
+		if (mapped == 0 || !watched) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	MappedScript(const MappedScript&) = delete;
+	MappedScript& operator=(const MappedScript&) = delete;
+	~MappedScript() {
+		if (mapped > 0) {
+			munmap(const_cast<char*>(data), mapped);
+		}
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+	// Sets line to the next line, without its newline; false at the end of the script.
+	// A line stays valid for the lifetime of the script, though its pages may need faulting back
+	// in, unless the file is truncated under it.
+	bool next(std::string_view& line) {
+		struct stat st;
+		if (fd != -1 && fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) < size) {
+			size = st.st_size;
+		}
+		if (pos >= size) {
+			return false;
+		}
+		release();
+		const char* start = data + pos;
+		const char* end = static_cast<const char*>(memchr(start, '\n', size - pos));
+		size_t length = end ? end - start : size - pos;
+		line = std::string_view(start, length);
+		pos += length + 1;
+		return true;
+	}
+	// The whole script, for formats read by offset rather than line by line
+	std::string_view contents() const {
+		return std::string_view(data, size);
+	}
+private:
+	static constexpr size_t RELEASE_CHUNK = 8 << 20;
+	// Kept open only to watch the file's size
+	int fd {-1};
+	const char* data {nullptr};
+	// Where the script ends, which a watched script's truncation can bring forward
+	size_t size {0};
+	// The length of the mapping, or 0 if the script was read into memory
+	size_t mapped {0};
+	size_t pos {0};
+	size_t released {0};
+	std::string buffer;
+
+	void release() {
+		if (mapped == 0 || pos - released < RELEASE_CHUNK) {
+			return;
+		}
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t end = pos / page * page;
+		madvise(const_cast<char*>(data) + released, end - released, MADV_DONTNEED);
+		released = end;
+	}
+};
+
+// Parsed lines memoized by their text, for generated scripts that repeat the same command
+// templates: a repeated line is executed from its cached AST without lexing or parsing. The cache
+// keeps copies of the lines it holds, so a line need only live until it is inserted.
+class ParseCache {
+public:
+	const Sequence* find(std::string_view line) {
+		if (disabled) {
+			return nullptr;
+		}
+		lookups++;
+		auto it = entries.find(line);
+		if (it != entries.end()) {
+			hits++;
+			return &it->second;
+		}
+		// A full cache that mostly misses (a script of distinct lines) is switched off for good,
+		// so such scripts pay for at most MAX_ENTRIES copies and 2 * MAX_ENTRIES lookups
+		if (entries.size() >= MAX_ENTRIES && lookups >= 2 * MAX_ENTRIES && hits * 4 < lookups) {
+			disabled = true;
+			entries.clear();
+			lines.clear();
+		}
+		return nullptr;
+	}
+	// Keeps a copy of sequence, on the default resource so it outlives the line's arena
+	void insert(std::string_view line, const Sequence& sequence) {
+		if (!disabled && entries.size() < MAX_ENTRIES && entries.count(line) == 0) {
+			entries.emplace(lines.emplace_back(line), Sequence(sequence, std::pmr::get_default_resource()));
+		}
+	}
+	size_t getSize() const {
+		return entries.size();
+	}
+	bool isDisabled() const {
+		return disabled;
+	}
+private:
+	static constexpr size_t MAX_ENTRIES = 4096;
+	// The keys' text
+	std::deque<std::string> lines;
+	std::unordered_map<std::string_view, Sequence> entries;
+	size_t lookups {0};
+	size_t hits {0};
+	bool disabled {false};
+};
+#endif
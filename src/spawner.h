@@ -0,0 +1,250 @@
+#ifndef SPAWNER_H
+#define SPAWNER_H
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <sched.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+// argv for exec built in a single allocation: the pointer array followed by the strings it points to
+class Argv {
+public:
+	template <typename Container>
+	explicit Argv(const Container& args) {
+		size_t bytes = 0;
+		for (const auto& arg : args) {
+			bytes += arg.size() + 1;
+		}
+		const size_t slots = args.size() + 1;
+		block.resize(slots + (bytes + sizeof(char*) - 1) / sizeof(char*));
+		char* strings = reinterpret_cast<char*>(block.data() + slots);
+		size_t i = 0;
+		for (const auto& arg : args) {
+			block[i++] = strings;
+			memcpy(strings, arg.data(), arg.size());
+			strings[arg.size()] = '\0';
+			strings += arg.size() + 1;
+		}
+		block[i] = nullptr;
+	}
+	Argv(const Argv&) = delete;
+	Argv& operator=(const Argv&) = delete;
+	Argv(Argv&&) = default;
+	Argv& operator=(Argv&&) = default;
+	char* const* data() const {
+		return block.data();
+	}
+	const char* operator[](size_t i) const {
+		return block[i];
+	}
+private:
+	std::vector<char*> block;
+};
+
+// Ordered fd setup for a child process, applied by posix_spawn in the child before exec,
+// or by apply() in a forked child that runs a builtin instead of exec'ing. CPU affinity, nice value
+// and resource limits, which posix_spawn cannot set, are applied after the fds; a plan with any of
+// them is spawned the way posix_spawn works, but running apply() in the child.
+class SpawnPlan {
+public:
+	void dup(int from, int to) {
+		actions.push_back({Action::DUP, to, from, nullptr, 0});
+	}
+	void open(int fd, const char* path, int flags) {
+		actions.push_back({Action::OPEN, fd, -1, path, flags});
+	}
+	void close(int fd) {
+		actions.push_back({Action::CLOSE, fd, -1, nullptr, 0});
+	}
+	// Closes the fds from `from` up that came from the shell at this point, rather than after the
+	// last step, so later steps can set up fds above 2 for the program. Those below `from` that
+	// earlier steps set up stay open too.
+	void closeInherited(int from = STDERR_FILENO + 1) {
+		actions.push_back({Action::CLOSE_FROM, from, -1, nullptr, 0});
+		closesInherited = true;
+	}
+	void newSession() {
+		session = true;
+	}
+	void setAffinity(const cpu_set_t& set) {
+		pinned = true;
+		cpus = set;
+	}
+	// Relative to the parent's, as nice(1) takes it
+	void setNice(int increment) {
+		niceness = increment;
+	}
+	// Sets both the soft and the hard limit
+	void setLimit(int resource, rlim_t value) {
+		limits.push_back({resource, value, value});
+	}
+	void setLimit(int resource, rlim_t soft, rlim_t hard) {
+		limits.push_back({resource, soft, hard});
+	}
+	bool hasScheduling() const {
+		return pinned || niceness != 0 || !limits.empty();
+	}
+	// Spawns the program at path with the plan applied; returns -1 and sets error on failure
+	pid_t spawn(const char* path, const Argv& argv, int& error) const {
+		if (hasScheduling()) {
+			return cloneExec(path, argv, error);
+		}
+		posix_spawn_file_actions_t fileActions;
+		posix_spawnattr_t attr;
+		posix_spawn_file_actions_init(&fileActions);
+		posix_spawnattr_init(&attr);
+		for (const auto& action : actions) {
+			if (action.kind == Action::DUP) {
+				posix_spawn_file_actions_adddup2(&fileActions, action.from, action.fd);
+			} else if (action.kind == Action::OPEN) {
+				posix_spawn_file_actions_addopen(&fileActions, action.fd, action.path, action.flags, 0644);
+			} else if (action.kind == Action::CLOSE) {
+				posix_spawn_file_actions_addclose(&fileActions, action.fd);
+			} else {
+				posix_spawn_file_actions_addclosefrom_np(&fileActions, action.fd);
+			}
+		}
+		// close_range in the child, so pipe ends and shell fds never leak past exec
+		if (!closesInherited) {
+			posix_spawn_file_actions_addclosefrom_np(&fileActions, STDERR_FILENO + 1);
+		}
+		// SIGPIPE back to its default, should the shell be ignoring it (see --daemon)
+		sigset_t defaults;
+		sigemptyset(&defaults);
+		sigaddset(&defaults, SIGPIPE);
+		posix_spawnattr_setsigdefault(&attr, &defaults);
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | (session ? POSIX_SPAWN_SETSID : 0));
+		pid_t pid = -1;
+		error = posix_spawn(&pid, path, &fileActions, &attr, argv.data(), environ);
+		posix_spawnattr_destroy(&attr);
+		posix_spawn_file_actions_destroy(&fileActions);
+		return error == 0 ? pid : -1;
+	}
+	// Applies the plan to the calling process; returns false with errno set if a step fails
+	bool apply() const {
+		for (const auto& action : actions) {
+			if (action.kind == Action::DUP) {
+				// dup2 onto itself would leave a close-on-exec pipe end to be closed by exec
+				if (action.from == action.fd ? fcntl(action.fd, F_SETFD, 0) == -1 : dup2(action.from, action.fd) == -1) {
+					return false;
+				}
+				continue;
+			} else if (action.kind == Action::CLOSE) {
+				::close(action.fd);
+				continue;
+			} else if (action.kind == Action::CLOSE_FROM) {
+				close_range(action.fd, ~0U, 0);
+				continue;
+			}
+			int fd = ::open(action.path, action.flags, 0644);
+			if (fd == -1) {
+				return false;
+			}
+			if (fd != action.fd) {
+				dup2(fd, action.fd);
+				::close(fd);
+			}
+		}
+		if (session) {
+			setsid();
+		}
+		if (pinned && sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+			return false;
+		}
+		if (niceness != 0) {
+			errno = 0;
+			int current = getpriority(PRIO_PROCESS, 0);
+			if ((current == -1 && errno != 0) || setpriority(PRIO_PROCESS, 0, current + niceness) == -1) {
+				return false;
+			}
+		}
+		for (const auto& limit : limits) {
+			struct rlimit value {limit.soft, limit.hard};
+			if (setrlimit(limit.resource, &value) == -1) {
+				return false;
+			}
+		}
+		signal(SIGPIPE, SIG_DFL);
+		if (!closesInherited) {
+			close_range(STDERR_FILENO + 1, ~0U, 0);
+		}
+		return true;
+	}
+private:
+	// The fork server ships plans to its helper process
+	friend class ForkServer;
+	struct Action {
+		enum Kind { DUP, OPEN, CLOSE, CLOSE_FROM } kind;
+		int fd;
+		int from;
+		const char* path;
+		int flags;
+	};
+	struct Limit {
+		int resource;
+		rlim_t soft;
+		rlim_t hard;
+	};
+	// What a cloned child needs, shared with it through CLONE_VM until it execs
+	struct Child {
+		const SpawnPlan* plan;
+		const char* path;
+		char* const* argv;
+		sigset_t mask;
+		int error;
+	};
+	static constexpr size_t STACK_SIZE = 64 << 10;
+	std::vector<Action> actions;
+	bool session {false};
+	bool closesInherited {false};
+	bool pinned {false};
+	cpu_set_t cpus {};
+	int niceness {0};
+	std::vector<Limit> limits;
+
+	// As posix_spawn does it: the child borrows this process's memory and the parent is suspended
+	// until it has exec'd, so nothing is copied, and a failure to exec comes back in child.error.
+	// Signals stay blocked in the child until its handlers are back to their defaults.
+	pid_t cloneExec(const char* path, const Argv& argv, int& error) const {
+		std::vector<char> stack(STACK_SIZE);
+		Child child {this, path, argv.data(), {}, 0};
+		sigset_t all;
+		sigfillset(&all);
+		pthread_sigmask(SIG_BLOCK, &all, &child.mask);
+		pid_t pid = clone(execChild, stack.data() + stack.size(), CLONE_VM | CLONE_VFORK | SIGCHLD, &child);
+		error = pid == -1 ? errno : child.error;
+		pthread_sigmask(SIG_SETMASK, &child.mask, nullptr);
+		if (pid != -1 && error != 0) {
+			// It has already exited
+			waitpid(pid, nullptr, 0);
+			return -1;
+		}
+		return pid;
+	}
+	static int execChild(void* arg) {
+		Child* child = static_cast<Child*>(arg);
+		for (int sig = 1; sig < NSIG; sig++) {
+			struct sigaction action;
+			if (sigaction(sig, nullptr, &action) == 0 && action.sa_handler != SIG_IGN && action.sa_handler != SIG_DFL) {
+				signal(sig, SIG_DFL);
+			}
+		}
+		if (child->plan->apply()) {
+			sigprocmask(SIG_SETMASK, &child->mask, nullptr);
+			execve(child->path, child->argv, environ);
+		}
+		child->error = errno;
+		_exit(127);
+	}
+};
+#endif
@@ -0,0 +1,91 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <ctime>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+inline void addTime(struct timeval& total, const struct timeval& t) {
+	total.tv_sec += t.tv_sec;
+	total.tv_usec += t.tv_usec;
+	if (total.tv_usec >= 1000000) {
+		total.tv_sec++;
+		total.tv_usec -= 1000000;
+	}
+}
+
+inline void subtractTime(struct timeval& total, const struct timeval& t) {
+	total.tv_sec -= t.tv_sec;
+	total.tv_usec -= t.tv_usec;
+	if (total.tv_usec < 0) {
+		total.tv_sec--;
+		total.tv_usec += 1000000;
+	}
+}
+
+// Sums CPU time and context switches; max RSS is the largest of the two
+inline void addUsage(struct rusage& total, const struct rusage& usage) {
+	addTime(total.ru_utime, usage.ru_utime);
+	addTime(total.ru_stime, usage.ru_stime);
+	total.ru_maxrss = std::max(total.ru_maxrss, usage.ru_maxrss);
+	total.ru_nvcsw += usage.ru_nvcsw;
+	total.ru_nivcsw += usage.ru_nivcsw;
+}
+
+inline double seconds(const struct timeval& t) {
+	return t.tv_sec + t.tv_usec / 1e6;
+}
+
+// Seconds on the monotonic clock, for wall times
+inline double monotonicSeconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// What `time` reports for one pipeline stage, or for the pipeline as a whole
+struct StageTime {
+	std::string command;
+	double real {0};
+	struct rusage usage {};
+};
+
+// Used when TIMEFORMAT is unset; a line is printed per stage and one for the total
+constexpr const char* DEFAULT_TIMEFORMAT = "%C\treal %Rs\tuser %Us\tsys %Ss\tmaxrss %MKB\tcsw %w/%c";
+
+// Expands a TIMEFORMAT-style format: %R real, %U user and %S sys seconds, %M max RSS in KB,
+// %w voluntary and %c involuntary context switches, %C the command, %% a percent sign
+inline std::string formatTime(std::string_view format, const StageTime& time) {
+	std::string result;
+	char number[32];
+	for (size_t i = 0; i < format.size(); i++) {
+		if (format[i] != '%' || i + 1 == format.size()) {
+			result += format[i];
+			continue;
+		}
+		switch (format[++i]) {
+			case 'R': snprintf(number, sizeof(number), "%.3f", time.real); break;
+			case 'U': snprintf(number, sizeof(number), "%.3f", seconds(time.usage.ru_utime)); break;
+			case 'S': snprintf(number, sizeof(number), "%.3f", seconds(time.usage.ru_stime)); break;
+			case 'M': snprintf(number, sizeof(number), "%ld", time.usage.ru_maxrss); break;
+			case 'w': snprintf(number, sizeof(number), "%ld", time.usage.ru_nvcsw); break;
+			case 'c': snprintf(number, sizeof(number), "%ld", time.usage.ru_nivcsw); break;
+			case 'C':
+				result += time.command;
+				continue;
+			case '%':
+				result += '%';
+				continue;
+			default:
+				result += format.substr(i - 1, 2);
+				continue;
+		}
+		result += number;
+	}
+	return result;
+}
+#endif
@@ -1,13 +1,13 @@
 #ifndef TOKEN_H
 #define TOKEN_H
 
-#include <string>
+#include <string_view>
 
 enum Type { PIPE, SEMI, QUOTE, LITERAL, END, REDIRECT, CONTROL };
 
 struct Token {
 	Type type{Type::END};
-	std::string value{"END"};
+	std::string_view value{"END"};
 
 	bool operator==(const Token& other) const {
 		return type == other.type && value == other.value;
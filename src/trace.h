@@ -0,0 +1,201 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+// Tracing is compiled in unless built with -DASH_NO_TRACING; compiled in, it is switched on at run
+// time by ASH_TRACE=path and costs one predictable branch per span while off.
+#ifndef ASH_NO_TRACING
+#define ASH_TRACING
+#endif
+
+// HDR-style latency histogram: log-linear buckets, 16 per power of two, so any recorded value is
+// reported within 1/16 of itself while the whole 64-bit range fits in a fixed array
+class LatencyHistogram {
+public:
+	void record(uint64_t value) {
+		counts[bucket(value)]++;
+		count++;
+		sum += value;
+		max = value > max ? value : max;
+	}
+	uint64_t getCount() const {
+		return count;
+	}
+	uint64_t getMax() const {
+		return max;
+	}
+	double mean() const {
+		return count == 0 ? 0 : static_cast<double>(sum) / count;
+	}
+	// Highest value equivalent to the given percentile (0-100), never above the recorded maximum
+	uint64_t percentile(double p) const {
+		uint64_t rank = static_cast<uint64_t>(p / 100 * count + 0.5);
+		rank = rank == 0 ? 1 : rank;
+		uint64_t seen = 0;
+		for (size_t i = 0; i < counts.size(); i++) {
+			seen += counts[i];
+			if (seen >= rank) {
+				uint64_t upper = highest(i);
+				return upper < max ? upper : max;
+			}
+		}
+		return max;
+	}
+private:
+	static constexpr int SUB_BITS = 4;
+	std::array<uint64_t, 64 << SUB_BITS> counts {};
+	uint64_t count {0};
+	uint64_t sum {0};
+	uint64_t max {0};
+
+	static size_t bucket(uint64_t value) {
+		if (value < (1u << SUB_BITS)) {
+			return value;
+		}
+		int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+		return (static_cast<size_t>(shift) << SUB_BITS) + (value >> shift);
+	}
+	static uint64_t highest(size_t index) {
+		if (index < (2u << SUB_BITS)) {
+			return index;
+		}
+		int shift = static_cast<int>(index >> SUB_BITS) - 1;
+		uint64_t mantissa = index - (static_cast<uint64_t>(shift) << SUB_BITS);
+		return (mantissa << shift) + (uint64_t {1} << shift) - 1;
+	}
+};
+
+// Records nanosecond spans of the shell's phases (lex, parse, spawn, wait, builtin, line).
+// On exit the spans are written to the ASH_TRACE path as Chrome trace JSON (chrome://tracing,
+// Perfetto), and per-phase latency histograms to the same path with ".hist" appended.
+class Tracer {
+public:
+	enum Phase { LEX, PARSE, SPAWN, WAIT, BUILTIN, LINE, PHASES };
+
+	static Tracer& instance() {
+		static Tracer tracer;
+		return tracer;
+	}
+	static bool enabled() {
+		return on;
+	}
+	static uint64_t now() {
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return static_cast<uint64_t>(t.tv_sec) * 1000000000 + t.tv_nsec;
+	}
+	// Starts tracing into path; a null or empty path leaves tracing off
+	void open(const char* path) {
+		if (path == nullptr || *path == '\0') {
+			return;
+		}
+		this->path = path;
+		origin = now();
+		on = true;
+	}
+	// Spans are tagged with the script line they belong to
+	void nextLine() {
+		line++;
+	}
+	void record(Phase phase, uint64_t start, uint64_t duration) {
+		if (events.size() < MAX_EVENTS) {
+			events.push_back(Event {phase, line, start, duration});
+		}
+		histograms[phase].record(duration);
+	}
+	const LatencyHistogram& histogram(Phase phase) const {
+		return histograms[phase];
+	}
+	// Writes both outputs; called on exit, and safe to call more than once
+	void dump() {
+		if (!on || getpid() != owner) {
+			return;
+		}
+		if (FILE* out = fopen(path.c_str(), "w")) {
+			fputs("{\"traceEvents\":[", out);
+			for (size_t i = 0; i < events.size(); i++) {
+				const Event& event = events[i];
+				fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"line\":%zu}}",
+					i == 0 ? "" : ",", NAMES[event.phase], owner, owner,
+					(event.start - origin) / 1e3, event.duration / 1e3, event.line);
+			}
+			fputs("\n],\"displayTimeUnit\":\"ns\"}\n", out);
+			fclose(out);
+		}
+		if (FILE* out = fopen((path + ".hist").c_str(), "w")) {
+			fprintf(out, "%-8s %8s %10s %10s %10s %10s %10s %10s\n", "phase", "count", "mean_us", "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+			for (int phase = 0; phase < PHASES; phase++) {
+				const LatencyHistogram& h = histograms[phase];
+				if (h.getCount() == 0) {
+					continue;
+				}
+				fprintf(out, "%-8s %8llu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", NAMES[phase],
+					static_cast<unsigned long long>(h.getCount()), h.mean() / 1e3,
+					h.percentile(50) / 1e3, h.percentile(90) / 1e3, h.percentile(99) / 1e3,
+					h.percentile(99.9) / 1e3, h.getMax() / 1e3);
+			}
+			fclose(out);
+		}
+		events.clear();
+	}
+	~Tracer() {
+		dump();
+	}
+private:
+	struct Event {
+		Phase phase;
+		size_t line;
+		uint64_t start;
+		uint64_t duration;
+	};
+	// The JSON keeps the first million spans, already more than trace viewers load comfortably;
+	// the histograms count every span
+	static constexpr size_t MAX_EVENTS = 1 << 20;
+	static constexpr const char* NAMES[PHASES] = {"lex", "parse", "spawn", "wait", "builtin", "line"};
+	static inline bool on {false};
+	// Forked children inherit the tracer but leave the dump to the shell
+	pid_t owner {getpid()};
+	std::string path;
+	uint64_t origin {0};
+	size_t line {0};
+	std::vector<Event> events;
+	std::array<LatencyHistogram, PHASES> histograms {};
+
+	Tracer() {}
+};
+
+// Records the enclosing scope as a span of the given phase
+class TraceSpan {
+public:
+	explicit TraceSpan(Tracer::Phase phase) : phase {phase}, start {Tracer::enabled() ? Tracer::now() : 0} {}
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+	~TraceSpan() {
+		if (Tracer::enabled()) {
+			Tracer::instance().record(phase, start, Tracer::now() - start);
+		}
+	}
+private:
+	Tracer::Phase phase;
+	uint64_t start;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// TRACE_SPAN times the rest of the enclosing scope as one phase; TRACE_NEXT_LINE starts the spans of
+// the next script line
+#ifdef ASH_TRACING
+#define TRACE_SPAN(phase) TraceSpan TRACE_CONCAT(traceSpan, __LINE__) {Tracer::phase}
+#define TRACE_NEXT_LINE() do { if (Tracer::enabled()) { Tracer::instance().nextLine(); } } while (false)
+#else
+#define TRACE_SPAN(phase) do {} while (false)
+#define TRACE_NEXT_LINE() do {} while (false)
+#endif
+#endif
@@ -0,0 +1,128 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "async.h"
+
+TEST(AsyncTest, StatusOfLastPipeline) {
+	AsyncExecutor executor;
+	EXPECT_EQ(executor.submit("/bin/false").get().status, 1);
+	EXPECT_EQ(executor.submit("/bin/true").get().status, 0);
+	EXPECT_EQ(executor.submit("/bin/true ; exit 3 ; /bin/true").get().status, 3);
+	EXPECT_EQ(executor.submit("/bin/sh -c \"exit 4\" | exit 5").get().status, 5);
+	EXPECT_EQ(executor.submit("/bin/true | /bin/false").get().status, 1);
+	EXPECT_EQ(executor.submit("/bin/false ; /bin/true").get().status, 0);
+	EXPECT_EQ(executor.submit("false").get().status, 1);
+	EXPECT_EQ(executor.submit("no-such-command-here").get().status, 127);
+}
+
+TEST(AsyncTest, ExitEndsOnlyTheLine) {
+	AsyncExecutor executor;
+	EXPECT_EQ(executor.submit("/bin/false ; exit ; /bin/true").get().status, 1);
+	EXPECT_EQ(executor.submit("/bin/true").get().status, 0);
+}
+
+TEST(AsyncTest, StatusPerStage) {
+	AsyncExecutor executor;
+	JobResult result = executor.submit("/bin/true | false | true | /bin/true").get();
+	EXPECT_EQ(result.pipeStatus, std::vector<int>({0, 1, 0, 0}));
+	EXPECT_EQ(result.failedStage, 1);
+	result = executor.submit("true | false").get();
+	EXPECT_EQ(result.status, 1);
+	EXPECT_EQ(result.pipeStatus, std::vector<int>({0, 1}));
+	EXPECT_EQ(result.failedStage, 1);
+}
+
+TEST(AsyncTest, SyntaxErrorIsReported) {
+	AsyncExecutor executor;
+	JobResult result = executor.submit("/bin/echo \"unclosed").get();
+	EXPECT_EQ(result.status, 2);
+	EXPECT_EQ(result.error, "Error: Unclosed Quote");
+}
+
+TEST(AsyncTest, ResourceUsage) {
+	AsyncExecutor executor;
+	// Busy for a while in the child, so its CPU time is measurable
+	JobResult result = executor.submit("/bin/sh -c \"i=0; while [ $i -lt 200000 ]; do i=$((i+1)); done\"").get();
+	EXPECT_EQ(result.status, 0);
+	EXPECT_GT(seconds(result.usage.ru_utime) + seconds(result.usage.ru_stime), 0);
+	EXPECT_GT(result.usage.ru_maxrss, 0);
+}
+
+TEST(AsyncTest, SubmitDoesNotWait) {
+	AsyncExecutor executor;
+	auto start = std::chrono::steady_clock::now();
+	std::vector<JobHandle> handles;
+	for (int i = 0; i < 8; i++) {
+		handles.push_back(executor.submit("/bin/sleep 0.3"));
+	}
+	EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(250));
+	EXPECT_FALSE(handles.front().isDone());
+	for (const auto& handle : handles) {
+		EXPECT_EQ(handle.get().status, 0);
+	}
+	// Run side by side, not one after another
+	EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(1500));
+}
+
+TEST(AsyncTest, BlockedBuiltinDoesNotStallReaper) {
+	// Standard input that stays empty until the test writes to it
+	int fds[2];
+	ASSERT_EQ(pipe(fds), 0);
+	int saved = dup(STDIN_FILENO);
+	dup2(fds[0], STDIN_FILENO);
+	close(fds[0]);
+	AsyncExecutor executor;
+	// The cat starts on the reaper thread, once the sleep has finished
+	JobHandle reading = executor.submit("/bin/sleep 0.1 ; cat > /dev/null");
+	std::this_thread::sleep_for(std::chrono::milliseconds(300));
+	// On a thread of its own, since a stalled reaper would also hold up submit()
+	auto other = std::async(std::launch::async, [&] { return executor.submit("/bin/true").get(); });
+	EXPECT_EQ(other.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+	EXPECT_FALSE(reading.isDone());
+	close(fds[1]);
+	EXPECT_EQ(reading.get().status, 0);
+	EXPECT_EQ(other.get().status, 0);
+	dup2(saved, STDIN_FILENO);
+	close(saved);
+	// A cd there still changes the shell's directory
+	auto cwd = std::filesystem::current_path();
+	EXPECT_EQ(executor.submit("/bin/true ; cd /").get().status, 0);
+	EXPECT_EQ(std::filesystem::current_path(), "/");
+	std::filesystem::current_path(cwd);
+}
+
+TEST(AsyncTest, Callback) {
+	std::atomic<int> statuses {0};
+	{
+		AsyncExecutor executor;
+		executor.submit("/bin/sh -c \"exit 3\"", [&](const JobResult& result) { statuses += result.status; });
+		executor.submit("false", [&](const JobResult& result) { statuses += result.status; });
+	}
+	// The destructor waits for both lines
+	EXPECT_EQ(statuses, 4);
+}
+
+TEST(AsyncTest, ManyThreads) {
+	AsyncExecutor executor;
+	std::atomic<int> wrong {0};
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 8; t++) {
+		threads.emplace_back([&, t] {
+			for (int i = 0; i < 20; i++) {
+				int expected = (t + i) % 2;
+				auto handle = executor.submit(expected ? "/bin/true | /bin/false" : "/bin/false ; /bin/true");
+				wrong += handle.get().status != expected;
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	EXPECT_EQ(wrong, 0);
+}
@@ -0,0 +1,131 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "batch.h"
+
+class ParallelBatchTest : public testing::Test {
+protected:
+	static constexpr int MAX_LINES = 16;
+	// Shared with the forked workers
+	struct Progress {
+		std::atomic<int> active;
+		std::atomic<int> peak;
+		std::atomic<bool> finished[MAX_LINES];
+	};
+	Progress* progress;
+	// What reached the shell itself, in order: lines run there, and the statuses recorded
+	std::vector<std::string> inShell;
+
+	void SetUp() override {
+		void* shared = mmap(nullptr, sizeof(Progress), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		ASSERT_NE(shared, MAP_FAILED);
+		progress = new (shared) Progress {};
+	}
+	void TearDown() override {
+		munmap(progress, sizeof(Progress));
+	}
+	// Runs lines through a ParallelBatch whose "execution" of line i (its text) holds until
+	// until(i) is true, then prints the line and exits with i; returns everything written to fd 1.
+	// A line that waits in vain gives up after a few seconds and prints "stuck" instead. A line
+	// that is not a number is a builtin run in the shell: it prints "barrier".
+	std::string runBatch(size_t slots, const std::vector<std::string>& lines, std::function<bool(int)> until = nullptr) {
+		FILE* capture = tmpfile();
+		std::cout.flush();
+		int saved = dup(STDOUT_FILENO);
+		dup2(fileno(capture), STDOUT_FILENO);
+		{
+			ParallelBatch batch(slots, [&](std::string_view line) {
+				if (!std::isdigit(static_cast<unsigned char>(line[0]))) {
+					inShell.emplace_back(line);
+					std::cout << "barrier" << std::endl;
+					return 0;
+				}
+				int i = std::stoi(std::string(line));
+				int active = ++progress->active;
+				for (int peak = progress->peak; active > peak && !progress->peak.compare_exchange_weak(peak, active);) {}
+				auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+				bool held = until && !until(i);
+				while (held && std::chrono::steady_clock::now() < deadline) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+					held = !until(i);
+				}
+				progress->active--;
+				progress->finished[i] = true;
+				std::cout << (held ? "stuck" : std::string(line)) << std::endl;
+				return i;
+			}, [&](int status) { inShell.push_back(std::to_string(status)); });
+			for (const auto& line : lines) {
+				batch.run(line);
+			}
+			batch.finish();
+		}
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+
+		std::string output;
+		char buf[4096];
+		ssize_t n;
+		lseek(fileno(capture), 0, SEEK_SET);
+		while ((n = read(fileno(capture), buf, sizeof(buf))) > 0) {
+			output.append(buf, n);
+		}
+		fclose(capture);
+		return output;
+	}
+};
+
+TEST_F(ParallelBatchTest, OutputKeepsScriptOrder) {
+	// Each line finishes only after the next one has, so they finish in reverse order
+	std::string output = runBatch(4, {"0", "1", "2", "3"}, [&](int i) { return i == 3 || progress->finished[i + 1]; });
+	EXPECT_EQ(output, "0\n1\n2\n3\n");
+	EXPECT_EQ(progress->peak, 4);
+}
+
+TEST_F(ParallelBatchTest, BoundedSlots) {
+	// Each line holds until two run at once; a third would never be let in
+	std::string output = runBatch(2, {"0", "1", "2", "3"}, [&](int) { return progress->peak >= 2; });
+	EXPECT_EQ(output, "0\n1\n2\n3\n");
+	EXPECT_EQ(progress->peak, 2);
+}
+
+TEST_F(ParallelBatchTest, WaitIsBarrier) {
+	// Line 1 would hold until line 0 finished anyway; the barrier means it starts only then
+	std::string output = runBatch(4, {"0", "wait", "1"}, [&](int i) { return i == 0 || progress->finished[0]; });
+	EXPECT_EQ(output, "0\nbarrier\n1\n");
+	EXPECT_EQ(progress->peak, 1);
+}
+
+TEST_F(ParallelBatchTest, ShellStateLinesRunInTheShell) {
+	std::string output = runBatch(2, {"0", "set -o pipefail", "1", "hash -r", "cd /tmp", "jobs", "exit"});
+	EXPECT_EQ(output, "0\nbarrier\n1\nbarrier\nbarrier\nbarrier\nbarrier\n");
+	std::vector<std::string> expected = {"0", "set -o pipefail", "1", "hash -r", "cd /tmp", "jobs", "exit"};
+	EXPECT_EQ(inShell, expected);
+}
+
+TEST_F(ParallelBatchTest, StatusesRecordedInScriptOrder) {
+	// Line 1 finishes after line 2, and both are recorded before the exit runs
+	runBatch(4, {"1", "2", "exit"}, [&](int i) { return i == 2 || progress->finished[2]; });
+	std::vector<std::string> expected = {"1", "2", "exit"};
+	EXPECT_EQ(inShell, expected);
+}
+
+TEST_F(ParallelBatchTest, OtherChildrenAreNotReaped) {
+	pid_t other = fork();
+	ASSERT_NE(other, -1);
+	if (other == 0) {
+		_exit(7);
+	}
+	std::string output = runBatch(2, {"0", "1", "2"});
+	EXPECT_EQ(output, "0\n1\n2\n");
+	int status;
+	ASSERT_EQ(waitpid(other, &status, 0), other);
+	EXPECT_EQ(WEXITSTATUS(status), 7);
+}
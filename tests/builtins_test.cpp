@@ -0,0 +1,195 @@
+#include <gtest/gtest.h>
+#include <sstream>
+#include <string>
+#include <sys/wait.h>
+#include "builtins.h"
+
+class BuiltinsTest : public testing::Test {
+protected:
+	std::istringstream in;
+	std::ostringstream out;
+	std::ostringstream err;
+
+	int run(const Builtin& builtin, std::initializer_list<const char*> args) {
+		Command cmd;
+		for (const char* arg : args) {
+			cmd.args.emplace_back(arg);
+		}
+		BuiltinIO io {in, out, err};
+		return builtin(cmd, io);
+	}
+};
+
+TEST_F(BuiltinsTest, Echo) {
+	EXPECT_EQ(run(builtinEcho, {"echo", "a", "b"}), 0);
+	EXPECT_EQ(out.str(), "a b\n");
+}
+
+TEST_F(BuiltinsTest, EchoFlags) {
+	run(builtinEcho, {"echo", "-n", "a"});
+	run(builtinEcho, {"echo", "-e", "b\\tc\\n"});
+	run(builtinEcho, {"echo", "-x", "d\\t"});
+	EXPECT_EQ(out.str(), "ab\tc\n\n-x d\\t\n");
+}
+
+TEST_F(BuiltinsTest, TrueFalse) {
+	EXPECT_EQ(run(builtinTrue, {"true"}), 0);
+	EXPECT_EQ(run(builtinFalse, {"false"}), 1);
+}
+
+TEST_F(BuiltinsTest, Printf) {
+	EXPECT_EQ(run(builtinPrintf, {"printf", "%s=%05d %x %%\\n", "a", "42", "255"}), 0);
+	EXPECT_EQ(out.str(), "a=00042 ff %\n");
+}
+
+TEST_F(BuiltinsTest, PrintfReusesFormat) {
+	run(builtinPrintf, {"printf", "[%s]", "a", "b", "c"});
+	EXPECT_EQ(out.str(), "[a][b][c]");
+}
+
+TEST_F(BuiltinsTest, PrintfInvalidNumber) {
+	EXPECT_EQ(run(builtinPrintf, {"printf", "%d", "abc"}), 1);
+	EXPECT_EQ(err.str(), "Error: printf: abc: invalid number\n");
+}
+
+TEST_F(BuiltinsTest, Test) {
+	EXPECT_EQ(run(builtinTest, {"test", "abc"}), 0);
+	EXPECT_EQ(run(builtinTest, {"test", ""}), 1);
+	EXPECT_EQ(run(builtinTest, {"test", "-z", ""}), 0);
+	EXPECT_EQ(run(builtinTest, {"test", "a", "!=", "b"}), 0);
+	EXPECT_EQ(run(builtinTest, {"test", "3", "-ge", "4"}), 1);
+	EXPECT_EQ(run(builtinTest, {"test", "-d", "/", "-a", "!", "-f", "/"}), 0);
+	EXPECT_EQ(run(builtinTest, {"test", "-f", "/", "-o", "(", "1", "-eq", "1", ")"}), 0);
+}
+
+TEST_F(BuiltinsTest, Bracket) {
+	EXPECT_EQ(run(builtinTest, {"[", "a", "=", "a", "]"}), 0);
+	EXPECT_EQ(run(builtinTest, {"[", "a", "=", "a"}), 2);
+	EXPECT_EQ(err.str(), "Error: [: missing ]\n");
+}
+
+TEST_F(BuiltinsTest, TestInvalidInteger) {
+	EXPECT_EQ(run(builtinTest, {"test", "x", "-lt", "1"}), 2);
+	EXPECT_EQ(err.str(), "Error: test: x: integer expression expected\n");
+}
+
+TEST_F(BuiltinsTest, FdStreams) {
+	int fds[2];
+	ASSERT_EQ(pipe(fds), 0);
+	{
+		FdOStream stream(fds[1]);
+		stream << "through a pipe" << '\n';
+	}
+	close(fds[1]);
+	FdIStream stream(fds[0]);
+	std::string line;
+	std::getline(stream, line);
+	close(fds[0]);
+	EXPECT_EQ(line, "through a pipe");
+}
+
+class CopyFdTest : public testing::Test {
+protected:
+	std::string source;
+	std::string target;
+	std::string content;
+
+	void SetUp() override {
+		source = testing::TempDir() + "ash_copyfd_source";
+		target = testing::TempDir() + "ash_copyfd_target";
+		for (int i = 0; i < 20000; i++) {
+			content += "line " + std::to_string(i) + "\n";
+		}
+		int fd = open(source.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		ASSERT_EQ(write(fd, content.data(), content.size()), static_cast<ssize_t>(content.size()));
+		close(fd);
+	}
+	void TearDown() override {
+		unlink(source.c_str());
+		unlink(target.c_str());
+	}
+	static std::string readAll(int fd) {
+		std::string result;
+		char buf[4096];
+		ssize_t n;
+		while ((n = read(fd, buf, sizeof(buf))) > 0) {
+			result.append(buf, n);
+		}
+		return result;
+	}
+};
+
+TEST_F(CopyFdTest, FileToFile) {
+	int from = open(source.c_str(), O_RDONLY);
+	int to = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	EXPECT_TRUE(copyFd(from, to));
+	close(from);
+	close(to);
+	int fd = open(target.c_str(), O_RDONLY);
+	EXPECT_EQ(readAll(fd), content);
+	close(fd);
+}
+
+TEST_F(CopyFdTest, FileToAppendedFile) {
+	int from = open(source.c_str(), O_RDONLY);
+	int to = open(target.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	ASSERT_EQ(write(to, "first\n", 6), 6);
+	EXPECT_TRUE(copyFd(from, to));
+	close(from);
+	close(to);
+	int fd = open(target.c_str(), O_RDONLY);
+	EXPECT_EQ(readAll(fd), "first\n" + content);
+	close(fd);
+}
+
+TEST_F(CopyFdTest, FileThroughPipe) {
+	int fds[2];
+	ASSERT_EQ(pipe(fds), 0);
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		int from = open(source.c_str(), O_RDONLY);
+		_exit(copyFd(from, fds[1]) ? 0 : 1);
+	}
+	close(fds[1]);
+	int to = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	EXPECT_TRUE(copyFd(fds[0], to));
+	close(fds[0]);
+	close(to);
+	int status;
+	waitpid(pid, &status, 0);
+	EXPECT_EQ(WEXITSTATUS(status), 0);
+	int fd = open(target.c_str(), O_RDONLY);
+	EXPECT_EQ(readAll(fd), content);
+	close(fd);
+}
+
+TEST_F(CopyFdTest, CatIntoStream) {
+	std::istringstream in("stdin\n");
+	std::ostringstream out;
+	std::ostringstream err;
+	Command cmd;
+	for (const char* arg : {"cat", "-", "/nonexistent"}) {
+		cmd.args.emplace_back(arg);
+	}
+	cmd.args.emplace_back(source);
+	BuiltinIO io {in, out, err};
+	EXPECT_EQ(builtinCat(cmd, io), 1);
+	EXPECT_EQ(out.str(), "stdin\n" + content);
+	EXPECT_EQ(err.str(), "Error: cat: /nonexistent: No such file or directory\n");
+}
+
+TEST(CatTest, OptionsAreLeftToTheProgram) {
+	auto command = [](std::initializer_list<const char*> args) {
+		Command cmd;
+		for (const char* arg : args) {
+			cmd.args.emplace_back(arg);
+		}
+		return cmd;
+	};
+	EXPECT_TRUE(catHandles(command({"cat"})));
+	EXPECT_TRUE(catHandles(command({"cat", "-", "file"})));
+	EXPECT_FALSE(catHandles(command({"cat", "-n", "file"})));
+	EXPECT_FALSE(catHandles(command({"cat", "file", "-A"})));
+	EXPECT_FALSE(catHandles(command({"cat", "--", "-file"})));
+}
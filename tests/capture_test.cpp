@@ -0,0 +1,66 @@
+#include <gtest/gtest.h>
+#include <string>
+#include "capture.h"
+#include "executor.h"
+#include "lexer.h"
+#include "parser.h"
+
+class CaptureTest : public testing::Test {
+protected:
+	Executor executor;
+	std::string output;
+	std::string errors;
+
+	bool capture(const std::string& line, Capture& out, Capture& err) {
+		Lexer lexer(line);
+		Parser parser(lexer);
+		return executor.capture(parser.parse(), out, err);
+	}
+};
+
+TEST_F(CaptureTest, StdoutAndStderrSeparately) {
+	Capture out(output);
+	Capture err(errors);
+	capture("echo builtin; /bin/echo child; /bin/ls /nonexistent-path; /nonexistent/command", out, err);
+	EXPECT_EQ(out.view(), "builtin\nchild\n");
+	EXPECT_NE(err.view().find("nonexistent-path"), std::string_view::npos);
+	EXPECT_NE(err.view().find("Error: /nonexistent/command: "), std::string_view::npos);
+	EXPECT_FALSE(out.isSpilled());
+	// The caller's own buffers hold the output
+	EXPECT_EQ(out.view().data(), output.data());
+}
+
+TEST_F(CaptureTest, RedirectionWinsOverCapture) {
+	std::string path = testing::TempDir() + "ash_capture_redirect";
+	Capture out(output);
+	Capture err(errors);
+	capture("/bin/echo file > " + path + "; /bin/cat " + path, out, err);
+	EXPECT_EQ(out.view(), "file\n");
+	unlink(path.c_str());
+}
+
+TEST_F(CaptureTest, LargeOutputSpills) {
+	Capture out(output, 1 << 20);
+	Capture err(errors);
+	capture("/usr/bin/head -c 5000000 /dev/zero | /usr/bin/tr \"\\0\" x; echo end", out, err);
+	ASSERT_TRUE(out.isSpilled());
+	EXPECT_NE(out.getFd(), -1);
+	EXPECT_TRUE(output.empty());
+	std::string_view view = out.view();
+	ASSERT_EQ(view.size(), 5000004);
+	EXPECT_EQ(view.find_first_not_of('x'), 5000000);
+	EXPECT_EQ(view.substr(5000000), "end\n");
+}
+
+TEST_F(CaptureTest, StopsAtExit) {
+	Capture out(output);
+	Capture err(errors);
+	EXPECT_FALSE(capture("echo one; exit; echo two", out, err));
+	EXPECT_EQ(out.view(), "one\n");
+	// Output goes back to fd 1 afterwards
+	std::string more;
+	Capture again(more);
+	Capture againErr(errors);
+	EXPECT_TRUE(capture("/bin/echo again", again, againErr));
+	EXPECT_EQ(again.view(), "again\n");
+}
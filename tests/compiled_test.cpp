@@ -0,0 +1,175 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "compiled.h"
+#include "lexer.h"
+#include "parser.h"
+
+static Sequence parse(std::string_view line) {
+	Lexer lexer(line);
+	Parser parser(lexer);
+	return parser.parse();
+}
+
+class CompiledScriptTest : public testing::Test {
+protected:
+	std::string source = testing::TempDir() + "ash_compiled_source";
+	std::string output = testing::TempDir() + "ash_compiled.ashc";
+	std::pmr::monotonic_buffer_resource arena;
+
+	void TearDown() override {
+		unlink(source.c_str());
+		unlink(output.c_str());
+	}
+	// Compiles lines, deduplicated the way ash --compile does, and returns the file's bytes
+	std::string compile(const std::vector<std::string>& lines) {
+		std::ofstream out(source);
+		for (const auto& line : lines) {
+			out << line << "\n";
+		}
+		out.close();
+		CompiledScriptWriter writer;
+		std::vector<std::string> seen;
+		for (const auto& line : lines) {
+			auto it = std::find(seen.begin(), seen.end(), line);
+			if (it != seen.end()) {
+				writer.repeat(it - seen.begin());
+			} else {
+				seen.push_back(line);
+				writer.add(parse(line));
+			}
+		}
+		writer.write(output, source, stampFile(source));
+		std::ostringstream bytes;
+		bytes << std::ifstream(output).rdbuf();
+		return bytes.str();
+	}
+};
+
+TEST_F(CompiledScriptTest, RoundTrip) {
+	std::vector<std::string> lines = {
+		"ls -la | grep x | wc -l > out.txt",
+		"cat < in.txt 2>> err.txt &",
+		"time echo \"a b\" 'c' 2>&1",
+		"pipesize=1M yes | head -1",
+		"cpus=0-1 pin 2 nice 3 limit nofile=unlimited limit cpu=10 a | b",
+		"",
+		"echo \"unterminated",
+		"ls | | wc",
+		"echo a ; echo b",
+	};
+	std::string bytes = compile(lines);
+	CompiledScript compiled(bytes);
+	ASSERT_TRUE(compiled.isCurrentVersion());
+	EXPECT_EQ(compiled.getSource(), source);
+	ASSERT_EQ(compiled.getLineCount(), lines.size());
+	for (size_t i = 0; i < lines.size(); i++) {
+		EXPECT_EQ(compiled.line(i, &arena), parse(lines[i])) << lines[i];
+	}
+}
+
+TEST_F(CompiledScriptTest, RepeatedLinesShareEncoding) {
+	std::string once = compile({"ls -la | wc -l > out.txt"});
+	std::string repeated = compile(std::vector<std::string>(100, "ls -la | wc -l > out.txt"));
+	// Each repeat costs only its line index
+	EXPECT_EQ(repeated.size() - once.size(), 99 * sizeof(uint32_t));
+	CompiledScript compiled(repeated);
+	EXPECT_EQ(compiled.line(99, &arena), parse("ls -la | wc -l > out.txt"));
+}
+
+TEST_F(CompiledScriptTest, NotCompiled) {
+	EXPECT_FALSE(CompiledScript::isCompiled("echo ASHC"));
+	EXPECT_FALSE(CompiledScript::isCompiled("ASH"));
+	EXPECT_THROW(CompiledScript("echo hello"), std::invalid_argument);
+}
+
+TEST_F(CompiledScriptTest, TruncatedThrows) {
+	std::string bytes = compile({"ls -la | wc -l", "echo a > b"});
+	for (size_t size = sizeof(ASHC_MAGIC); size < bytes.size(); size++) {
+		std::string_view truncated(bytes.data(), size);
+		EXPECT_THROW({
+			CompiledScript compiled(truncated);
+			for (uint64_t i = 0; i < compiled.getLineCount(); i++) {
+				compiled.line(i, &arena);
+			}
+		}, std::invalid_argument) << size;
+	}
+}
+
+TEST_F(CompiledScriptTest, CorruptLineIndexThrows) {
+	CompiledScriptWriter writer;
+	writer.add(parse("echo a"));
+	writer.repeat(5);
+	writer.write(output, source, SourceStamp {});
+	std::ostringstream bytes;
+	bytes << std::ifstream(output).rdbuf();
+	std::string contents = bytes.str();
+	CompiledScript compiled(contents);
+	EXPECT_EQ(compiled.line(0, &arena), parse("echo a"));
+	EXPECT_THROW(compiled.line(1, &arena), std::invalid_argument);
+}
+
+TEST_F(CompiledScriptTest, ValuesTheParserRejectsThrow) {
+	// Each sequence is written as it is, then must not decode
+	auto decodes = [&](const Sequence& sequence) {
+		CompiledScriptWriter writer;
+		writer.add(sequence);
+		writer.write(output, source, SourceStamp {});
+		std::ostringstream bytes;
+		bytes << std::ifstream(output).rdbuf();
+		std::string contents = bytes.str();
+		CompiledScript(contents).line(0, &arena);
+	};
+	auto pipeline = [](Sequence& sequence) -> Pipeline& { return std::get<Pipeline>(sequence[0]); };
+	Sequence fd = parse("echo hi > out");
+	pipeline(fd).commands[0].redirection.ops[0].fd = 100000;
+	EXPECT_THROW(decodes(fd), std::invalid_argument);
+	Sequence from = parse("echo hi 2>&1");
+	pipeline(from).commands[0].redirection.ops[0].from = -7;
+	EXPECT_THROW(decodes(from), std::invalid_argument);
+	Sequence error {ShellError {static_cast<ErrorType>(7), "Error: ?"}};
+	EXPECT_THROW(decodes(error), std::invalid_argument);
+	Sequence nice = parse("nice 5 echo hi");
+	pipeline(nice).commands[0].placement.nice = 1000;
+	EXPECT_THROW(decodes(nice), std::invalid_argument);
+	Sequence pin = parse("pin 0 echo hi");
+	pipeline(pin).commands[0].placement.cpus = "x";
+	EXPECT_THROW(decodes(pin), std::invalid_argument);
+	Sequence cpus = parse("cpus=0 echo hi");
+	pipeline(cpus).cpus = "0-";
+	EXPECT_THROW(decodes(cpus), std::invalid_argument);
+	EXPECT_NO_THROW(decodes(parse("pin 0 nice --40 echo hi 2>&1 > out; echo \"unclosed")));
+}
+
+TEST_F(CompiledScriptTest, SourceChangeDetected) {
+	std::string bytes = compile({"echo a"});
+	EXPECT_TRUE(CompiledScript(bytes).isSourceUnchanged());
+	// Same size, different content: caught by the hash even if the mtime were unchanged
+	std::ofstream(source) << "echo b\n";
+	EXPECT_FALSE(CompiledScript(bytes).isSourceUnchanged());
+	// Rewriting the original content only touches the mtime, so the hash settles it
+	std::ofstream(source) << "echo a\n";
+	EXPECT_TRUE(CompiledScript(bytes).isSourceUnchanged());
+	unlink(source.c_str());
+	EXPECT_FALSE(CompiledScript(bytes).isSourceUnchanged());
+}
+
+TEST_F(CompiledScriptTest, OtherVersionKeepsSource) {
+	std::string bytes = compile({"echo a"});
+	uint32_t version = ASHC_VERSION + 1;
+	memcpy(bytes.data() + sizeof(ASHC_MAGIC), &version, sizeof(version));
+	// Nothing past the source path is read, so another layout cannot be misread
+	bytes.resize(sizeof(ASHC_MAGIC) + 2 * sizeof(uint32_t) + source.size());
+	CompiledScript compiled(bytes);
+	EXPECT_FALSE(compiled.isCurrentVersion());
+	EXPECT_EQ(compiled.getSource(), source);
+}
+
+TEST_F(CompiledScriptTest, UnwritableOutputThrows) {
+	CompiledScriptWriter writer;
+	writer.add(parse("echo a"));
+	EXPECT_THROW(writer.write("/nonexistent/dir/out.ashc", source, SourceStamp {}), std::invalid_argument);
+}
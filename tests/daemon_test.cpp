@@ -0,0 +1,160 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include "daemon.h"
+
+class DaemonTest : public testing::Test {
+protected:
+	std::string path = testing::TempDir() + "ash_daemon_test.sock";
+
+	void TearDown() override {
+		unlink(path.c_str());
+	}
+	// Runs line from a forked client; returns the client's pid, whose exit code is the status
+	pid_t client(const std::string& line) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			int status = runInDaemon(path.c_str(), line);
+			_exit(status == -1 ? 255 : status);
+		}
+		return pid;
+	}
+	static int exitCode(pid_t pid) {
+		int status;
+		waitpid(pid, &status, 0);
+		return WEXITSTATUS(status);
+	}
+};
+
+TEST_F(DaemonTest, RequestAndReply) {
+	DaemonSocket daemon(path.c_str());
+	pid_t pid = client("echo hello | wc -c");
+	DaemonSocket::Request request;
+	ASSERT_TRUE(daemon.next(request));
+	EXPECT_EQ(request.line, "echo hello | wc -c");
+	ASSERT_EQ(request.fds.size(), DAEMON_FDS);
+	// The client's own fds, here the test's stdout
+	struct stat received, mine;
+	ASSERT_EQ(fstat(request.fds[DAEMON_STDOUT], &received), 0);
+	ASSERT_EQ(fstat(STDOUT_FILENO, &mine), 0);
+	EXPECT_EQ(received.st_ino, mine.st_ino);
+	DaemonSocket::reply(request, 7);
+	EXPECT_EQ(request.connection, -1);
+	EXPECT_EQ(exitCode(pid), 7);
+}
+
+TEST_F(DaemonTest, NoDaemon) {
+	EXPECT_EQ(runInDaemon(path.c_str(), "true"), -1);
+	EXPECT_EQ(errno, ENOENT);
+}
+
+TEST_F(DaemonTest, LiveSocketIsKept) {
+	DaemonSocket daemon(path.c_str());
+	EXPECT_THROW(DaemonSocket second(path.c_str()), std::invalid_argument);
+	// The first daemon still serves
+	pid_t pid = client("true");
+	DaemonSocket::Request request;
+	ASSERT_TRUE(daemon.next(request));
+	DaemonSocket::reply(request, 0);
+	EXPECT_EQ(exitCode(pid), 0);
+}
+
+TEST_F(DaemonTest, StaleSocketIsReplaced) {
+	{
+		// A socket file nobody listens on, as a killed daemon leaves behind
+		struct sockaddr_un address;
+		ASSERT_TRUE(daemonAddress(path.c_str(), address));
+		int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		ASSERT_EQ(bind(sock, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)), 0);
+		close(sock);
+	}
+	DaemonSocket daemon(path.c_str());
+	pid_t pid = client("true");
+	DaemonSocket::Request request;
+	ASSERT_TRUE(daemon.next(request));
+	DaemonSocket::reply(request, 3);
+	EXPECT_EQ(exitCode(pid), 3);
+}
+
+TEST_F(DaemonTest, RegularFileIsKept) {
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+	close(fd);
+	EXPECT_THROW(DaemonSocket daemon(path.c_str()), std::invalid_argument);
+	struct stat st;
+	EXPECT_EQ(stat(path.c_str(), &st), 0);
+}
+
+TEST_F(DaemonTest, SilentClientIsDropped) {
+	DaemonSocket daemon(path.c_str(), 200);
+	// Connects and sends half a length, then nothing
+	struct sockaddr_un address;
+	ASSERT_TRUE(daemonAddress(path.c_str(), address));
+	int silent = socket(AF_UNIX, SOCK_STREAM, 0);
+	ASSERT_EQ(connect(silent, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)), 0);
+	ASSERT_EQ(write(silent, "\0\0", 2), 2);
+	pid_t pid = client("true");
+	DaemonSocket::Request request;
+	ASSERT_TRUE(daemon.next(request));
+	EXPECT_EQ(request.line, "true");
+	DaemonSocket::reply(request, 5);
+	EXPECT_EQ(exitCode(pid), 5);
+	// The silent one was hung up on
+	char byte;
+	EXPECT_EQ(read(silent, &byte, 1), 0);
+	close(silent);
+}
+
+TEST(FdPassTest, LargeMessageWithFds) {
+	int sockets[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+	// Larger than the socket buffer, so the sender blocks part way and the rest follows the fds
+	std::string payload(4 << 20, 'x');
+	payload.back() = 'y';
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(sockets[0]);
+		_exit(sendMessage(sockets[1], payload, {STDIN_FILENO, STDOUT_FILENO}) ? 0 : 1);
+	}
+	close(sockets[1]);
+	std::string received;
+	std::vector<int> fds;
+	ASSERT_TRUE(receiveMessage(sockets[0], received, fds));
+	EXPECT_EQ(received, payload);
+	EXPECT_EQ(fds.size(), 2);
+	for (int fd : fds) {
+		EXPECT_EQ(fcntl(fd, F_GETFD) & FD_CLOEXEC, FD_CLOEXEC);
+		close(fd);
+	}
+	EXPECT_FALSE(receiveMessage(sockets[0], received, fds));
+	close(sockets[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	EXPECT_EQ(WEXITSTATUS(status), 0);
+}
+
+TEST(FdPassTest, TooManyFds) {
+	int sockets[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+	std::vector<int> fds(MAX_PASSED_FDS + 1, STDOUT_FILENO);
+	EXPECT_FALSE(sendMessage(sockets[0], "x", fds));
+	EXPECT_EQ(errno, EINVAL);
+	close(sockets[0]);
+	close(sockets[1]);
+}
+
+TEST(FdPassTest, OversizedLengthIsRefused) {
+	int sockets[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+	uint32_t length = UINT32_MAX;
+	ASSERT_EQ(write(sockets[1], &length, sizeof(length)), sizeof(length));
+	std::string received;
+	std::vector<int> fds;
+	EXPECT_FALSE(receiveMessage(sockets[0], received, fds));
+	EXPECT_EQ(errno, EMSGSIZE);
+	EXPECT_TRUE(received.empty());
+	EXPECT_FALSE(sendMessage(sockets[1], std::string(MAX_MESSAGE + 1, 'x'), {}));
+	EXPECT_EQ(errno, EMSGSIZE);
+	close(sockets[0]);
+	close(sockets[1]);
+}
@@ -1,7 +1,13 @@
 #include <gtest/gtest.h>
+#include <chrono>
+#include <fstream>
 #include <sstream>
 #include <string>
 #include <variant>
+#include <vector>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include "executor.h"
 #include "lexer.h"
 #include "token.h"
@@ -11,22 +17,39 @@ class ExecutorTest : public testing::Test {
 protected:
 	void SetUp() override {}
 	ExecutorTest() {}
-	void testExecutor(std::string input, std::string expected) {
+	// Output written by child processes is captured too. Returns how many child processes the
+	// input started.
+	size_t testExecutor(std::string input, std::string expected, bool forkServer = false) {
 		Lexer lexer(input);
 		Parser parser(lexer);
 		auto sequence = parser.parse();
 
 		Executor executor;
-		std::stringstream buffer;
-
-		std::streambuf* old = std::cout.rdbuf(buffer.rdbuf());
-		executor.execute(sequence);
-		std::cout << std::endl;
-		std::cout.rdbuf(old);
-
-		std::string output = buffer.str();
+		if (forkServer) {
+			EXPECT_TRUE(executor.startForkServer());
+		}
+		std::string output;
+		std::string errors;
+		Capture out(output);
+		Capture err(errors);
+		executor.capture(sequence, out, err);
 
 		EXPECT_EQ(output, expected);
+		return executor.getSpawnCount();
+	}
+	// Runs input in executor and returns its stdout
+	static std::string run(Executor& executor, std::string input) {
+		Lexer lexer(input);
+		Parser parser(lexer);
+		std::string output;
+		std::string errors;
+		Capture out(output);
+		Capture err(errors);
+		executor.capture(parser.parse(), out, err);
+		return output;
+	}
+	static double elapsed(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 	}
 };
 
@@ -35,3 +58,411 @@ TEST_F(ExecutorTest, BasicInput) {
 	std::string expected = "blah\n";
 	testExecutor(input, expected);
 }
+
+TEST_F(ExecutorTest, Pipeline) {
+	std::string input = "echo blah | tr a-z A-Z";
+	std::string expected = "BLAH\n";
+	testExecutor(input, expected);
+}
+
+TEST_F(ExecutorTest, RedirectOverridesPipe) {
+	std::string input = "echo blah > /dev/null | cat";
+	std::string expected = "";
+	testExecutor(input, expected);
+}
+
+TEST_F(ExecutorTest, StderrIntoPipe) {
+	const std::string both = "/bin/sh -c \"echo out; echo err >&2\"";
+	for (bool forkServer : {false, true}) {
+		testExecutor(both + " 2>&1 | /usr/bin/sort", "err\nout\n", forkServer);
+		// Order matters: stderr takes stdout's pipe before stdout moves to /dev/null
+		testExecutor(both + " 2>&1 > /dev/null | /bin/cat", "err\n", forkServer);
+		testExecutor(both + " > /dev/null 2>&1 | /bin/cat", "", forkServer);
+		// And in the shell itself
+		testExecutor("echo builtin >&2 2>/dev/null; echo shown 2>&1 >&2", "shown\n", forkServer);
+	}
+}
+
+TEST_F(ExecutorTest, RedirectAnyFd) {
+	std::string path = testing::TempDir() + "ash_redirect_fd";
+	for (bool forkServer : {false, true}) {
+		testExecutor("/bin/sh -c \"echo three >&3\" 3> " + path + "; /bin/cat " + path, "three\n", forkServer);
+		testExecutor("/bin/sh -c \"cat <&4\" 4< " + path, "three\n", forkServer);
+		testExecutor("/bin/cat 0< " + path + " | /bin/cat", "three\n", forkServer);
+		// Closed fds stay closed; a dup from one is an error
+		testExecutor("/bin/sh -c \"echo x >&3\" 3> " + path + " 3>&-; /bin/cat " + path, "", forkServer);
+		testExecutor("/bin/echo bad >&7; echo bad >&7; echo next", "next\n", forkServer);
+	}
+	unlink(path.c_str());
+}
+
+TEST_F(ExecutorTest, CommandNotFound) {
+	std::string input = "/nonexistent/command; echo after";
+	std::string expected = "after\n";
+	testExecutor(input, expected);
+}
+
+TEST_F(ExecutorTest, BuiltinsDoNotFork) {
+	std::string input = "echo a; true; false; printf \"%s-%d\\n\" x 1 y 2; [ 1 -lt 2 ]; test -d /";
+	std::string expected = "a\nx-1\ny-2\n";
+	EXPECT_EQ(testExecutor(input, expected), 0);
+}
+
+TEST_F(ExecutorTest, BuiltinRedirect) {
+	std::string path = testing::TempDir() + "ash_builtin_redirect";
+	std::string input = "echo one > " + path + "; echo two >> " + path + "; /bin/cat " + path;
+	std::string expected = "one\ntwo\n";
+	EXPECT_EQ(testExecutor(input, expected), 1);
+	unlink(path.c_str());
+}
+
+TEST_F(ExecutorTest, BuiltinInPipeline) {
+	std::string input = "echo blah | tr a-z A-Z | cat";
+	std::string expected = "BLAH\n";
+	EXPECT_EQ(testExecutor(input, expected), 3);
+}
+
+TEST_F(ExecutorTest, ForksPerScript) {
+	std::string script = "echo start; printf \"%s\\n\" mid; true; false; test -n x; pwd > /dev/null; echo end";
+	std::string external = "/bin/echo start; /usr/bin/printf \"%s\\n\" mid; /bin/true; /bin/false; /usr/bin/test -n x; /bin/pwd > /dev/null; /bin/echo end";
+	std::string expected = "start\nmid\nend\n";
+	size_t builtinForks = testExecutor(script, expected);
+	size_t externalForks = testExecutor(external, expected);
+	EXPECT_EQ(builtinForks, 0);
+	EXPECT_EQ(externalForks, 7);
+	RecordProperty("forks_with_builtins", static_cast<int>(builtinForks));
+	RecordProperty("forks_without_builtins", static_cast<int>(externalForks));
+	std::cerr << "forks per script: " << externalForks << " -> " << builtinForks << std::endl;
+}
+
+TEST_F(ExecutorTest, BuiltinPipelineDoesNotFork) {
+	std::string input = "echo a | echo b | printf \"%s\\n\" c";
+	std::string expected = "c\n";
+	EXPECT_EQ(testExecutor(input, expected), 0);
+}
+
+TEST_F(ExecutorTest, AdjacentBuiltinsShareOneChild) {
+	std::string input = "echo a | echo b | tr a-z A-Z | echo c | echo d";
+	std::string expected = "d\n";
+	EXPECT_EQ(testExecutor(input, expected), 3);
+}
+
+TEST_F(ExecutorTest, CatBetweenFusedStages) {
+	std::string input = "echo hi | cat | cat";
+	std::string expected = "hi\n";
+	EXPECT_EQ(testExecutor(input, expected), 0);
+}
+
+TEST_F(ExecutorTest, FusedStagesHoldNoBuffer) {
+	std::string path = testing::TempDir() + "ash_fused_stream";
+	// 64 MB, sparse, so it costs nothing to make
+	FILE* file = fopen(path.c_str(), "w");
+	ASSERT_NE(file, nullptr);
+	ASSERT_EQ(ftruncate(fileno(file), 64 << 20), 0);
+	fclose(file);
+	EXPECT_EQ(testExecutor("cat " + path + " | cat | cat | /usr/bin/wc -c; cat " + path + " | echo done", "67108864\ndone\n"), 2);
+	struct rusage usage;
+	getrusage(RUSAGE_CHILDREN, &usage);
+	EXPECT_LT(usage.ru_maxrss, 32 << 10);
+	unlink(path.c_str());
+}
+
+TEST_F(ExecutorTest, CatMixingInputGetsAPipe) {
+	std::string path = testing::TempDir() + "ash_cat_mixed";
+	std::string input = "echo file > " + path + "; echo a | cat - " + path + "; echo b | cat > " + path + "; cat " + path +
+		"; echo c | cat | echo d";
+	std::string expected = "a\nfile\nb\nd\n";
+	EXPECT_EQ(testExecutor(input, expected), 4);
+	unlink(path.c_str());
+}
+
+TEST_F(ExecutorTest, CatFileIntoPipeline) {
+	std::string path = testing::TempDir() + "ash_cat_pipeline";
+	std::string input = "printf \"b\\na\\n\" > " + path + "; cat < " + path + " | sort; cat " + path + " | wc -l";
+	std::string expected = "a\nb\n2\n";
+	EXPECT_EQ(testExecutor(input, expected), 4);
+	unlink(path.c_str());
+}
+
+TEST_F(ExecutorTest, CatWithOptionsRunsProgram) {
+	std::string path = testing::TempDir() + "ash_cat_options";
+	std::string input = "printf \"a\\nb\\n\" > " + path + "; cat -n " + path + "; echo hi | cat -A; echo - | cat -";
+	std::string expected = "     1\ta\n     2\tb\nhi$\n-\n";
+	EXPECT_EQ(testExecutor(input, expected), 3);
+	unlink(path.c_str());
+}
+
+TEST_F(ExecutorTest, ScriptWithoutShebangRunsInSh) {
+	std::string path = testing::TempDir() + "ash_no_shebang";
+	std::ofstream(path) << "echo \"$0\" $1\n";
+	chmod(path.c_str(), 0755);
+	testExecutor(path + " arg | /bin/cat", path + " arg\n");
+	testExecutor(path + " arg", path + " arg\n", true);
+	unlink(path.c_str());
+}
+
+TEST_F(ExecutorTest, OutOfRangeFdIsRefused) {
+	Executor executor;
+	for (std::string line : {"echo hi > /dev/null", "/bin/echo hi > /dev/null", "echo hi 2>&1"}) {
+		Sequence sequence = Parser(Lexer(line)).parse();
+		FdOp& op = std::get<Pipeline>(sequence[0]).commands[0].redirection.ops[0];
+		(op.kind == FdOp::DUP ? op.from : op.fd) = 100000;
+		std::string output;
+		std::string errors;
+		Capture out(output);
+		Capture err(errors);
+		executor.capture(sequence, out, err);
+		EXPECT_EQ(output, "") << line;
+		EXPECT_EQ(errors, "Error: 100000: Bad file descriptor\n") << line;
+	}
+	EXPECT_EQ(executor.getSpawnCount(), 0);
+}
+
+TEST_F(ExecutorTest, ForkServerCreatesChildren) {
+	std::string path = testing::TempDir() + "ash_fork_server";
+	std::string input = "echo blah | tr a-z A-Z; /bin/echo one > " + path + "; cat " + path + " | cat | wc -l; "
+		"/nonexistent/command; /bin/false | jobs | echo done";
+	std::string expected = "BLAH\n1\ndone\n";
+	EXPECT_EQ(testExecutor(input, expected, true), testExecutor(input, expected));
+	unlink(path.c_str());
+}
+
+TEST_F(ExecutorTest, RunStopsAtExit) {
+	Lexer lexer("true; exit; echo unreachable");
+	Parser parser(lexer);
+	Executor executor;
+	EXPECT_FALSE(executor.run(parser.parse()));
+	Lexer more("true");
+	Parser moreParser(more);
+	EXPECT_TRUE(executor.run(moreParser.parse()));
+}
+
+TEST_F(ExecutorTest, ExitStatus) {
+	Executor executor;
+	auto exitsWith = [&](const std::string& line) {
+		Lexer lexer(line);
+		Parser parser(lexer);
+		EXPECT_FALSE(executor.run(parser.parse())) << line;
+		return executor.getLastStatus();
+	};
+	EXPECT_EQ(exitsWith("exit 3"), 3);
+	EXPECT_EQ(exitsWith("false; exit"), 1);
+	EXPECT_EQ(exitsWith("true; exit"), 0);
+	EXPECT_EQ(exitsWith("false; exit 0"), 0);
+	EXPECT_EQ(exitsWith("exit 258"), 2);
+	EXPECT_EQ(exitsWith("exit -1"), 255);
+	EXPECT_EQ(exitsWith("exit 4 5"), 4);
+	EXPECT_EQ(exitsWith("exit three"), 2);
+	// Without N, the status from before the pipeline, not that of the stages before exit
+	EXPECT_EQ(exitsWith("/bin/sh -c \"exit 6\" | exit"), 2);
+}
+
+TEST_F(ExecutorTest, PipelineStatusAndPipefail) {
+	Executor executor;
+	run(executor, "/bin/false | /bin/true");
+	EXPECT_EQ(executor.getLastStatus(), 0);
+	EXPECT_EQ(executor.getPipeStatus(), std::vector<int>({1, 0}));
+	EXPECT_EQ(executor.getFailedStage(), 0);
+	EXPECT_EQ(run(executor, "set -o pipefail; set -o"), "pipefail\ton\npipesize\tdefault\n");
+	run(executor, "/bin/sh -c \"exit 3\" | /bin/false | /bin/true");
+	EXPECT_EQ(executor.getLastStatus(), 1);
+	run(executor, "/bin/true | /bin/true");
+	EXPECT_EQ(executor.getLastStatus(), 0);
+	EXPECT_EQ(executor.getFailedStage(), -1);
+	// Being cut off is not a failure
+	run(executor, "/bin/sleep 10 | /bin/true");
+	EXPECT_EQ(executor.getLastStatus(), 0);
+	EXPECT_EQ(executor.getPipeStatus(), std::vector<int>({128 + SIGPIPE, 0}));
+	run(executor, "set +o pipefail; /bin/false | /bin/true");
+	EXPECT_EQ(executor.getLastStatus(), 0);
+	run(executor, "set -o nosuchoption");
+	EXPECT_EQ(executor.getLastStatus(), 1);
+}
+
+TEST_F(ExecutorTest, FusedBuiltinStatusesPerStage) {
+	for (bool forkServer : {false, true}) {
+		Executor executor;
+		if (forkServer) {
+			ASSERT_TRUE(executor.startForkServer());
+		}
+		// In the shell itself
+		run(executor, "false | true");
+		EXPECT_EQ(executor.getLastStatus(), 0);
+		EXPECT_EQ(executor.getPipeStatus(), std::vector<int>({1, 0}));
+		EXPECT_EQ(executor.getFailedStage(), 0);
+		run(executor, "set -o pipefail; false | echo x");
+		EXPECT_EQ(executor.getLastStatus(), 1);
+		// In one child, between programs
+		EXPECT_EQ(run(executor, "/bin/true | false | test -n \"\" | echo x | /bin/cat"), "x\n");
+		EXPECT_EQ(executor.getPipeStatus(), std::vector<int>({0, 1, 1, 0, 0}));
+		EXPECT_EQ(executor.getFailedStage(), 1);
+		EXPECT_EQ(executor.getLastStatus(), 1);
+		run(executor, "/bin/true | true | false | /bin/true");
+		EXPECT_EQ(executor.getPipeStatus(), std::vector<int>({0, 0, 1, 0}));
+		EXPECT_EQ(executor.getFailedStage(), 2);
+		run(executor, "set +o pipefail; /bin/true | false | true");
+		EXPECT_EQ(executor.getLastStatus(), 0);
+		EXPECT_EQ(executor.getPipeStatus(), std::vector<int>({0, 1, 0}));
+	}
+}
+
+TEST_F(ExecutorTest, TimedPipelineReportsEachStage) {
+	unsetenv("TIMEFORMAT");
+	Executor executor;
+	std::string output;
+	std::string errors;
+	Capture out(output);
+	Capture err(errors);
+	executor.capture(Parser(Lexer("time /bin/echo hi | /bin/cat")).parse(), out, err);
+	EXPECT_EQ(output, "hi\n");
+	// One line per stage, then the total, each in the default TIMEFORMAT
+	std::vector<std::string> lines;
+	std::istringstream stream(errors);
+	for (std::string line; std::getline(stream, line);) {
+		lines.push_back(line);
+	}
+	ASSERT_EQ(lines.size(), 3) << errors;
+	EXPECT_EQ(lines[0].rfind("/bin/echo hi\treal ", 0), 0) << lines[0];
+	EXPECT_EQ(lines[1].rfind("/bin/cat\treal ", 0), 0) << lines[1];
+	EXPECT_EQ(lines[2].rfind("total\treal ", 0), 0) << lines[2];
+	for (const auto& line : lines) {
+		EXPECT_NE(line.find("\tuser "), std::string::npos) << line;
+		EXPECT_NE(line.find("\tmaxrss "), std::string::npos) << line;
+	}
+}
+
+TEST_F(ExecutorTest, ExitedReaderCutsOffProducer) {
+	Executor executor;
+	auto start = std::chrono::steady_clock::now();
+	// sleep never writes, so only being cut off ends it early
+	run(executor, "/bin/sleep 10 | /bin/false");
+	EXPECT_LT(elapsed(start), 5);
+	EXPECT_EQ(executor.getPipeStatus(), std::vector<int>({128 + SIGPIPE, 1}));
+	// The producer was cut off, so the reader failed first
+	EXPECT_EQ(executor.getFailedStage(), 1);
+}
+
+TEST_F(ExecutorTest, ProducerIgnoringSigpipeIsTerminated) {
+	Executor executor;
+	auto start = std::chrono::steady_clock::now();
+	EXPECT_EQ(run(executor, "/bin/sh -c \"trap '' PIPE; while :; do echo y; done\" | /usr/bin/head -1"), "y\n");
+	EXPECT_LT(elapsed(start), 5);
+	EXPECT_EQ(executor.getPipeStatus(), std::vector<int>({128 + SIGTERM, 0}));
+}
+
+TEST_F(ExecutorTest, RedirectedProducerIsNotCutOff) {
+	std::string path = testing::TempDir() + "ash_not_cut_off";
+	Executor executor;
+	EXPECT_EQ(run(executor, "/bin/sh -c \"sleep 0.2; echo late\" > " + path + " | /bin/true; /bin/cat " + path), "late\n");
+	unlink(path.c_str());
+}
+
+TEST_F(ExecutorTest, PipeSize) {
+	int fds[2];
+	ASSERT_TRUE(openPipe(fds, 1 << 20));
+	EXPECT_EQ(fcntl(fds[1], F_GETPIPE_SZ), std::min<int>(1 << 20, pipeMaxSize()));
+	EXPECT_EQ(fcntl(fds[0], F_GETFD) & FD_CLOEXEC, FD_CLOEXEC);
+	close(fds[0]);
+	close(fds[1]);
+	// Past pipe-max-size, clamped to it rather than refused
+	ASSERT_TRUE(openPipe(fds, pipeMaxSize() * 4));
+	EXPECT_EQ(static_cast<size_t>(fcntl(fds[1], F_GETPIPE_SZ)), pipeMaxSize());
+	close(fds[0]);
+	close(fds[1]);
+
+	Executor executor;
+	EXPECT_EQ(run(executor, "set -o pipesize=256K; set -o"), "pipefail\toff\npipesize\t262144\n");
+	EXPECT_EQ(run(executor, "/usr/bin/head -c 300000 /dev/zero | /usr/bin/wc -c"), "300000\n");
+	EXPECT_EQ(run(executor, "pipesize=1M /usr/bin/head -c 300000 /dev/zero | /usr/bin/wc -c"), "300000\n");
+	EXPECT_EQ(run(executor, "set +o pipesize; set -o"), "pipefail\toff\npipesize\tdefault\n");
+	run(executor, "set -o pipesize=lots");
+	EXPECT_EQ(executor.getLastStatus(), 1);
+}
+
+// The CPUs the test itself may run on, in order
+static std::vector<int> allowedCpus() {
+	cpu_set_t set;
+	std::vector<int> cpus;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &set)) {
+				cpus.push_back(cpu);
+			}
+		}
+	}
+	return cpus;
+}
+
+TEST_F(ExecutorTest, PinnedStageAffinity) {
+	std::vector<int> shellCpus = allowedCpus();
+	std::string cpu = std::to_string(shellCpus.back());
+	std::string expected = "Cpus_allowed_list:\t" + cpu + "\n";
+	for (bool forkServer : {false, true}) {
+		Executor executor;
+		if (forkServer) {
+			ASSERT_TRUE(executor.startForkServer());
+		}
+		EXPECT_EQ(run(executor, "pin " + cpu + " /bin/grep Cpus_allowed_list /proc/self/status"), expected);
+		// A pinned builtin is not run in the shell, so the shell's own affinity stays as it was
+		EXPECT_EQ(run(executor, "pin " + cpu + " echo builtin | /usr/bin/tr a-z A-Z"), "BUILTIN\n");
+		EXPECT_EQ(allowedCpus(), shellCpus);
+		// A CPU the process may not use fails the spawn
+		std::string errors;
+		std::string output;
+		Capture out(output);
+		Capture err(errors);
+		executor.capture(Parser(Lexer("pin " + std::to_string(CPU_SETSIZE - 1) + " /bin/true")).parse(), out, err);
+		EXPECT_NE(errors.find("Error: /bin/true: Invalid argument"), std::string::npos) << errors;
+	}
+}
+
+TEST_F(ExecutorTest, CpusSpreadOverStages) {
+	std::vector<int> cpus = allowedCpus();
+	if (cpus.size() < 2) {
+		GTEST_SKIP() << "needs two CPUs";
+	}
+	std::string list = std::to_string(cpus[0]) + "," + std::to_string(cpus[1]);
+	Executor executor;
+	EXPECT_EQ(run(executor, "cpus=" + list + " /bin/grep Cpus_allowed_list /proc/self/status | "
+		"/bin/sh -c \"cat; grep Cpus_allowed_list /proc/self/status\""),
+		"Cpus_allowed_list:\t" + std::to_string(cpus[0]) + "\nCpus_allowed_list:\t" + std::to_string(cpus[1]) + "\n");
+}
+
+TEST_F(ExecutorTest, NiceAndLimits) {
+	Executor executor;
+	int nice = getpriority(PRIO_PROCESS, 0);
+	EXPECT_EQ(run(executor, "nice 5 /usr/bin/nice"), std::to_string(nice + 5) + "\n");
+	EXPECT_EQ(run(executor, "limit nofile=64 /bin/sh -c \"ulimit -n; ulimit -Hn\""), "64\n64\n");
+	EXPECT_EQ(run(executor, "limit nofile=64 nice 2 /bin/sh -c \"ulimit -n\" | nice 1 /bin/cat"), "64\n");
+	// The shell's own are unchanged
+	EXPECT_EQ(getpriority(PRIO_PROCESS, 0), nice);
+	struct rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	EXPECT_GT(limit.rlim_cur, 64);
+}
+
+TEST_F(ExecutorTest, ChildrenGetTheFdLimitBack) {
+	struct rlimit saved;
+	ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &saved), 0);
+	if (saved.rlim_max <= 256) {
+		GTEST_SKIP() << "no room under the hard limit";
+	}
+	struct rlimit low {256, saved.rlim_max};
+	ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &low), 0);
+	{
+		Executor executor;
+		// The first background job raises the shell's own limit
+		run(executor, "/bin/true &; wait");
+		struct rlimit raised;
+		getrlimit(RLIMIT_NOFILE, &raised);
+		EXPECT_EQ(raised.rlim_cur, saved.rlim_max);
+		std::string hard = std::to_string(saved.rlim_max);
+		if (saved.rlim_max == RLIM_INFINITY) {
+			hard = "unlimited";
+		}
+		EXPECT_EQ(run(executor, "/bin/sh -c \"ulimit -n; ulimit -Hn\""), "256\n" + hard + "\n");
+		EXPECT_EQ(run(executor, "/bin/sh -c \"ulimit -n\" | /bin/cat"), "256\n");
+		EXPECT_EQ(run(executor, "limit nofile=64 /bin/sh -c \"ulimit -n\""), "64\n");
+	}
+	ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &saved), 0);
+}
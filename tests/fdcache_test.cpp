@@ -0,0 +1,126 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fdcache.h"
+#include "executor.h"
+#include "lexer.h"
+#include "parser.h"
+
+class FdCacheTest : public testing::Test {
+protected:
+	static constexpr int APPEND = O_WRONLY | O_CREAT | O_APPEND;
+	void SetUp() override {
+		char templ[] = "/tmp/ash_fdcache_XXXXXX";
+		dir = mkdtemp(templ);
+		log = dir + "/run.log";
+	}
+	void TearDown() override {
+		std::filesystem::remove_all(dir);
+	}
+	static std::string contents(const std::string& path) {
+		std::ostringstream out;
+		out << std::ifstream(path).rdbuf();
+		return out.str();
+	}
+	static bool isOpen(int fd) {
+		return fcntl(fd, F_GETFD) != -1;
+	}
+	std::string dir;
+	std::string log;
+};
+
+TEST_F(FdCacheTest, ReusesOpenFile) {
+	FdCache cache;
+	int fd = cache.get(log, APPEND);
+	ASSERT_NE(fd, -1);
+	EXPECT_EQ(cache.get(log, APPEND), fd);
+	EXPECT_EQ(cache.getHits(), 1);
+	EXPECT_EQ(cache.getMisses(), 1);
+	EXPECT_EQ(fcntl(fd, F_GETFD) & FD_CLOEXEC, FD_CLOEXEC);
+	// Other flags are another entry
+	EXPECT_NE(cache.get(log, APPEND | O_SYNC), fd);
+	EXPECT_EQ(cache.getSize(), 2);
+}
+
+TEST_F(FdCacheTest, TruncatingOpensAreNotCacheable) {
+	EXPECT_TRUE(FdCache::isCacheable(APPEND));
+	EXPECT_FALSE(FdCache::isCacheable(O_WRONLY | O_CREAT | O_TRUNC));
+	EXPECT_FALSE(FdCache::isCacheable(O_RDONLY));
+}
+
+TEST_F(FdCacheTest, RenameInvalidates) {
+	FdCache cache;
+	int fd = cache.get(log, APPEND);
+	ASSERT_EQ(write(fd, "old\n", 4), 4);
+	ASSERT_EQ(rename(log.c_str(), (log + ".1").c_str()), 0);
+	int again = cache.get(log, APPEND);
+	ASSERT_NE(again, -1);
+	EXPECT_EQ(cache.getInvalidations(), 1);
+	EXPECT_EQ(cache.getSize(), 1);
+	ASSERT_EQ(write(again, "new\n", 4), 4);
+	EXPECT_EQ(contents(log + ".1"), "old\n");
+	EXPECT_EQ(contents(log), "new\n");
+}
+
+TEST_F(FdCacheTest, UnlinkInvalidates) {
+	FdCache cache;
+	cache.get(log, APPEND);
+	ASSERT_EQ(unlink(log.c_str()), 0);
+	int fd = cache.get(log, APPEND);
+	ASSERT_NE(fd, -1);
+	EXPECT_EQ(cache.getInvalidations(), 1);
+	EXPECT_TRUE(std::filesystem::exists(log));
+}
+
+TEST_F(FdCacheTest, LeastRecentlyUsedIsClosed) {
+	FdCache cache(2);
+	int a = cache.get(dir + "/a", APPEND);
+	cache.get(dir + "/b", APPEND);
+	// a is now the more recently used
+	cache.get(dir + "/a", APPEND);
+	cache.get(dir + "/c", APPEND);
+	EXPECT_EQ(cache.getSize(), 2);
+	EXPECT_TRUE(isOpen(a));
+	EXPECT_EQ(cache.get(dir + "/a", APPEND), a);
+	EXPECT_EQ(cache.getMisses(), 3);
+	cache.clear();
+	EXPECT_FALSE(isOpen(a));
+}
+
+TEST_F(FdCacheTest, UnopenableIsLeftToTheChild) {
+	FdCache cache;
+	EXPECT_EQ(cache.get(dir + "/missing/log", APPEND), -1);
+	EXPECT_EQ(cache.getSize(), 0);
+}
+
+TEST_F(FdCacheTest, ExecutorAppendsThroughCache) {
+	Executor executor;
+	executor.cacheAppendFds();
+	auto run = [&](const std::string& line) {
+		Lexer lexer(line);
+		Parser parser(lexer);
+		executor.execute(parser.parse());
+	};
+	for (int i = 0; i < 3; i++) {
+		run("/bin/echo line " + std::to_string(i) + " >> " + log);
+	}
+	run("/bin/sh -c \"echo err >&2\" 2>> " + log + " | /bin/cat");
+	EXPECT_EQ(contents(log), "line 0\nline 1\nline 2\nerr\n");
+	const FdCache* cache = executor.getAppendFdCache();
+	ASSERT_NE(cache, nullptr);
+	EXPECT_EQ(cache->getMisses(), 1);
+	EXPECT_EQ(cache->getHits(), 3);
+	// Rotated away: later lines go to a new file of that name
+	ASSERT_EQ(rename(log.c_str(), (log + ".1").c_str()), 0);
+	run("/bin/echo rotated >> " + log);
+	EXPECT_EQ(contents(log), "rotated\n");
+	EXPECT_EQ(cache->getInvalidations(), 1);
+	// A truncating redirect still truncates
+	run("/bin/echo replaced > " + log);
+	EXPECT_EQ(contents(log), "replaced\n");
+}
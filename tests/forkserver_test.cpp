@@ -0,0 +1,122 @@
+#include <gtest/gtest.h>
+#include <climits>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "forkserver.h"
+
+class ForkServerTest : public testing::Test {
+protected:
+	ForkServer server;
+
+	void SetUp() override {
+		ASSERT_TRUE(server.start([](const Command* first, size_t count) {
+			std::string text = "ran " + std::to_string(count) + " " + std::string(first->args[0]) + "\n";
+			write(STDOUT_FILENO, text.data(), text.size());
+			return 3;
+		}));
+	}
+	// Output of a child whose stdout the plan points at a pipe, and its exit code
+	std::string capture(const std::function<pid_t(const SpawnPlan&)>& create, int* code = nullptr) {
+		int fds[2];
+		EXPECT_EQ(pipe(fds), 0);
+		SpawnPlan plan;
+		plan.dup(fds[1], STDOUT_FILENO);
+		pid_t pid = create(plan);
+		close(fds[1]);
+		std::string output;
+		char buf[256];
+		ssize_t n;
+		while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+			output.append(buf, n);
+		}
+		close(fds[0]);
+		int status = 0;
+		// The child is this process's own, so it can be waited for here
+		EXPECT_EQ(waitpid(pid, &status, 0), pid);
+		if (code != nullptr) {
+			*code = WEXITSTATUS(status);
+		}
+		return output;
+	}
+	pid_t spawn(const SpawnPlan& plan, std::vector<std::string> args, int& error) {
+		Argv argv(args);
+		return server.spawn(plan, args[0].c_str(), argv, error);
+	}
+};
+
+TEST_F(ForkServerTest, Spawn) {
+	int error = -1;
+	std::string output = capture([&](const SpawnPlan& plan) {
+		return spawn(plan, {"/bin/echo", "hello", "world"}, error);
+	});
+	EXPECT_EQ(output, "hello world\n");
+	EXPECT_EQ(error, 0);
+}
+
+TEST_F(ForkServerTest, SpawnFailureIsReported) {
+	int error = 0;
+	EXPECT_EQ(spawn(SpawnPlan(), {"/nonexistent/program"}, error), -1);
+	EXPECT_EQ(error, ENOENT);
+	EXPECT_TRUE(server.isRunning());
+}
+
+TEST_F(ForkServerTest, RunsBuiltins) {
+	Command cmd;
+	cmd.args = {"echo", "x"};
+	std::vector<Command> commands(2, cmd);
+	int code = 0;
+	int error = -1;
+	std::string output = capture([&](const SpawnPlan& plan) {
+		return server.run(plan, commands.data(), commands.size(), error);
+	}, &code);
+	EXPECT_EQ(output, "ran 2 echo\n");
+	EXPECT_EQ(code, 3);
+	EXPECT_EQ(error, 0);
+}
+
+TEST_F(ForkServerTest, ChildUsesShellDirectory) {
+	char saved[PATH_MAX];
+	ASSERT_NE(getcwd(saved, sizeof(saved)), nullptr);
+	ASSERT_EQ(chdir("/tmp"), 0);
+	int error;
+	std::string output = capture([&](const SpawnPlan& plan) {
+		return spawn(plan, {"/bin/pwd"}, error);
+	});
+	ASSERT_EQ(chdir(saved), 0);
+	EXPECT_EQ(output, "/tmp\n");
+}
+
+TEST_F(ForkServerTest, ChildUsesShellStdout) {
+	int fds[2];
+	ASSERT_EQ(pipe(fds), 0);
+	int saved = dup(STDOUT_FILENO);
+	dup2(fds[1], STDOUT_FILENO);
+	close(fds[1]);
+	int error;
+	pid_t pid = spawn(SpawnPlan(), {"/bin/echo", "through the shell's fd 1"}, error);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	ASSERT_EQ(waitpid(pid, nullptr, 0), pid);
+	char buf[64] = {};
+	ASSERT_GT(read(fds[0], buf, sizeof(buf) - 1), 0);
+	close(fds[0]);
+	EXPECT_STREQ(buf, "through the shell's fd 1\n");
+}
+
+TEST_F(ForkServerTest, StopsWhenServerDies) {
+	kill(server.getPid(), SIGKILL);
+	int error = 0;
+	EXPECT_EQ(spawn(SpawnPlan(), {"/bin/true"}, error), -1);
+	EXPECT_FALSE(server.isRunning());
+}
+
+TEST_F(ForkServerTest, NotUsableFromForkedChild) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		_exit(server.isRunning() ? 1 : 0);
+	}
+	int status;
+	ASSERT_EQ(waitpid(pid, &status, 0), pid);
+	EXPECT_EQ(WEXITSTATUS(status), 0);
+}
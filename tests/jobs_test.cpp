@@ -0,0 +1,135 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include "jobs.h"
+
+extern char** environ;
+
+class JobTableTest : public testing::Test {
+protected:
+	void SetUp() override {}
+	JobTableTest() {}
+	pid_t spawnShell(const std::string& script) {
+		const char* argv[] = {"/bin/sh", "-c", script.c_str(), nullptr};
+		pid_t pid;
+		posix_spawn(&pid, "/bin/sh", nullptr, nullptr, const_cast<char**>(argv), environ);
+		return pid;
+	}
+};
+
+TEST_F(JobTableTest, WaitReturnsStatus) {
+	JobTable jobs;
+	int id = jobs.add({spawnShell("exit 3")}, "exit 3");
+	EXPECT_EQ(jobs.wait(id), 3);
+	EXPECT_EQ(jobs.wait(id), std::nullopt);
+	EXPECT_TRUE(jobs.getJobs().empty());
+}
+
+TEST_F(JobTableTest, PipelineStatusIsLastStage) {
+	JobTable jobs;
+	int id = jobs.add({spawnShell("exit 1"), spawnShell("exit 0")}, "false | true");
+	EXPECT_EQ(jobs.wait(id), 0);
+}
+
+TEST_F(JobTableTest, SignalledStatus) {
+	JobTable jobs;
+	pid_t pid = spawnShell("sleep 10");
+	int id = jobs.add({pid}, "sleep 10");
+	kill(pid, SIGKILL);
+	EXPECT_EQ(jobs.wait(id), 128 + SIGKILL);
+}
+
+TEST_F(JobTableTest, WaitNextReturnsFirstToFinish) {
+	JobTable jobs;
+	jobs.add({spawnShell("sleep 10")}, "sleep 10");
+	jobs.add({spawnShell("exit 7")}, "exit 7");
+	EXPECT_EQ(jobs.waitNext(), 7);
+	EXPECT_EQ(jobs.getJobs().size(), 1);
+	kill(jobs.getJobs().begin()->second.pids[0], SIGKILL);
+	EXPECT_EQ(jobs.waitNext(), 128 + SIGKILL);
+	EXPECT_EQ(jobs.waitNext(), std::nullopt);
+}
+
+TEST_F(JobTableTest, PollReapsWithoutBlocking) {
+	JobTable jobs;
+	pid_t pid = spawnShell("exit 0");
+	jobs.add({pid}, "exit 0");
+	jobs.add({spawnShell("sleep 10")}, "sleep 10");
+	while (jobs.getJobs().at(1).done == false) {
+		jobs.poll();
+	}
+	EXPECT_FALSE(jobs.getJobs().at(2).done);
+	// Already reaped by the table, so no zombie is left for anyone else
+	EXPECT_EQ(waitpid(pid, nullptr, WNOHANG), -1);
+	auto finished = jobs.takeFinished();
+	ASSERT_EQ(finished.size(), 1);
+	EXPECT_EQ(finished[0].command, "exit 0");
+	kill(jobs.getJobs().at(2).pids[0], SIGKILL);
+	jobs.waitAll();
+}
+
+TEST_F(JobTableTest, ManyConcurrentJobs) {
+	JobTable jobs;
+	std::vector<pid_t> pids;
+	for (int i = 0; i < 1000; i++) {
+		pids.push_back(spawnShell("exit 0"));
+		jobs.add({pids.back()}, "exit 0");
+	}
+	jobs.waitAll();
+	EXPECT_TRUE(jobs.getJobs().empty());
+	for (pid_t pid : pids) {
+		EXPECT_EQ(waitpid(pid, nullptr, WNOHANG), -1);
+	}
+}
+
+TEST_F(JobTableTest, RemembersTheFdLimitItRaised) {
+	struct rlimit saved;
+	ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &saved), 0);
+	if (saved.rlim_max <= 256) {
+		GTEST_SKIP() << "no room under the hard limit";
+	}
+	struct rlimit low {256, saved.rlim_max};
+	ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &low), 0);
+	{
+		JobTable jobs;
+		EXPECT_EQ(jobs.getInheritedFdLimit(), std::nullopt);
+		jobs.wait(jobs.add({spawnShell("exit 0")}, "exit 0"));
+		ASSERT_TRUE(jobs.getInheritedFdLimit().has_value());
+		EXPECT_EQ(jobs.getInheritedFdLimit()->rlim_cur, 256);
+		EXPECT_EQ(jobs.getInheritedFdLimit()->rlim_max, saved.rlim_max);
+	}
+	ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &saved), 0);
+}
+
+TEST_F(JobTableTest, ProcessesWithoutPidfdsAreStillWaitedFor) {
+	JobTable jobs;
+	int first = jobs.add({spawnShell("exit 0")}, "exit 0");
+	pid_t sleeper = spawnShell("sleep 10");
+	pid_t early = spawnShell("exit 1");
+	pid_t late = spawnShell("exit 5");
+	// Leave no descriptor free, so no pidfd can be opened
+	struct rlimit saved;
+	ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &saved), 0);
+	struct rlimit low = saved;
+	low.rlim_cur = dup(STDIN_FILENO) + 1;
+	ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &low), 0);
+	std::vector<int> filler {static_cast<int>(low.rlim_cur) - 1};
+	for (int fd; (fd = dup(STDIN_FILENO)) != -1;) {
+		filler.push_back(fd);
+	}
+	int second = jobs.add({early, late}, "false | exit 5");
+	int third = jobs.add({sleeper}, "sleep 10");
+	ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &saved), 0);
+	for (int fd : filler) {
+		close(fd);
+	}
+	EXPECT_EQ(jobs.wait(second), 5);
+	EXPECT_EQ(waitpid(early, nullptr, WNOHANG), -1);
+	EXPECT_EQ(jobs.wait(first), 0);
+	kill(sleeper, SIGKILL);
+	EXPECT_EQ(jobs.wait(third), 128 + SIGKILL);
+	EXPECT_EQ(jobs.waitNext(), std::nullopt);
+}
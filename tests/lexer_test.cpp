@@ -144,3 +144,53 @@ TEST_F(LexerTest, Redirection3) {
 	testLexer(input, expected);
 }
 
+
+TEST_F(LexerTest, Redirection4) {
+	std::string input = "2>&x >&x 3>>a 12>b >>>";
+	std::vector<std::variant<Token, ShellError>> expected = {
+		Token {Type::REDIRECT, "2>"},
+		Token {Type::CONTROL, "&"},
+		Token {Type::LITERAL, "x"},
+		Token {Type::REDIRECT, ">"},
+		Token {Type::CONTROL, "&"},
+		Token {Type::LITERAL, "x"},
+		Token {Type::REDIRECT, "3>>"},
+		Token {Type::LITERAL, "a"},
+		Token {Type::LITERAL, "12"},
+		Token {Type::REDIRECT, ">"},
+		Token {Type::LITERAL, "b"},
+		Token {Type::REDIRECT, ">>"},
+		Token {Type::REDIRECT, ">"},
+		Token {Type::END, "END"}
+	};
+	testLexer(input, expected);
+}
+
+TEST_F(LexerTest, Redirection5) {
+	std::string input = "3<a <&3 0<&4 2>&- >&- 5<< <&x";
+	std::vector<std::variant<Token, ShellError>> expected = {
+		Token {Type::REDIRECT, "3<"},
+		Token {Type::LITERAL, "a"},
+		Token {Type::REDIRECT, "<&3"},
+		Token {Type::REDIRECT, "0<&4"},
+		Token {Type::REDIRECT, "2>&-"},
+		Token {Type::REDIRECT, ">&-"},
+		Token {Type::REDIRECT, "5<"},
+		Token {Type::REDIRECT, "<"},
+		Token {Type::REDIRECT, "<"},
+		Token {Type::CONTROL, "&"},
+		Token {Type::LITERAL, "x"},
+		Token {Type::END, "END"}
+	};
+	testLexer(input, expected);
+}
+
+TEST_F(LexerTest, RedirectionAtEnd) {
+	std::string input = "echo 2>&1";
+	std::vector<std::variant<Token, ShellError>> expected = {
+		Token {Type::LITERAL, "echo"},
+		Token {Type::REDIRECT, "2>&1"},
+		Token {Type::END, "END"}
+	};
+	testLexer(input, expected);
+}
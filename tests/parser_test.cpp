@@ -1,26 +1,73 @@
 #include <gtest/gtest.h>
+#include <cstdlib>
+#include <new>
 #include <string>
 #include <variant>
+#include "arena.h"
 #include "parser.h"
 #include "lexer.h"
 #include "token.h"
 #include "shellerror.h"
 
+// Flags of a > redirection
+static constexpr int WRITE = O_WRONLY | O_CREAT | O_TRUNC;
+
+// Counts every heap allocation in this binary, so tests can check the parser stays in its arena
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+	allocations++;
+	if (void* ptr = malloc(size)) {
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+// std::pmr::new_delete_resource allocates through the aligned overload
+void* operator new(size_t size, std::align_val_t align) {
+	allocations++;
+	size_t alignment = static_cast<size_t>(align);
+	if (void* ptr = aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)) {
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept {
+	free(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept {
+	free(ptr);
+}
+void operator delete(void* ptr, std::align_val_t) noexcept {
+	free(ptr);
+}
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+	free(ptr);
+}
+
 class ParserTest : public testing::Test {
 protected:
 	void SetUp() override {}
 	ParserTest() {}
-	void testParser(std::string input, std::vector<std::variant<Pipeline, ShellError>> expected) {
+	void testParser(std::string input, Sequence expected) {
 		Lexer lexer(input);
 		Parser parser(lexer);
 		auto res = parser.parse();
 		EXPECT_EQ(res, expected);
 	}
+	size_t countArenaParseAllocations(const std::string& input, LineArena& arena) {
+		size_t before = allocations;
+		{
+			Lexer lexer(input, arena.resource());
+			Parser parser(lexer, arena.resource());
+			auto res = parser.parse();
+		}
+		return allocations - before;
+	}
 };
 
 TEST_F(ParserTest, BasicInput) {
 	std::string input = "echo blah";
-	std::vector<std::variant<Pipeline, ShellError>> expected = {
+	Sequence expected = {
 		Pipeline {
 			.commands = {
 				{
@@ -34,7 +81,7 @@ TEST_F(ParserTest, BasicInput) {
 
 TEST_F(ParserTest, MultipleCommands) {
 	std::string input = "echo blah; echo blah2";
-	std::vector<std::variant<Pipeline, ShellError>> expected = {
+	Sequence expected = {
 		Pipeline {
 			.commands = {
 				{
@@ -55,7 +102,7 @@ TEST_F(ParserTest, MultipleCommands) {
 
 TEST_F(ParserTest, BasicError) {
 	std::string input = "& blah";
-	std::vector<std::variant<Pipeline, ShellError>> expected = {
+	Sequence expected = {
 		ShellError {ErrorType::SYNTAX_ERROR, "Error: \"&\" may only be used at the end of a command"}
 	};
 	testParser(input, expected);
@@ -63,7 +110,7 @@ TEST_F(ParserTest, BasicError) {
 
 TEST_F(ParserTest, Pipeline1) {
 	std::string input = "ls -la | cat";
-	std::vector<std::variant<Pipeline, ShellError>> expected = {
+	Sequence expected = {
 		Pipeline {
 			.commands = {
 				{
@@ -80,7 +127,7 @@ TEST_F(ParserTest, Pipeline1) {
 
 TEST_F(ParserTest, Pipeline2) {
 	std::string input = "ls -la | cat | |&";
-	std::vector<std::variant<Pipeline, ShellError>> expected = {
+	Sequence expected = {
 		Pipeline {
 			.commands = {
 				{
@@ -99,20 +146,22 @@ TEST_F(ParserTest, Pipeline2) {
 
 TEST_F(ParserTest, Pipeline3) {
 	std::string input = "ls -la | cat | | \"";
-	std::vector<std::variant<Pipeline, ShellError>> expected = {};
+	Sequence expected = {
+		ShellError {ErrorType::UNCLOSED_QUOTE, "Error: Unclosed Quote"}
+	};
 	testParser(input, expected);
 }
 
 TEST_F(ParserTest, Redirect1) {
 	std::string input = "ls -la > out.txt";
-	std::vector<std::variant<Pipeline, ShellError>> expected = {
+	Sequence expected = {
 		Pipeline {
 			.commands = {
 				{
 					.args = {"ls", "-la"},
-					.redirection = {
-						.coutFile = "out.txt",
-					}
+					.redirection = {.ops = {
+						{FdOp::OPEN, 1, -1, "out.txt", WRITE},
+					}}
 				}
 			}
 		}
@@ -122,15 +171,15 @@ TEST_F(ParserTest, Redirect1) {
 
 TEST_F(ParserTest, Redirect2) {
 	std::string input = "ls -la &> out.txt";
-	std::vector<std::variant<Pipeline, ShellError>> expected = {
+	Sequence expected = {
 		Pipeline {
 			.commands = {
 				{
 					.args = {"ls", "-la"},
-					.redirection = {
-						.coutFile = "out.txt",
-						.cerrFile = "out.txt"
-					}
+					.redirection = {.ops = {
+						{FdOp::OPEN, 1, -1, "out.txt", WRITE},
+						{FdOp::DUP, 2, 1},
+					}}
 				}
 			}
 		}
@@ -140,17 +189,281 @@ TEST_F(ParserTest, Redirect2) {
 
 TEST_F(ParserTest, Redirect3) {
 	std::string input = "ls -la 2>&1 out.txt";
-	std::vector<std::variant<Pipeline, ShellError>> expected = {
+	Sequence expected = {
 		Pipeline {
 			.commands = {
 				{
 					.args = {"ls", "-la", "out.txt"},
-					.redirection = {
-						.cerrTo = 1,
-					}
+					.redirection = {.ops = {
+						{FdOp::DUP, 2, 1},
+					}}
 				}
 			}
 		}
 	};
 	testParser(input, expected);
-}
\ No newline at end of file
+}
+TEST_F(ParserTest, Redirect4) {
+	std::string input = "make 2>> err.txt 1>&2 < in.txt";
+	Sequence expected = {
+		Pipeline {
+			.commands = {
+				{
+					.args = {"make"},
+					.redirection = {.ops = {
+						{FdOp::OPEN, 2, -1, "err.txt", O_WRONLY | O_CREAT | O_APPEND},
+						{FdOp::DUP, 1, 2},
+						{FdOp::OPEN, 0, -1, "in.txt", O_RDONLY},
+					}}
+				}
+			}
+		}
+	};
+	testParser(input, expected);
+}
+
+TEST_F(ParserTest, RedirectAnyFd) {
+	std::string input = "cmd 3> three.txt 4< in.txt 0<&4 5>&- >&3 <&-";
+	Sequence expected = {
+		Pipeline {
+			.commands = {
+				{
+					.args = {"cmd"},
+					.redirection = {.ops = {
+						{FdOp::OPEN, 3, -1, "three.txt", WRITE},
+						{FdOp::OPEN, 4, -1, "in.txt", O_RDONLY},
+						// 0<&4 is left out: <&- undoes it before anything reads 0
+						{FdOp::CLOSE, 5},
+						{FdOp::DUP, 1, 3},
+						{FdOp::CLOSE, 0},
+					}}
+				}
+			}
+		}
+	};
+	testParser(input, expected);
+}
+
+TEST_F(ParserTest, RedundantRedirectsDropped) {
+	std::string input = "a 1>&1 2>&1 2>&1; b 2>&1 3>&2 2> err.txt; c > one.txt > two.txt";
+	Sequence expected = {
+		Pipeline {
+			.commands = {
+				{
+					.args = {"a"},
+					.redirection = {.ops = {
+						{FdOp::DUP, 2, 1},
+					}}
+				}
+			}
+		},
+		// 3>&2 reads the first dup before 2 changes, so it stays
+		Pipeline {
+			.commands = {
+				{
+					.args = {"b"},
+					.redirection = {.ops = {
+						{FdOp::DUP, 2, 1},
+						{FdOp::DUP, 3, 2},
+						{FdOp::OPEN, 2, -1, "err.txt", WRITE},
+					}}
+				}
+			}
+		},
+		// Both files are created, as in sh
+		Pipeline {
+			.commands = {
+				{
+					.args = {"c"},
+					.redirection = {.ops = {
+						{FdOp::OPEN, 1, -1, "one.txt", WRITE},
+						{FdOp::OPEN, 1, -1, "two.txt", WRITE},
+					}}
+				}
+			}
+		}
+	};
+	testParser(input, expected);
+}
+
+TEST_F(ParserTest, InvalidRedirect) {
+	std::string input = "ls 3>; ls < | wc";
+	Sequence expected = {
+		ShellError {ErrorType::SYNTAX_ERROR, "Error: Invalid redirection."},
+		ShellError {ErrorType::SYNTAX_ERROR, "Error: Invalid redirection."}
+	};
+	testParser(input, expected);
+}
+
+TEST_F(ParserTest, EscapedArgument) {
+	std::string input = "echo a\\;b \"c d\"";
+	Sequence expected = {
+		Pipeline {
+			.commands = {
+				{
+					.args = {"echo", "a;b", "c d"},
+				}
+			}
+		}
+	};
+	testParser(input, expected);
+}
+
+TEST_F(ParserTest, TimedPipeline) {
+	std::string input = "time ls | wc; \"time\" ls; ls time";
+	Sequence expected = {
+		Pipeline {
+			.commands = {
+				{.args = {"ls"}},
+				{.args = {"wc"}}
+			},
+			.timed = true
+		},
+		Pipeline {
+			.commands = {
+				{.args = {"time", "ls"}}
+			}
+		},
+		Pipeline {
+			.commands = {
+				{.args = {"ls", "time"}}
+			}
+		}
+	};
+	testParser(input, expected);
+}
+
+TEST_F(ParserTest, PipeSize) {
+	std::string input = "pipesize=1M ls | wc; time pipesize=4096 ls; pipesize=64k time ls; ls pipesize=1M; pipesize=1X ls; pipesize=0 ls";
+	Sequence expected = {
+		Pipeline {
+			.commands = {
+				{.args = {"ls"}},
+				{.args = {"wc"}}
+			},
+			.pipeSize = 1 << 20
+		},
+		Pipeline {
+			.commands = {
+				{.args = {"ls"}}
+			},
+			.timed = true,
+			.pipeSize = 4096
+		},
+		Pipeline {
+			.commands = {
+				{.args = {"ls"}}
+			},
+			.timed = true,
+			.pipeSize = 64 << 10
+		},
+		Pipeline {
+			.commands = {
+				{.args = {"ls", "pipesize=1M"}}
+			}
+		},
+		ShellError {ErrorType::SYNTAX_ERROR, "Error: Invalid pipe size."},
+		ShellError {ErrorType::SYNTAX_ERROR, "Error: Invalid pipe size."}
+	};
+	testParser(input, expected);
+}
+
+TEST_F(ParserTest, PlacementPrefixes) {
+	std::string input = "pin 0-3,8 nice 5 limit nofile=64 ls | limit as=1G wc; cpus=0,2 time a | b; nice -n 5 ls; pin x ls; limit foo=1 ls";
+	Sequence expected = {
+		Pipeline {
+			.commands = {
+				{
+					.args = {"ls"},
+					.placement = {.cpus = "0-3,8", .nice = 5, .limits = {{RLIMIT_NOFILE, 64}}}
+				},
+				{
+					.args = {"wc"},
+					.placement = {.limits = {{RLIMIT_AS, 1 << 30}}}
+				}
+			}
+		},
+		Pipeline {
+			.commands = {
+				{.args = {"a"}},
+				{.args = {"b"}}
+			},
+			.timed = true,
+			.cpus = "0,2"
+		},
+		// Not followed by a number, nice is the command
+		Pipeline {
+			.commands = {
+				{.args = {"nice", "-n", "5", "ls"}}
+			}
+		},
+		ShellError {ErrorType::SYNTAX_ERROR, "Error: pin: Invalid CPU list."},
+		ShellError {ErrorType::SYNTAX_ERROR, "Error: limit: Invalid resource limit."}
+	};
+	testParser(input, expected);
+}
+
+TEST_F(ParserTest, NiceOldSyntax) {
+	std::string input = "nice -5 make; nice --5 make; nice 100 make; nice - make";
+	Sequence expected = {
+		Pipeline {.commands = {{.args = {"make"}, .placement = {.nice = 5}}}},
+		Pipeline {.commands = {{.args = {"make"}, .placement = {.nice = -5}}}},
+		Pipeline {.commands = {{.args = {"make"}, .placement = {.nice = 40}}}},
+		Pipeline {.commands = {{.args = {"nice", "-", "make"}}}}
+	};
+	testParser(input, expected);
+}
+
+TEST_F(ParserTest, CpuList) {
+	std::vector<int> cpus;
+	EXPECT_TRUE(parseCpuList("3,0-2,8", &cpus));
+	EXPECT_EQ(cpus, std::vector<int>({3, 0, 1, 2, 8}));
+	EXPECT_FALSE(parseCpuList(""));
+	EXPECT_FALSE(parseCpuList("1,"));
+	EXPECT_FALSE(parseCpuList("3-1"));
+	EXPECT_FALSE(parseCpuList("-1"));
+	EXPECT_FALSE(parseCpuList("100000"));
+}
+
+TEST_F(ParserTest, ArenaParseDoesNotAllocate) {
+	LineArena arena;
+	std::string input = "cat < /var/tmp/some/long/input/path.txt | grep -v \"a long quoted pattern to match\" | "
+		"sort --parallel=4 2>> /var/log/provisioning-errors.log > out.txt; echo escaped\\;argument\\|here &";
+	EXPECT_EQ(countArenaParseAllocations(input, arena), 0);
+	arena.reset();
+	EXPECT_EQ(countArenaParseAllocations(input, arena), 0);
+}
+
+TEST_F(ParserTest, DefaultResourceParseAllocates) {
+	std::string input = "cat < /var/tmp/some/long/input/path.txt | sort";
+	size_t before = allocations;
+	{
+		Lexer lexer(input);
+		Parser parser(lexer);
+		auto res = parser.parse();
+	}
+	EXPECT_GT(allocations - before, 0);
+}
+
+TEST_F(ParserTest, ArenaParseSurvivesCopy) {
+	LineArena arena;
+	std::string input = "grep \"a long quoted pattern to match\" /var/tmp/some/long/input/path.txt";
+	Sequence copy;
+	{
+		Lexer lexer(input, arena.resource());
+		Parser parser(lexer, arena.resource());
+		copy = Sequence(parser.parse(), std::pmr::get_default_resource());
+	}
+	arena.reset();
+	Sequence expected = {
+		Pipeline {
+			.commands = {
+				{
+					.args = {"grep", "a long quoted pattern to match", "/var/tmp/some/long/input/path.txt"},
+				}
+			}
+		}
+	};
+	EXPECT_EQ(copy, expected);
+	EXPECT_EQ(countArenaParseAllocations(input, arena), 0);
+}
@@ -0,0 +1,114 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <fstream>
+#include <filesystem>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <utime.h>
+#include "pathcache.h"
+
+class PathCacheTest : public testing::Test {
+protected:
+	void SetUp() override {
+		oldPath = std::getenv("PATH");
+		char templ[] = "/tmp/ash_pathcache_XXXXXX";
+		first = mkdtemp(templ);
+		char templ2[] = "/tmp/ash_pathcache_XXXXXX";
+		second = mkdtemp(templ2);
+		setenv("PATH", (first + ":" + second).c_str(), 1);
+	}
+	void TearDown() override {
+		setenv("PATH", oldPath.c_str(), 1);
+		std::filesystem::remove_all(first);
+		std::filesystem::remove_all(second);
+	}
+	PathCacheTest() {}
+	void makeExecutable(const std::string& dir, const std::string& name) {
+		std::string path = dir + "/" + name;
+		std::ofstream(path) << "#!/bin/sh\n";
+		chmod(path.c_str(), 0755);
+	}
+	// Moves a directory's mtime forward so changes are seen regardless of timestamp granularity
+	void bumpMtime(const std::string& dir, time_t seconds) {
+		struct utimbuf times {seconds, seconds};
+		utime(dir.c_str(), &times);
+	}
+	std::string oldPath;
+	std::string first;
+	std::string second;
+};
+
+TEST_F(PathCacheTest, ResolvesThroughPath) {
+	makeExecutable(second, "tool");
+	PathCache cache;
+	EXPECT_EQ(cache.lookup("tool"), second + "/tool");
+	EXPECT_EQ(cache.lookup("missing"), std::nullopt);
+	EXPECT_EQ(cache.lookup("./relative"), "./relative");
+}
+
+TEST_F(PathCacheTest, CountsHits) {
+	makeExecutable(first, "tool");
+	PathCache cache;
+	cache.lookup("tool");
+	cache.lookup("tool");
+	cache.lookup("tool");
+	ASSERT_EQ(cache.getEntries().size(), 1);
+	EXPECT_EQ(cache.getEntries().at("tool").hits, 3);
+}
+
+TEST_F(PathCacheTest, InvalidatedByDirectoryChange) {
+	makeExecutable(second, "tool");
+	bumpMtime(second, 1000);
+	PathCache cache;
+	EXPECT_EQ(cache.lookup("tool"), second + "/tool");
+	std::filesystem::remove(second + "/tool");
+	bumpMtime(second, 2000);
+	EXPECT_EQ(cache.lookup("tool"), std::nullopt);
+	EXPECT_TRUE(cache.getEntries().empty());
+}
+
+TEST_F(PathCacheTest, InvalidatedByPathChange) {
+	makeExecutable(first, "tool");
+	makeExecutable(second, "tool");
+	PathCache cache;
+	EXPECT_EQ(cache.lookup("tool"), first + "/tool");
+	setenv("PATH", second.c_str(), 1);
+	EXPECT_EQ(cache.lookup("tool"), second + "/tool");
+}
+
+TEST_F(PathCacheTest, ShadowedByNewBinaryEarlierInPath) {
+	makeExecutable(second, "tool");
+	makeExecutable(second, "other");
+	bumpMtime(first, 1000);
+	bumpMtime(second, 1000);
+	PathCache cache;
+	EXPECT_EQ(cache.lookup("tool"), second + "/tool");
+	EXPECT_EQ(cache.lookup("other"), second + "/other");
+	makeExecutable(first, "tool");
+	bumpMtime(first, 2000);
+	EXPECT_EQ(cache.lookup("tool"), first + "/tool");
+	// Resolved again, since the new directory contents might shadow it too
+	EXPECT_EQ(cache.lookup("other"), second + "/other");
+	EXPECT_EQ(cache.getEntries().at("other").hits, 1);
+}
+
+TEST_F(PathCacheTest, ShadowedByDirectoryCreatedEarlierInPath) {
+	std::string missing = first + "/later";
+	setenv("PATH", (missing + ":" + second).c_str(), 1);
+	makeExecutable(second, "tool");
+	PathCache cache;
+	EXPECT_EQ(cache.lookup("tool"), second + "/tool");
+	EXPECT_EQ(cache.lookup("tool"), second + "/tool");
+	EXPECT_EQ(cache.getEntries().at("tool").hits, 2);
+	std::filesystem::create_directory(missing);
+	makeExecutable(missing, "tool");
+	EXPECT_EQ(cache.lookup("tool"), missing + "/tool");
+}
+
+TEST_F(PathCacheTest, Clear) {
+	makeExecutable(first, "tool");
+	PathCache cache;
+	cache.lookup("tool");
+	cache.clear();
+	EXPECT_TRUE(cache.getEntries().empty());
+}
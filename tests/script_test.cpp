@@ -0,0 +1,148 @@
+#include <gtest/gtest.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "script.h"
+#include "lexer.h"
+#include "parser.h"
+
+class MappedScriptTest : public testing::Test {
+protected:
+	std::string path = testing::TempDir() + "ash_mapped_script";
+
+	void TearDown() override {
+		unlink(path.c_str());
+	}
+	std::vector<std::string> readLines(const std::string& contents) {
+		std::ofstream(path) << contents;
+		return readLinesFrom(path.c_str());
+	}
+	static std::vector<std::string> readLinesFrom(const char* file) {
+		MappedScript script(file);
+		std::vector<std::string> lines;
+		std::string_view line;
+		while (script.next(line)) {
+			lines.emplace_back(line);
+		}
+		return lines;
+	}
+};
+
+TEST_F(MappedScriptTest, Lines) {
+	std::vector<std::string> expected = {"echo a", "", "ls | wc"};
+	EXPECT_EQ(readLines("echo a\n\nls | wc\n"), expected);
+}
+
+TEST_F(MappedScriptTest, NoTrailingNewline) {
+	std::vector<std::string> expected = {"echo a", "echo b"};
+	EXPECT_EQ(readLines("echo a\necho b"), expected);
+}
+
+TEST_F(MappedScriptTest, Empty) {
+	EXPECT_TRUE(readLines("").empty());
+}
+
+TEST_F(MappedScriptTest, LargeScriptReleasesPages) {
+	std::string contents;
+	for (int i = 0; i < 500000; i++) {
+		contents += "echo line " + std::to_string(i) + "\n";
+	}
+	auto lines = readLines(contents);
+	ASSERT_EQ(lines.size(), 500000);
+	EXPECT_EQ(lines.back(), "echo line 499999");
+}
+
+TEST_F(MappedScriptTest, Pipe) {
+	int fds[2];
+	ASSERT_EQ(pipe(fds), 0);
+	ASSERT_EQ(write(fds[1], "echo a\necho b\n", 14), 14);
+	close(fds[1]);
+	std::string file = "/proc/self/fd/" + std::to_string(fds[0]);
+	std::vector<std::string> expected = {"echo a", "echo b"};
+	EXPECT_EQ(readLinesFrom(file.c_str()), expected);
+	close(fds[0]);
+}
+
+TEST_F(MappedScriptTest, SmallScriptRunsFromItsCopy) {
+	std::ofstream(path) << "echo a\necho b\n";
+	MappedScript script(path.c_str(), true);
+	std::string_view line;
+	ASSERT_TRUE(script.next(line));
+	ASSERT_EQ(truncate(path.c_str(), 0), 0);
+	ASSERT_TRUE(script.next(line));
+	EXPECT_EQ(line, "echo b");
+	EXPECT_FALSE(script.next(line));
+}
+
+TEST_F(MappedScriptTest, WatchedScriptEndsWhereTruncated) {
+	std::string contents;
+	while (contents.size() <= 2 * MappedScript::COPY_LIMIT) {
+		contents += "echo line " + std::to_string(contents.size()) + "\n";
+	}
+	std::ofstream(path) << contents;
+	MappedScript script(path.c_str(), true);
+	std::string_view line;
+	ASSERT_TRUE(script.next(line));
+	EXPECT_EQ(line, "echo line 0");
+	// Cut in the middle of the second line: what is left of it is the last line
+	ASSERT_EQ(truncate(path.c_str(), 16), 0);
+	ASSERT_TRUE(script.next(line));
+	EXPECT_EQ(line, "echo");
+	EXPECT_FALSE(script.next(line));
+	ASSERT_EQ(truncate(path.c_str(), 0), 0);
+	EXPECT_FALSE(script.next(line));
+}
+
+TEST_F(MappedScriptTest, MissingFile) {
+	EXPECT_THROW(MappedScript("/nonexistent/script"), std::invalid_argument);
+}
+
+static Sequence parse(std::string_view line) {
+	Lexer lexer(line);
+	Parser parser(lexer);
+	return parser.parse();
+}
+
+TEST(ParseCacheTest, RepeatedLineHits) {
+	ParseCache cache;
+	std::string line = "ls -la | wc -l > out.txt";
+	EXPECT_EQ(cache.find(line), nullptr);
+	{
+		std::pmr::monotonic_buffer_resource arena;
+		Lexer lexer(line, &arena);
+		Parser parser(lexer, &arena);
+		cache.insert(line, parser.parse());
+	}
+	const Sequence* cached = cache.find(line);
+	ASSERT_NE(cached, nullptr);
+	EXPECT_EQ(*cached, parse(line));
+	EXPECT_EQ(cache.getSize(), 1);
+}
+
+TEST(ParseCacheTest, KeepsCopiesOfLines) {
+	ParseCache cache;
+	{
+		std::string line = "echo kept";
+		cache.insert(line, parse(line));
+		line.assign(line.size(), 'x');
+	}
+	std::string again = "echo kept";
+	const Sequence* cached = cache.find(again);
+	ASSERT_NE(cached, nullptr);
+	EXPECT_EQ(*cached, parse(again));
+}
+
+TEST(ParseCacheTest, DistinctLinesDisableCache) {
+	ParseCache cache;
+	std::vector<std::string> lines;
+	for (int i = 0; i < 20000; i++) {
+		lines.push_back("echo " + std::to_string(i));
+	}
+	for (const auto& line : lines) {
+		if (cache.find(line) == nullptr) {
+			cache.insert(line, parse(line));
+		}
+	}
+	EXPECT_TRUE(cache.isDisabled());
+	EXPECT_EQ(cache.getSize(), 0);
+}
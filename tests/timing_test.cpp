@@ -0,0 +1,41 @@
+#include <gtest/gtest.h>
+#include <string>
+#include "timing.h"
+
+class TimingTest : public testing::Test {
+protected:
+	StageTime stage() {
+		StageTime time {"grep x", 1.5};
+		time.usage.ru_utime = {0, 250000};
+		time.usage.ru_stime = {2, 1000};
+		time.usage.ru_maxrss = 1024;
+		time.usage.ru_nvcsw = 7;
+		time.usage.ru_nivcsw = 3;
+		return time;
+	}
+};
+
+TEST_F(TimingTest, DefaultFormat) {
+	EXPECT_EQ(formatTime(DEFAULT_TIMEFORMAT, stage()),
+		"grep x\treal 1.500s\tuser 0.250s\tsys 2.001s\tmaxrss 1024KB\tcsw 7/3");
+}
+
+TEST_F(TimingTest, CustomFormat) {
+	EXPECT_EQ(formatTime("%C: %R %% %q %", stage()), "grep x: 1.500 % %q %");
+}
+
+TEST_F(TimingTest, AddUsage) {
+	struct rusage total = stage().usage;
+	struct rusage other {};
+	other.ru_utime = {0, 900000};
+	other.ru_maxrss = 4096;
+	other.ru_nvcsw = 1;
+	addUsage(total, other);
+	EXPECT_EQ(total.ru_utime.tv_sec, 1);
+	EXPECT_EQ(total.ru_utime.tv_usec, 150000);
+	EXPECT_EQ(total.ru_maxrss, 4096);
+	EXPECT_EQ(total.ru_nvcsw, 8);
+	subtractTime(total.ru_utime, other.ru_utime);
+	EXPECT_EQ(total.ru_utime.tv_sec, 0);
+	EXPECT_EQ(total.ru_utime.tv_usec, 250000);
+}
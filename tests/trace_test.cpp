@@ -0,0 +1,75 @@
+#include <gtest/gtest.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include "trace.h"
+#include "lexer.h"
+#include "parser.h"
+
+static std::string readFile(const std::string& path) {
+	std::ifstream in(path);
+	std::stringstream contents;
+	contents << in.rdbuf();
+	return contents.str();
+}
+
+TEST(LatencyHistogramTest, ExactBelowSixteen) {
+	LatencyHistogram histogram;
+	for (uint64_t i = 1; i <= 10; i++) {
+		histogram.record(i);
+	}
+	EXPECT_EQ(histogram.getCount(), 10);
+	EXPECT_EQ(histogram.percentile(50), 5);
+	EXPECT_EQ(histogram.percentile(100), 10);
+	EXPECT_DOUBLE_EQ(histogram.mean(), 5.5);
+}
+
+TEST(LatencyHistogramTest, RelativePrecision) {
+	LatencyHistogram histogram;
+	for (uint64_t i = 1; i <= 100000; i++) {
+		histogram.record(i * 1000);
+	}
+	for (double p : {50.0, 90.0, 99.0, 99.9}) {
+		double exact = p / 100 * 100000 * 1000;
+		EXPECT_NEAR(histogram.percentile(p), exact, exact / 16) << "p" << p;
+	}
+	EXPECT_EQ(histogram.percentile(100), 100000000);
+	EXPECT_EQ(histogram.getMax(), 100000000);
+}
+
+TEST(LatencyHistogramTest, Empty) {
+	LatencyHistogram histogram;
+	EXPECT_EQ(histogram.percentile(99), 0);
+	EXPECT_EQ(histogram.mean(), 0);
+}
+
+TEST(TracerTest, DumpsChromeTraceAndHistograms) {
+	std::string path = testing::TempDir() + "ash_trace.json";
+	Tracer& tracer = Tracer::instance();
+	tracer.open(path.c_str());
+	ASSERT_TRUE(Tracer::enabled());
+	tracer.nextLine();
+	{
+		TRACE_SPAN(LINE);
+		Lexer lexer("ls -la | wc -l > out.txt");
+		Parser parser(lexer);
+		parser.parse();
+	}
+	EXPECT_EQ(tracer.histogram(Tracer::LEX).getCount(), 1);
+	EXPECT_EQ(tracer.histogram(Tracer::PARSE).getCount(), 1);
+	EXPECT_EQ(tracer.histogram(Tracer::LINE).getCount(), 1);
+	tracer.dump();
+
+	std::string json = readFile(path);
+	EXPECT_EQ(json.rfind("{\"traceEvents\":[", 0), 0);
+	EXPECT_NE(json.find("\"name\":\"lex\",\"ph\":\"X\""), std::string::npos);
+	EXPECT_NE(json.find("\"name\":\"parse\""), std::string::npos);
+	EXPECT_NE(json.find("\"args\":{\"line\":1}"), std::string::npos);
+	std::string histograms = readFile(path + ".hist");
+	EXPECT_EQ(histograms.rfind("phase", 0), 0);
+	EXPECT_NE(histograms.find("\nlex "), std::string::npos);
+	EXPECT_NE(histograms.find("\nline "), std::string::npos);
+	EXPECT_EQ(histograms.find("\nspawn "), std::string::npos);
+	unlink(path.c_str());
+	unlink((path + ".hist").c_str());
+}